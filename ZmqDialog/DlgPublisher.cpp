@@ -3,12 +3,12 @@
 #include <unistd.h>
 #include <readline/readline.h>
 #include <readline/history.h>
-#include <sys/time.h>
 
 
 #include <zmq.hpp>
 
 #include "DlgPublisher.h"
+#include "DlgTyped.h"
 #include "Config.h"
 #include "Debug.h"
 #include "DlgMessage.h"
@@ -22,6 +22,13 @@
 #include <random>
 
 
+//Payload of the demo: its latency comes from the header stamps
+struct demo_tick_t
+{
+  uint64_t sequence;
+};
+DLG_TYPED_MESSAGE(demo_tick_t)
+
 using namespace ZmqDialog;
 void USAGE(int argc, char* argv[])
 {
@@ -30,6 +37,9 @@ void USAGE(int argc, char* argv[])
   printf("    -d          - debug mode (all printouts)\n");
   printf("    -v          - verbose mode\n");
   printf("    -s          - silent mode (minimum printout)\n");
+  printf("    -c <file>   - ZMQ tuning and thread placement settings\n");
+  printf("    -a <addr>   - server address (default %s)\n", server_address);
+  printf("    -p <port>   - server port (default %d)\n", DLG_SERVER_TCP_PORT);
 }
 
 
@@ -39,14 +49,15 @@ void USAGE(int argc, char* argv[])
 int main(int argc, char* argv[])
 {
   DLG_DEBUG_LEVEL = DBG_LEVEL_DEFAULT;
-  if(argc != 2)
+  if(argc < 2)
     {
       USAGE(argc,argv);
       return 1;
     }
   int c = 0;
+  int port = DLG_SERVER_TCP_PORT;
 
-  while((c = getopt(argc,argv,"vsd")) != -1)
+  while((c = getopt(argc,argv,"vsdc:a:p:")) != -1)
     {
       switch (c)
 	{
@@ -59,6 +70,16 @@ int main(int argc, char* argv[])
 	case 'd':
 	  DLG_DEBUG_LEVEL = DBG_LEVEL_DEBUG;
 	  break;	  
+	case 'c':
+	  if(!ZMQ::LoadConfig(optarg))
+	    return 1;
+	  break;
+	case 'a':
+	  server_address = optarg;
+	  break;
+	case 'p':
+	  port = atoi(optarg);
+	  break;
 	default:
 	  fprintf(stderr,"Unknown option '-%c'.\n", optopt);
 	case '?':
@@ -70,7 +91,7 @@ int main(int argc, char* argv[])
 
   DlgPublisher Publisher("Publisher #1", "SomeService");
   char endpoint[256];
-  sprintf(endpoint, "%s:%d", server_address, DLG_SERVER_TCP_PORT);
+  sprintf(endpoint, "%s:%d", server_address, port);
   if (!Publisher.Connect(endpoint))
     {
       Print(DBG_LEVEL_ERROR,
@@ -85,6 +106,8 @@ int main(int argc, char* argv[])
             "Couldn't register publisher.\n");
       return 2;
   }
+  //subscribers measure the latency of every hop from the header stamps
+  Publisher.EnableTimestamps(true);
   
   char* line = NULL;
 
@@ -98,27 +121,11 @@ int main(int argc, char* argv[])
 	}
       if (strncmp(line, "publish", 7) == 0)
 	{
+	  TypedPublisher<demo_tick_t> typed(Publisher);
 	  for(size_t i = 0; i < 1000; ++i)
 	    {
-	      DlgMessage msg;
-	      if (!msg.SetMessageType(PUBLISH_BINARY_MESSAGE))
-		{
-		  Print(DBG_LEVEL_ERROR,"Couldn't set message type.\n");
-		  continue;
-		}
-	      timeval current_time;
-	      if (gettimeofday(&current_time, NULL) != 0)
-		{
-		  Print(DBG_LEVEL_DEBUG, "Get time of day error\n");
-		  continue;
-		}
-	      	
-	      if (!msg.SetMessageBuffer(&current_time, sizeof(current_time)))
-		{
-		  Print(DBG_LEVEL_ERROR,"Couldn't set message body.\n");
-		  continue;
-		}
-	      if (!Publisher.PublishMessage(&msg))
+	      demo_tick_t tick = { i };
+	      if (!typed.Publish(tick))
 		{
 		  Print(DBG_LEVEL_ERROR,"Couldn't publish message.\n");
 		  continue;
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+
+#include "DlgSchema.h"
+
+//Generator of Reader/Builder classes for payloads laid out by DlgSchema.h.
+//A schema file has messages of fields, one per line ('#' starts a comment):
+//
+//  message Quote 2          # name and version
+//    symbol  string  key    # routing key, a string or bytes field
+//    price   f64
+//    qty     u32
+//    venue   string  2      # added in version 2
+//  end
+//
+//Types: u8 u16 u32 u64 i8 i16 i32 i64 f32 f64 bool string bytes.
+//A field has the version it was added in (1 by default); fields are
+//appended, so a field can't come after one of a later version.
+//Offsets are named after the fields in upper case, beside ID, VERSION,
+//FIXED_SIZE and KEY_SLOT of the message: no field may be called so, and
+//field names need a lower case letter.
+
+using namespace ZmqDialog;
+
+struct field_t
+{
+  std::string name;
+  std::string type;
+  uint32_t    size;      // of the fixed part: a scalar or a slot
+  uint32_t    offset;
+  uint32_t    since;
+  bool        isKey;
+  bool        isVariable;
+};
+
+struct message_t
+{
+  std::string          name;
+  uint32_t             version;
+  std::vector<field_t> fields;
+  uint32_t             fixedSize;
+  uint32_t             nVariables;
+  std::string          key;
+};
+
+static const char* cpp_type(const std::string& type)
+{
+  static const char* types[][2] = {
+    { "u8", "uint8_t" }, { "u16", "uint16_t" }, { "u32", "uint32_t" }, { "u64", "uint64_t" },
+    { "i8", "int8_t" },  { "i16", "int16_t" },  { "i32", "int32_t" },  { "i64", "int64_t" },
+    { "f32", "float" },  { "f64", "double" },   { "bool", "bool" }
+  };
+  for(size_t i = 0; i < sizeof(types)/sizeof(types[0]); i++)
+    if(type == types[i][0])
+      return types[i][1];
+  return NULL;
+}
+
+static uint32_t type_size(const std::string& type)
+{
+  if(type == "string" || type == "bytes")
+    return SCHEMA_SLOT_SIZE;
+  if(type == "u8" || type == "i8" || type == "bool")
+    return 1;
+  if(type == "u16" || type == "i16")
+    return 2;
+  if(type == "u32" || type == "i32" || type == "f32")
+    return 4;
+  if(type == "u64" || type == "i64" || type == "f64")
+    return 8;
+  return 0;
+}
+
+static uint32_t schema_id(const std::string& name)
+{
+  uint32_t hash = 2166136261u;
+  for(size_t i = 0; i < name.size(); i++)
+    hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+  return hash;
+}
+
+static std::string upper(const std::string& str)
+{
+  std::string result(str);
+  for(size_t i = 0; i < result.size(); i++)
+    result[i] = toupper(result[i]);
+  return result;
+}
+
+//The constant of the field clashes with one of the message, another field
+//or its own accessor (a name in upper case)
+static bool is_reserved(const message_t& msg, const std::string& name)
+{
+  static const char* constants[] = { "ID", "VERSION", "FIXED_SIZE", "KEY_SLOT" };
+  std::string constant = upper(name);
+  if(constant == name)
+    return true;
+  for(size_t i = 0; i < sizeof(constants)/sizeof(constants[0]); i++)
+    if(constant == constants[i])
+      return true;
+  for(size_t i = 0; i < msg.fields.size(); i++)
+    if(constant == upper(msg.fields[i].name))
+      return true;
+  return false;
+}
+
+//__QUOTES_H__ of quotes.h or of quotes.schema
+static std::string include_guard(const char* fileName)
+{
+  std::string name(fileName);
+  size_t slash = name.rfind('/');
+  if(slash != std::string::npos)
+    name.erase(0, slash + 1);
+  size_t dot = name.find('.');
+  if(dot != std::string::npos)
+    name.erase(dot);
+  std::string guard("__");
+  for(size_t i = 0; i < name.size(); i++)
+    guard += isalnum((unsigned char)name[i]) ? toupper(name[i]) : '_';
+  return guard + "_H__";
+}
+
+//Offsets are given once and never change, new fields go after the old ones
+static bool layout(message_t& msg, int line)
+{
+  uint32_t offset = SCHEMA_PREFIX_SIZE;
+  uint32_t since  = 1;
+  msg.nVariables  = 0;
+  for(size_t i = 0; i < msg.fields.size(); i++)
+    {
+      field_t& f = msg.fields[i];
+      if(f.since < since || f.since > msg.version)
+	{
+	  fprintf(stderr, "line %d: field '%s' of %s has a wrong version %u.\n",
+		  line, f.name.c_str(), msg.name.c_str(), f.since);
+	  return false;
+	}
+      since = f.since;
+      //slots are aligned as their uint32_t
+      uint32_t align = f.isVariable ? 4 : f.size;
+      offset = (offset + align - 1) / align * align;
+      f.offset = offset;
+      offset += f.size;
+      if(f.isVariable)
+	msg.nVariables++;
+    }
+  msg.fixedSize = (offset + 7) / 8 * 8;
+  if(msg.fixedSize > 0xffff)
+    {
+      fprintf(stderr, "line %d: %s is too big.\n", line, msg.name.c_str());
+      return false;
+    }
+  return true;
+}
+
+static bool parse(const char* fileName, std::vector<message_t>& messages)
+{
+  std::ifstream in(fileName);
+  if(!in)
+    {
+      fprintf(stderr, "Couldn't open %s.\n", fileName);
+      return false;
+    }
+  std::string line;
+  int number = 0;
+  message_t* msg = NULL;
+  while(std::getline(in, line))
+    {
+      number++;
+      size_t comment = line.find('#');
+      if(comment != std::string::npos)
+	line.erase(comment);
+      std::istringstream words(line);
+      std::string first;
+      if(!(words >> first))
+	continue;
+      if(first == "message")
+	{
+	  if(msg)
+	    {
+	      fprintf(stderr, "line %d: 'end' of %s is missing.\n", number, msg->name.c_str());
+	      return false;
+	    }
+	  message_t m;
+	  m.version = 1;
+	  if(!(words >> m.name))
+	    {
+	      fprintf(stderr, "line %d: message without a name.\n", number);
+	      return false;
+	    }
+	  words >> m.version;
+	  messages.push_back(m);
+	  msg = &messages.back();
+	  continue;
+	}
+      if(!msg)
+	{
+	  fprintf(stderr, "line %d: '%s' is out of a message.\n", number, first.c_str());
+	  return false;
+	}
+      if(first == "end")
+	{
+	  if(!layout(*msg, number))
+	    return false;
+	  msg = NULL;
+	  continue;
+	}
+      field_t f;
+      f.name  = first;
+      f.since = 1;
+      f.isKey = false;
+      if(is_reserved(*msg, f.name))
+	{
+	  fprintf(stderr, "line %d: field name '%s' of %s is taken.\n", number, f.name.c_str(), msg->name.c_str());
+	  return false;
+	}
+      if(!(words >> f.type) || (f.size = type_size(f.type)) == 0)
+	{
+	  fprintf(stderr, "line %d: field '%s' has no known type.\n", number, f.name.c_str());
+	  return false;
+	}
+      f.isVariable = (f.type == "string" || f.type == "bytes");
+      std::string option;
+      while(words >> option)
+	{
+	  if(option == "key")
+	    f.isKey = true;
+	  else
+	    f.since = (uint32_t)atoi(option.c_str());
+	}
+      if(f.isKey && (!f.isVariable || !msg->key.empty()))
+	{
+	  fprintf(stderr, "line %d: the key of %s is one string or bytes field.\n", number, msg->name.c_str());
+	  return false;
+	}
+      if(f.isKey)
+	msg->key = f.name;
+      msg->fields.push_back(f);
+    }
+  if(msg)
+    {
+      fprintf(stderr, "'end' of %s is missing.\n", msg->name.c_str());
+      return false;
+    }
+  return true;
+}
+
+static void generate(FILE* out, const char* fileName, const char* headerName,
+		     const std::vector<message_t>& messages)
+{
+  std::string guard = include_guard(headerName);
+  fprintf(out, "//Generated by DlgSchema from %s, do not edit.\n", fileName);
+  fprintf(out, "#ifndef %s\n#define %s\n\n", guard.c_str(), guard.c_str());
+  fprintf(out, "#include \"DlgSchema.h\"\n\nnamespace ZmqDialog\n{\n");
+  for(size_t m = 0; m < messages.size(); m++)
+    {
+      const message_t& msg = messages[m];
+      fprintf(out, "\n  struct %s\n  {\n", msg.name.c_str());
+      fprintf(out, "    static constexpr uint32_t ID         = 0x%08xu;\n", schema_id(msg.name));
+      fprintf(out, "    static constexpr uint16_t VERSION    = %u;\n", msg.version);
+      fprintf(out, "    static constexpr uint32_t FIXED_SIZE = %u;\n", msg.fixedSize);
+      for(size_t i = 0; i < msg.fields.size(); i++)
+	fprintf(out, "    static constexpr uint32_t %-10s = %u;  // %s, version %u\n",
+		upper(msg.fields[i].name).c_str(), msg.fields[i].offset,
+		msg.fields[i].type.c_str(), msg.fields[i].since);
+      fprintf(out, "    static constexpr uint16_t KEY_SLOT   = %s;\n",
+	      msg.key.empty() ? "0" : upper(msg.key).c_str());
+
+      //Reader
+      fprintf(out, "\n    class Reader : public SchemaReader\n    {\n    public:\n");
+      fprintf(out, "      Reader(const void* data, size_t size) : SchemaReader(data, size, ID) {}\n");
+      fprintf(out, "      explicit Reader(DlgMessage* msg) : SchemaReader(msg, ID) {}\n\n");
+      for(size_t i = 0; i < msg.fields.size(); i++)
+	{
+	  const field_t& f = msg.fields[i];
+	  if(f.isVariable)
+	    fprintf(out, "      schema_bytes_t %s() const { return GetBytes(%s); }\n",
+		    f.name.c_str(), upper(f.name).c_str());
+	  else
+	    fprintf(out, "      %s %s() const { return Get<%s>(%s, %s()); }\n",
+		    cpp_type(f.type), f.name.c_str(), cpp_type(f.type), upper(f.name).c_str(), cpp_type(f.type));
+	}
+      fprintf(out, "    };\n");
+
+      //Builder
+      fprintf(out, "\n    class Builder : public SchemaBuilder<FIXED_SIZE, %u>\n    {\n    public:\n", msg.nVariables);
+      fprintf(out, "      Builder() : SchemaBuilder<FIXED_SIZE, %u>(ID, VERSION, KEY_SLOT)\n      {\n", msg.nVariables);
+      uint32_t index = 0;
+      for(size_t i = 0; i < msg.fields.size(); i++)
+	if(msg.fields[i].isVariable)
+	  fprintf(out, "        SetBytes(%u, %s, \"\", 0);\n", index++, upper(msg.fields[i].name).c_str());
+      fprintf(out, "      }\n\n");
+      index = 0;
+      for(size_t i = 0; i < msg.fields.size(); i++)
+	{
+	  const field_t& f = msg.fields[i];
+	  if(f.isVariable)
+	    {
+	      fprintf(out, "      Builder& %s(const void* data, uint32_t size) { SetBytes(%u, %s, data, size); return *this; }\n",
+		      f.name.c_str(), index, upper(f.name).c_str());
+	      fprintf(out, "      Builder& %s(const char* str) { return %s(str, (uint32_t)strlen(str)); }\n",
+		      f.name.c_str(), f.name.c_str());
+	      index++;
+	    }
+	  else
+	    fprintf(out, "      Builder& %s(%s value) { Set<%s>(%s, value); return *this; }\n",
+		    f.name.c_str(), cpp_type(f.type), cpp_type(f.type), upper(f.name).c_str());
+	}
+      fprintf(out, "    };\n  };\n");
+    }
+  fprintf(out, "\n} // namespace ZmqDialog\n\n#endif // %s\n", guard.c_str());
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc < 2)
+    {
+      printf("%s <schema> [header]\n", argv[0]);
+      printf("    writes Reader/Builder classes of the schema to header (stdout by default)\n");
+      return 1;
+    }
+  std::vector<message_t> messages;
+  if(!parse(argv[1], messages))
+    return 1;
+  FILE* out = argc > 2 ? fopen(argv[2], "w") : stdout;
+  if(!out)
+    {
+      fprintf(stderr, "Couldn't write %s.\n", argv[2]);
+      return 1;
+    }
+  generate(out, argv[1], argc > 2 ? argv[2] : argv[1], messages);
+  if(out != stdout)
+    fclose(out);
+  return 0;
+}
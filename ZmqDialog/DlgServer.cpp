@@ -8,6 +8,7 @@
 #include <zmq.hpp>
 
 #include "DlgServer.h"
+#include "BrokerWorker.h"
 #include "Config.h"
 #include "Debug.h"
 #include "ZmqDialog.h"
@@ -22,6 +23,32 @@ void USAGE(int argc, char* argv[])
   printf("    -d          - debug mode (all printouts)\n");
   printf("    -v          - verbose mode\n");
   printf("    -s          - silent mode (minimum printout)\n");
+  printf("    -c <file>   - ZMQ tuning and thread placement settings\n");
+  printf("    -a <addr>   - server address (default %s)\n", server_address);
+  printf("    -p <port>   - server port (default %d)\n", DLG_SERVER_TCP_PORT);
+  printf("    -w <server> - run as a broker worker of server (addr:port)\n");
+}
+
+//Broker worker process: runs brokers which the server places here
+static int run_worker(const char* server)
+{
+  char name[64];
+  sprintf(name, "worker-%d", (int)getpid());
+  BrokerWorker worker(name, server_address);
+  if(!worker.Connect(server))
+    return 1;
+  char* line = NULL;
+  while((line = readline("worker> ")) != NULL)
+    {
+      if(strncmp(line,"exit",4) == 0 || strncmp(line,"quit",4) == 0)
+	{
+	  free(line);
+	  break;
+	}
+      free(line);
+    }
+  worker.Stop();
+  return 0;
 }
 
 static const char* history_file_name = ".server.history";
@@ -29,13 +56,15 @@ static const char* history_file_name = ".server.history";
 int main(int argc, char* argv[])
 {
   DLG_DEBUG_LEVEL = DBG_LEVEL_DEFAULT;
-  if(argc != 2)
+  if(argc < 2)
     {
       USAGE(argc,argv);
       return 1;
     }
   int c = 0;
-  while((c = getopt(argc,argv,"vsd")) != -1)
+  int port = DLG_SERVER_TCP_PORT;
+  const char* workerOf = NULL;
+  while((c = getopt(argc,argv,"vsdc:a:p:w:")) != -1)
     {
       switch (c)
 	{
@@ -48,6 +77,19 @@ int main(int argc, char* argv[])
 	case 'd':
 	  DLG_DEBUG_LEVEL = DBG_LEVEL_DEBUG;
 	  break;	  
+	case 'c':
+	  if(!ZMQ::LoadConfig(optarg))
+	    return 1;
+	  break;
+	case 'a':
+	  server_address = optarg;
+	  break;
+	case 'p':
+	  port = atoi(optarg);
+	  break;
+	case 'w':
+	  workerOf = optarg;
+	  break;
 	default:
 	  fprintf(stderr,"Unknown option '-%c'.\n", optopt);
 	case '?':
@@ -55,8 +97,10 @@ int main(int argc, char* argv[])
 	  return 1;
 	}
     }
+  if(workerOf)
+    return run_worker(workerOf);
   Print(DBG_LEVEL_DEBUG, "Dlg Server is starting with option '%s'...\n",argv[1]);
-  DlgServer server;
+  DlgServer server(server_address, port);
   server.Start();
   read_history(history_file_name);
   char* line = NULL;
@@ -69,6 +113,18 @@ int main(int argc, char* argv[])
 	  Print(DBG_LEVEL_DEBUG,"Command \'%s\' is received.\n",line);
 	  break;
 	}
+      if(strncmp(line,"placement",9) == 0)
+	Affinity::PrintReport();
+      //peer <address:port> - federate with another server
+      if(strncmp(line,"peer ",5) == 0)
+	server.AddPeer(std::string(line + 5));
+      if(strncmp(line,"peers",5) == 0)
+	server.PrintPeers();
+      if(strncmp(line,"workers",7) == 0)
+	server.PrintWorkers();
+      //counters of the server and its brokers, see DlgServer::RequestStats()
+      if(strncmp(line,"stats",5) == 0)
+	server.PrintStats();
       free(line);
     }
   write_history(history_file_name);
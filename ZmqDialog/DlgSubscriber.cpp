@@ -3,11 +3,11 @@
 #include <unistd.h>
 #include <readline/readline.h>
 #include <readline/history.h>
-#include <sys/time.h>
 
 #include <zmq.hpp>
 
 #include "DlgSubscriber.h"
+#include "DlgTyped.h"
 #include "Config.h"
 #include "Debug.h"
 #include "DlgMessage.h"
@@ -17,6 +17,13 @@
 
 #include <ctime>
 
+//Payload of the demo: its latency comes from the header stamps
+struct demo_tick_t
+{
+  uint64_t sequence;
+};
+DLG_TYPED_MESSAGE(demo_tick_t)
+
 using namespace ZmqDialog;
 void USAGE(int argc, char* argv[])
 {
@@ -25,6 +32,9 @@ void USAGE(int argc, char* argv[])
   printf("    -d          - debug mode (all printouts)\n");
   printf("    -v          - verbose mode\n");
   printf("    -s          - silent mode (minimum printout)\n");
+  printf("    -c <file>   - ZMQ tuning and thread placement settings\n");
+  printf("    -a <addr>   - server address (default %s)\n", server_address);
+  printf("    -p <port>   - server port (default %d)\n", DLG_SERVER_TCP_PORT);
 }
 
 
@@ -37,14 +47,15 @@ void some_loop(void*);
 int main(int argc, char* argv[])
 {
   DLG_DEBUG_LEVEL = DBG_LEVEL_DEFAULT;
-  if(argc != 2)
+  if(argc < 2)
     {
       USAGE(argc,argv);
       return 1;
     }
   int c = 0;
+  int port = DLG_SERVER_TCP_PORT;
 
-  while((c = getopt(argc,argv,"vsd")) != -1)
+  while((c = getopt(argc,argv,"vsdc:a:p:")) != -1)
     {
       switch (c)
 	{
@@ -57,6 +68,16 @@ int main(int argc, char* argv[])
 	case 'd':
 	  DLG_DEBUG_LEVEL = DBG_LEVEL_DEBUG;
 	  break;	  
+	case 'c':
+	  if(!ZMQ::LoadConfig(optarg))
+	    return 1;
+	  break;
+	case 'a':
+	  server_address = optarg;
+	  break;
+	case 'p':
+	  port = atoi(optarg);
+	  break;
 	default:
 	  fprintf(stderr,"Unknown option '-%c'.\n", optopt);
 	case '?':
@@ -69,7 +90,7 @@ int main(int argc, char* argv[])
 
   DlgSubscriber tempSub("Subscriber #1", "SomeService");
   char endpoint[256];
-  sprintf(endpoint, "%s:%d", server_address, DLG_SERVER_TCP_PORT);
+  sprintf(endpoint, "%s:%d", server_address, port);
   if (!tempSub.Connect(endpoint))
     {
       Print(DBG_LEVEL_ERROR,"Couldn't connect to server.\n");
@@ -93,6 +114,15 @@ int main(int argc, char* argv[])
 	  Print(DBG_LEVEL_DEBUG,"Command \'%s\' is received.\n",line);
 	  break;
 	}
+      //percentiles of every hop of the messages taken so far
+      if(strncmp(line,"latency",7) == 0)
+	for (int i = 0; i < N_LATENCY_HOPS; i++)
+	  {
+	    latency_summary_t l = tempSub.GetLatency((LatencyHop)i).GetSummary();
+	    Print(DBG_LEVEL_INFO, "%-16s %8llu msgs  p50 %9.1fus  p99 %9.1fus  p99.9 %9.1fus  max %9.1fus\n",
+		  LatencyHopName((LatencyHop)i), (unsigned long long)l.count,
+		  l.p50/1000.0, l.p99/1000.0, l.p999/1000.0, l.max/1000.0);
+	  }
       free(line);
     }
   subthread->join();
@@ -105,51 +135,27 @@ void some_loop(void *param)
 {	    
   Print(DBG_LEVEL_DEBUG, "Start of some_loop function\n");
   DlgSubscriber *sub = static_cast<DlgSubscriber*>(param);
+  std::vector<DlgMessage*> messages;
   while(thread_run)
     {
-      if (sub->HasData())
+      //sleeps while there is nothing to read, wakes up to check thread_run
+      if (!sub->WaitMessage(TIMEOUT_INTERVAL))
+	continue;
+      messages.clear();
+      sub->ExtractMessages(messages, 64);
+      for (size_t i = 0; i < messages.size(); i++)
 	{
-	  DlgMessage *msg = nullptr;
-      if (!sub->ExtractMessage(msg))
-	    {
-          Print(DBG_LEVEL_DEBUG, "Couldn't extract message from subscriber\n");
-	      continue;
-	    }
-
-	  timeval* receive_time = nullptr;
-	  void *buf = nullptr;
-	  size_t size = 0;
-	  if (msg->GetMessageBuffer(buf, size))
-	    {
-	      Print(DBG_LEVEL_DEBUG, "Binary message received with size %u.\n", size);
-	      buf = operator new(size);
-	      if (msg->GetMessageBuffer(buf, size))
-		{
-		  receive_time = static_cast<timeval*>(buf);
-		}
-	      else
-		{
-		  Print(DBG_LEVEL_DEBUG, "Couldn't get binary data.\n");
-		  operator delete(buf);
-		  continue;
-		}
-	    }
-	  else
-	    {
-	      Print(DBG_LEVEL_DEBUG, "Couldn't get binary message.\n");
-	      continue;
-	    }
-	 timeval current_time;
-	  if (gettimeofday(&current_time, NULL) != 0)
+	  DlgMessage *msg = messages[i];
+	  const demo_tick_t *tick = TypedSubscriber<demo_tick_t>::View(msg);
+	  if (!tick)
 	    {
-	      Print(DBG_LEVEL_DEBUG, "Get time of day error\n");
-	      operator delete(buf);
+	      Print(DBG_LEVEL_DEBUG, "Message isn't a demo_tick_t.\n");
+	      delete msg;
 	      continue;
 	    }
-	  timeval res;
-	  timersub(&current_time, receive_time, &res);
-	  Print(DBG_LEVEL_DEBUG,"Time elapsed: %lus   %luus\n", res.tv_sec, res.tv_usec);
-	  operator delete(buf);
+	  //latency comes from the header stamps, see the 'latency' command
+	  Print(DBG_LEVEL_DEBUG,"Tick #%lu\n", (unsigned long)tick->sequence);
+	  delete msg;
 	}
     } 
   Print(DBG_LEVEL_DEBUG, "End of some_loop function\n");
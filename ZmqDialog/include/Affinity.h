@@ -0,0 +1,61 @@
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+namespace ZmqDialog
+{
+
+  enum ThreadRole
+  {
+    THREAD_SERVER  = 0, // DlgServer main thread
+    THREAD_BROKER  = 1, // aBroker threads
+    THREAD_CLIENT  = 2, // DlgPublisher/DlgSubscriber threads
+    THREAD_ZMQ_IO  = 3, // I/O threads of the ZMQ context
+    N_THREAD_ROLES = 4
+  };
+
+  ////**********************************************************////
+  ////                     Affinity class                       ////
+  ////**********************************************************////
+
+  //CPU sets are configured at start up, before ZMQ::Instance() is called
+  //and before servers and clients are created. Every thread of a role is
+  //pinned to the next CPU of its set (round robin) and allocates memory
+  //from its local NUMA node, so queues and messages it creates stay local.
+  class Affinity
+  {
+    struct placement_t
+    {
+      std::string name;
+      int         cpu;
+      int         node;
+      bool        isPinned;
+    };
+
+    static std::vector<int>         m_cpus[N_THREAD_ROLES];
+    static std::atomic<unsigned>    m_next[N_THREAD_ROLES];
+    static std::vector<placement_t> m_placements;
+    static std::mutex               m_mutex;
+  public:
+    //cpuList is like "0-3,8,10-11", empty list removes the setting
+    static bool SetCpus(ThreadRole role, const std::string& cpuList);
+    static bool SetCpus(ThreadRole role, const std::vector<int>& cpus);
+    static const std::vector<int>& GetCpus(ThreadRole role) { return m_cpus[role]; }
+
+    //Pins the calling thread and makes its allocations node local
+    static bool Apply(ThreadRole role, const std::string& name);
+
+    static int  CurrentCpu();
+    static int  NodeOfCpu(int cpu);
+
+    //Where every thread has landed
+    static void PrintReport();
+  };
+
+} // namespace ZmqDialog
+
+#endif // __AFFINITY_H__
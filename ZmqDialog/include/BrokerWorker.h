@@ -0,0 +1,62 @@
+#ifndef __BROKER_WORKER_H__
+#define __BROKER_WORKER_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <map>
+#include <vector>
+#include <thread>
+
+#include <zmq.hpp>
+#include "DlgServer.h"
+
+namespace ZmqDialog
+{
+
+  ////**********************************************************////
+  ////                   BrokerWorker class                     ////
+  ////**********************************************************////
+
+  //A process which runs brokers for DlgServer, so that hot services don't
+  //share one process's allocator, ZMQ context and scheduler. DlgServer
+  //places services on workers by consistent hashing and moves a service
+  //away from a worker whose load crosses its threshold.
+  class BrokerWorker
+  {
+    struct retired_t
+    {
+      aBroker* broker;
+      int64_t  deleteAt;   // usecs
+    };
+
+    std::string                     m_name;
+    std::string                     m_address;   // brokers bind here
+    std::string                     m_server;
+    zmq::socket_t*                  m_socket;    // DEALER to the server
+    std::thread*                    m_thread;
+    volatile bool                   m_isRunning;
+    std::map<std::string, aBroker*> m_brokers;
+    std::map<std::string, uint64_t> m_reported;  // published messages at the last report
+    std::vector<retired_t>          m_retired;   // moved brokers which still drain
+  public:
+    BrokerWorker(const std::string& name, const char* address = server_address);
+    ~BrokerWorker();
+
+    //server is address:port of DlgServer
+    bool Connect(const std::string& server);
+    void Stop();
+
+  private:
+    void worker_thread();
+    void send_load(int64_t elapsed);
+    void delete_retired(int64_t now);
+    static const message_registry_t<BrokerWorker>& handlers();
+
+    bool create_broker(DlgMessage *msg);
+    bool move_broker(DlgMessage *msg);
+  };
+
+} // namespace ZmqDialog
+
+#endif // __BROKER_WORKER_H__
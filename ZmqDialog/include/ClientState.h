@@ -0,0 +1,98 @@
+#ifndef __CLIENT_STATE_H__
+#define __CLIENT_STATE_H__
+
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include <atomic>
+
+#include "Debug.h"
+
+namespace ZmqDialog
+{
+
+  //Where the thread of a DlgPublisher or a DlgSubscriber is
+  enum ClientState
+  {
+    CLIENT_DISCONNECTED = 0, // no socket, the thread sleeps until Connect()
+    CLIENT_HANDSHAKE    = 1, // connected, waiting for the server or the broker
+    CLIENT_CONNECTED    = 2, // registered at the broker (or a direct peer)
+    CLIENT_DRAINING     = 3  // the object is destroyed, the thread ends
+  };
+
+  inline const char* ClientStateName(ClientState state)
+  {
+    switch (state)
+      {
+      case CLIENT_DISCONNECTED: return "disconnected";
+      case CLIENT_HANDSHAKE:    return "handshake";
+      case CLIENT_CONNECTED:    return "connected";
+      case CLIENT_DRAINING:     return "draining";
+      }
+    return "unknown";
+  }
+
+  ////**********************************************************////
+  ////                     wakeup_t class                       ////
+  ////**********************************************************////
+
+  //An eventfd polled by a client thread next to its sockets (zmq::poll
+  //takes plain descriptors). Signal() always wakes the thread, Notify()
+  //only if it is asleep, which keeps the eventfd off the hot path:
+  //
+  //  wakeup.Sleep();                  //  push(item);
+  //  if (nothing to do) poll(...);    //  wakeup.Notify();
+  //  wakeup.Awake(revents);
+  class wakeup_t
+  {
+    int               m_fd;
+    std::atomic<bool> m_isSleeping;
+  public:
+    wakeup_t() : m_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), m_isSleeping(false)
+    {
+      if (m_fd < 0)
+        Print(DBG_LEVEL_ERROR, "wakeup_t: eventfd() failed: %s\n", strerror(errno));
+    }
+    ~wakeup_t() { if (m_fd >= 0) close(m_fd); }
+
+    int Fd() const { return m_fd; }
+
+    void Signal()
+    {
+      uint64_t one = 1;
+      if (write(m_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        Print(DBG_LEVEL_ERROR, "wakeup_t::Signal(): %s\n", strerror(errno));
+    }
+
+    void Notify()
+    {
+      if (m_isSleeping.exchange(false))
+        Signal();
+    }
+
+    //Called by the thread before it checks for work for the last time
+    void Sleep()
+    {
+      m_isSleeping = true;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void Awake(bool isSignaled)
+    {
+      m_isSleeping = false;
+      uint64_t count = 0;
+      if (isSignaled && read(m_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        Print(DBG_LEVEL_ERROR, "wakeup_t::Awake(): %s\n", strerror(errno));
+    }
+
+  private:
+    wakeup_t(const wakeup_t&);
+    wakeup_t& operator=(const wakeup_t&);
+  };
+
+} // namespace ZmqDialog
+
+#endif // __CLIENT_STATE_H__
@@ -10,6 +10,50 @@ namespace ZmqDialog
 #define DLG_SERVER_TCP_PORT         55550
 #define TIMEOUT_INTERVAL            2500000
 #define HEARTBEAT_INTERVAL          2500000 // usecs
+#define DLG_ZMQ_IO_THREADS          1       // default, see ZMQ::SetIOThreads()
+#define MAX_CONFIG_LINE_LENGTH      1024
+
+// Priority lanes
+#define PRIORITY_WEIGHT_HIGH        8       // messages per weighted round
+#define PRIORITY_WEIGHT_NORMAL      4
+#define PRIORITY_WEIGHT_LOW         1
+#define BROKER_MAX_RECV_BATCH       256     // messages read per broker cycle
+#define BROKER_MAX_SEND_BATCH       64      // messages fanned out per broker cycle
+
+// Credit based flow control
+#define SUBSCRIBER_CREDIT_MESSAGES  1000    // window granted by subscriber (<= ZMQ SNDHWM)
+#define SUBSCRIBER_CREDIT_BYTES     0       // bytes window, 0 - unlimited
+#define BROKER_MAX_PENDING          10000   // messages waiting for credit per subscriber
+#define SUBSCRIBER_QUEUE_CAPACITY   4096    // ring size per priority, see DlgSubscriber::SetQueue()
+#define SUBSCRIBER_SEND_QUEUE       1024    // replies waiting for the subscriber thread
+#define FLOW_CONTROL_INTERVAL       10000   // usecs, how often consumed credit is returned
+#define DIRECTORY_CACHE_TIMEOUT     500000  // usecs, a cached broker must answer in this time
+
+// Publisher batching
+#define PUBLISHER_BATCH_BYTES       65536   // batch is sent when it grows to this size
+#define PUBLISHER_BATCH_DELAY       50      // usecs a batch collects messages, an idle thread waits a whole msec
+#define PUBLISHER_QUEUE_CAPACITY    8192    // messages waiting for the publisher thread
+#define PUBLISHER_MAX_SEND_BATCH    256     // messages sent per publisher thread cycle
+#define PUBLISHER_HANDLE_POOL       64      // messages built up front by DlgPublisher::Prepare()
+#define REQUEST_TIMEOUT             5000000 // usecs, DlgPublisher::Request() gives up on a reply
+
+// Statistics (DlgStats.h)
+#define STATS_REQUEST_TIMEOUT       1000000 // usecs, DlgServer::RequestStats() waits this long
+
+// Latency timestamps (Latency.h)
+#define LATENCY_CLOCK_TSC           0       // 1 - TSC instead of CLOCK_MONOTONIC (x86, invariant TSC)
+
+// Message type registry (MessageRegistry.h)
+#define MESSAGE_TYPE_MAX            256     // types are indices of handler tables
+
+// Handler dispatch of subscribers
+#define DISPATCH_THREADS            2       // default size of DlgDispatcher pool
+#define DISPATCH_MAX_BATCH          64      // messages passed to a batch handler at once
+
+// Broker worker processes
+#define WORKER_VIRTUAL_NODES        64      // points of a worker on the hash ring
+#define WORKER_LOAD_THRESHOLD       100000  // messages/sec, a hotter worker gives a service away
+#define BROKER_DRAIN_TIME           5000000 // usecs, a moved broker lives this long
 }
 
 #endif
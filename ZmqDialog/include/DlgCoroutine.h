@@ -0,0 +1,298 @@
+#ifndef __DLG_COROUTINE_H__
+#define __DLG_COROUTINE_H__
+
+//Optional C++20 interface over DlgSubscriber and DlgPublisher. The library
+//itself is C++11, this header is empty unless the compiler has coroutines.
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "DlgPublisher.h"
+#include "DlgSubscriber.h"
+
+namespace ZmqDialog
+{
+
+  ////**********************************************************////
+  ////                     DlgTask class                        ////
+  ////**********************************************************////
+
+  //Coroutine started by DlgExecutor::Spawn(), it frees itself when it returns:
+  //
+  //  DlgTask consume(AsyncSubscriber& sub)
+  //  {
+  //    while (DlgMessage* msg = co_await sub.Next())
+  //      { ...; delete msg; }
+  //  }
+  //  executor.Spawn(consume(sub));
+  class DlgTask
+  {
+  public:
+    struct promise_type
+    {
+      DlgTask get_return_object()
+      {
+        return DlgTask(std::coroutine_handle<promise_type>::from_promise(*this));
+      }
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      std::suspend_never  final_suspend() noexcept   { return {}; }
+      void return_void() {}
+      void unhandled_exception()
+      {
+        Print(DBG_LEVEL_ERROR, "DlgTask: unhandled exception, the task is finished.\n");
+      }
+    };
+
+    DlgTask(DlgTask&& task) noexcept : m_handle(task.m_handle) { task.m_handle = nullptr; }
+    DlgTask(const DlgTask&) = delete;
+    DlgTask& operator=(const DlgTask&) = delete;
+    //a task which was never spawned
+    ~DlgTask() { if (m_handle) m_handle.destroy(); }
+
+    std::coroutine_handle<> Release()
+    {
+      std::coroutine_handle<> handle = m_handle;
+      m_handle = nullptr;
+      return handle;
+    }
+
+  private:
+    explicit DlgTask(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+    std::coroutine_handle<promise_type> m_handle;
+  };
+
+
+  ////**********************************************************////
+  ////                    DlgExecutor class                     ////
+  ////**********************************************************////
+
+  //A few threads resume the coroutines of any number of AsyncSubscriber and
+  //AsyncPublisher objects. A coroutine waiting for a message holds no thread.
+  class DlgExecutor
+  {
+    std::vector<std::thread>             m_threads;
+    std::deque<std::coroutine_handle<> > m_ready;
+    std::mutex                           m_mutex;
+    std::condition_variable              m_condition;
+    bool                                 m_isRunning;
+
+  public:
+    explicit DlgExecutor(size_t nThreads = 1) : m_isRunning(true)
+    {
+      for (size_t i = 0; i < (nThreads ? nThreads : 1); i++)
+        m_threads.push_back(std::thread(&DlgExecutor::run, this));
+    }
+    ~DlgExecutor() { Stop(); }
+
+    DlgExecutor(const DlgExecutor&) = delete;
+    DlgExecutor& operator=(const DlgExecutor&) = delete;
+
+    void Post(std::coroutine_handle<> handle)
+    {
+      m_mutex.lock();
+      m_ready.push_back(handle);
+      m_mutex.unlock();
+      m_condition.notify_one();
+    }
+
+    void Spawn(DlgTask task) { Post(task.Release()); }
+
+    //Coroutines which haven't returned yet stay suspended
+    void Stop()
+    {
+      m_mutex.lock();
+      m_isRunning = false;
+      m_mutex.unlock();
+      m_condition.notify_all();
+      for (size_t i = 0; i < m_threads.size(); i++)
+        if (m_threads[i].joinable())
+          m_threads[i].join();
+      m_threads.clear();
+    }
+
+    //co_await executor.Schedule() goes on in a thread of the executor
+    auto Schedule()
+    {
+      struct awaiter_t
+      {
+        DlgExecutor* executor;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { executor->Post(handle); }
+        void await_resume() const noexcept {}
+      };
+      return awaiter_t{ this };
+    }
+
+  private:
+    void run()
+    {
+      while (true)
+        {
+          std::unique_lock<std::mutex> lock(m_mutex);
+          m_condition.wait(lock, [this] { return !m_isRunning || !m_ready.empty(); });
+          if (!m_isRunning)
+            return;
+          std::coroutine_handle<> handle = m_ready.front();
+          m_ready.pop_front();
+          lock.unlock();
+          handle.resume();
+        }
+    }
+  };
+
+
+  ////**********************************************************////
+  ////                  AsyncSubscriber class                   ////
+  ////**********************************************************////
+
+  //co_await Next() gives the next message of the subscriber (the caller owns
+  //it), or nullptr after Close(). One coroutine consumes a subscriber.
+  class AsyncSubscriber
+  {
+    //shared with the notify hook, which may outlive this object for a while
+    struct state_t
+    {
+      DlgSubscriber*          subscriber;
+      DlgExecutor*            executor;
+      std::mutex              mutex;
+      std::coroutine_handle<> waiter;
+      bool                    isClosed;
+    };
+    std::shared_ptr<state_t> m_state;
+
+    //a late notify of a message which was extracted already doesn't wake it
+    static void wake(const std::shared_ptr<state_t>& state)
+    {
+      std::coroutine_handle<> waiter;
+      state->mutex.lock();
+      if (state->waiter && (state->isClosed || state->subscriber->HasData()))
+        std::swap(waiter, state->waiter);
+      state->mutex.unlock();
+      if (waiter)
+        state->executor->Post(waiter);
+    }
+
+  public:
+    AsyncSubscriber(DlgSubscriber& subscriber, DlgExecutor& executor) : m_state(new state_t)
+    {
+      m_state->subscriber = &subscriber;
+      m_state->executor   = &executor;
+      m_state->isClosed   = false;
+      std::shared_ptr<state_t> state = m_state;
+      subscriber.SetNotify([state] { wake(state); });
+    }
+    ~AsyncSubscriber()
+    {
+      m_state->subscriber->SetNotify(nullptr);
+      Close();
+    }
+
+    AsyncSubscriber(const AsyncSubscriber&) = delete;
+    AsyncSubscriber& operator=(const AsyncSubscriber&) = delete;
+
+    void Close()
+    {
+      m_state->mutex.lock();
+      m_state->isClosed = true;
+      m_state->mutex.unlock();
+      wake(m_state);
+    }
+
+    auto Next()
+    {
+      struct awaiter_t
+      {
+        std::shared_ptr<state_t> state;
+        DlgMessage*              msg;
+
+        bool extract()
+        {
+          return state->subscriber->HasData() && state->subscriber->ExtractMessage(msg);
+        }
+        bool await_ready() { return extract(); }
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+          std::lock_guard<std::mutex> lock(state->mutex);
+          if (state->isClosed || state->subscriber->HasData())
+            return false;
+          state->waiter = handle;
+          return true;
+        }
+        DlgMessage* await_resume()
+        {
+          if (!msg)
+            extract();
+          return msg;
+        }
+      };
+      return awaiter_t{ m_state, nullptr };
+    }
+  };
+
+
+  ////**********************************************************////
+  ////                  AsyncPublisher class                    ////
+  ////**********************************************************////
+
+  class AsyncPublisher
+  {
+    DlgPublisher& m_publisher;
+    DlgExecutor&  m_executor;
+
+  public:
+    AsyncPublisher(DlgPublisher& publisher, DlgExecutor& executor)
+      : m_publisher(publisher), m_executor(executor) {}
+
+    //PublishMessage() only queues the message for the publisher's thread,
+    //so the coroutine isn't suspended
+    auto Publish(DlgMessage* msg)
+    {
+      struct awaiter_t
+      {
+        bool isPublished;
+        bool await_ready() const noexcept { return true; }
+        void await_suspend(std::coroutine_handle<>) const noexcept {}
+        bool await_resume() const noexcept { return isPublished; }
+      };
+      return awaiter_t{ m_publisher.PublishMessage(msg) };
+    }
+
+    //Resumes in the executor with the reply (the caller owns it), nullptr if
+    //the request failed, timed out or the service has no subscriber
+    auto Request(DlgMessage* msg)
+    {
+      struct awaiter_t
+      {
+        AsyncPublisher* publisher;
+        DlgMessage*     request;
+        DlgMessage*     reply;
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+          DlgExecutor* executor = &publisher->m_executor;
+          awaiter_t* self = this;
+          //the reply may come before Request() returns, this isn't used after it
+          return publisher->m_publisher.Request(request, [self, executor, handle](DlgMessage* msg)
+                                                {
+                                                  self->reply = msg;
+                                                  executor->Post(handle);
+                                                });
+        }
+        DlgMessage* await_resume() const noexcept { return reply; }
+      };
+      return awaiter_t{ this, msg, nullptr };
+    }
+  };
+
+} // namespace ZmqDialog
+
+#endif // __cpp_impl_coroutine
+
+#endif // __DLG_COROUTINE_H__
@@ -0,0 +1,69 @@
+#ifndef __DLG_DISPATCHER_H__
+#define __DLG_DISPATCHER_H__
+
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "Config.h"
+#include "DlgMessage.h"
+
+namespace ZmqDialog
+{
+
+  ////**********************************************************////
+  ////                   DlgDispatcher class                    ////
+  ////**********************************************************////
+
+  //Pool of threads calling message handlers of subscribers, so that an
+  //application needs neither a polling thread per subscriber nor its queue.
+  //Every subscription is a strand: its messages are handled in the order
+  //they came, by one thread of the pool at a time. A strand gives its
+  //thread away after each batch, so a busy subscription doesn't starve others.
+  class DlgDispatcher
+  {
+  public:
+    //Owns the messages, they are deleted or kept by the handler
+    typedef std::function<void(std::vector<DlgMessage*>&)> batch_handler_t;
+
+    struct strand_t
+    {
+      batch_handler_t         handler;
+      size_t                  maxBatch;
+      std::deque<DlgMessage*> messages;
+      bool                    isScheduled;  // in the ready queue or handled now
+      bool                    isHandled;
+      bool                    isDetached;
+    };
+
+  private:
+    std::vector<std::thread*>                m_threads;
+    std::deque<std::shared_ptr<strand_t> >   m_ready;
+    std::mutex                               m_mutex;
+    std::condition_variable                  m_condition;
+    std::condition_variable                  m_handled;   // Detach() waits here
+    bool                                     m_isRunning;
+  public:
+    explicit DlgDispatcher(size_t nThreads = DISPATCH_THREADS);
+    ~DlgDispatcher();
+
+    std::shared_ptr<strand_t> Attach(const batch_handler_t& handler, size_t maxBatch = DISPATCH_MAX_BATCH);
+    //Drops the queued messages and waits for the running handler to return,
+    //so it must not be called from a handler of the same strand
+    void Detach(const std::shared_ptr<strand_t>& strand);
+    void Post(const std::shared_ptr<strand_t>& strand, DlgMessage* msg);
+
+    size_t GetThreadCount() const { return m_threads.size(); }
+  private:
+    void dispatch_thread();
+  };
+
+} // namespace ZmqDialog
+
+#endif // __DLG_DISPATCHER_H__
@@ -42,9 +42,40 @@ namespace ZmqDialog {
     bool Send(zmq::socket_t* socket);
   };
 
+  //DlgHeader timestamps of a message flagged HEADER_FLAG_TIMED, ticks of
+  //latency_clock_t (see Latency.h), 0 - not stamped at that point
+  const int STAMP_PUBLISH    = 0; // DlgPublisher, when the message is posted
+  const int STAMP_BROKER_IN  = 1; // queued by the broker
+  const int STAMP_BROKER_OUT = 2; // taken from the queue for fan-out
+  const int STAMP_DEQUEUE    = 3; // extracted from DlgSubscriber by the application
+  const int N_STAMPS         = 4;
+
+  //Fixed-size binary header carried in the last frame of DlgMessage.
+  //New fields are appended to the end of the structure.
+  struct DlgHeader
+  {
+    uint32_t priority;
+    uint32_t flags;
+    uint64_t epoch;      // directory epoch of a broker (control messages)
+    uint64_t correlation;// matches a reply to its request
+    uint64_t fingerprint;// type of a typed body (see DlgTyped.h), 0 - untyped
+    uint64_t stamps[N_STAMPS];
+    uint64_t host;       // latency_clock_t::HostId() of the stamps, 0 - untimed
+  };
+
+  //DlgHeader flags
+  const uint32_t HEADER_FLAG_FORWARDED       = 1; // came from a broker of another server
+  const uint32_t HEADER_FLAG_JOIN_BROKER     = 2; // reply: repeat the request at the broker
+  const uint32_t HEADER_FLAG_NO_RESPONDER    = 4; // reply: nobody subscribes to the service
+  const uint32_t HEADER_FLAG_SCHEMA          = 8; // body is laid out by a schema (DlgSchema.h)
+  const uint32_t HEADER_FLAG_TIMED           = 16; // stamps are taken on the way (DlgPublisher::EnableTimestamps)
+
+  class DlgBatch;
+
   class DlgMessage : protected message_array_t
   {
-    const size_t N_FIELDS = 5;
+    const size_t N_FIELDS = 6;
+    friend class DlgBatch;
   public:
     DlgMessage();
     DlgMessage(const std::string& name, const std::string& from, const std::string& to, 
@@ -57,7 +88,14 @@ namespace ZmqDialog {
     bool GetMessageType(uint32_t& msgType);
     bool GetMessageBody(std::string& body);
     bool GetMessageBuffer(void* buf, size_t& size);
+    //The body where it is, nullptr on a bad message. Valid while the message
+    //isn't changed; the frame storage is aligned as operator new aligns it.
+    const void* GetMessageData(size_t& size);
     bool GetIdentity(std::string& identity);
+    bool GetHeader(DlgHeader& header);
+    bool GetPriority(uint32_t& priority);
+    bool GetEpoch(uint64_t& epoch);
+    bool GetCorrelation(uint64_t& correlation);
 
     bool SetServiceName(const std::string& name);
     bool SetFromAddress(const std::string& address);
@@ -65,8 +103,16 @@ namespace ZmqDialog {
     bool SetMessageType(uint32_t msgType);
     bool SetMessageBody(const std::string& body);
     bool SetMessageBuffer(void* buf, size_t size);
+    //Body of size bytes to be filled by the caller, nullptr on a bad message.
+    //The frame keeps its storage, so a reused message doesn't allocate.
+    void* PrepareMessageBuffer(size_t size);
     bool SetIdentity(const std::string &identity);
+    bool SetHeader(const DlgHeader& header);
+    bool SetPriority(uint32_t priority);
+    bool SetEpoch(uint64_t epoch);
+    bool SetCorrelation(uint64_t correlation);
   
+    size_t           GetSize() const;
     message_array_t* GetMessageArray()           { return (message_array_t*)this;          }    
     bool             Recv(zmq::socket_t* socket) { return GetMessageArray()->Recv(socket); }
     bool             Send(zmq::socket_t* socket) { return GetMessageArray()->Send(socket); }
@@ -79,6 +125,73 @@ namespace ZmqDialog {
   const uint32_t SUBSCRIBE_TO_SERVICE        = 3;
   const uint32_t REGISTER_PUBLISHER          = 4;
   const uint32_t SUCCESS                     = 5;  
+  const uint32_t GRANT_CREDIT                = 6;
+  const uint32_t PUBLISH_BATCH_MESSAGE       = 7;
+  //Brokerless mode: DlgServer only keeps the directory of publishers' endpoints
+  const uint32_t REGISTER_DIRECT_PUBLISHER   = 8;
+  const uint32_t SUBSCRIBE_DIRECT            = 9;
+  const uint32_t DIRECT_PUBLISHERS           = 10; // body: endpoints separated by ';'
+  //Reply to SUBSCRIBE_TO_SERVICE of a XPUB broker, body: XPUB endpoint
+  const uint32_t SUBSCRIBE_TO_XPUB           = 11;
+  //Broker's reply to a client that came with an outdated cached epoch
+  const uint32_t STALE_EPOCH                 = 12;
+  //Federation of servers, from: sender's endpoint
+  const uint32_t PEER_HELLO                  = 13;
+  const uint32_t PEER_DIRECTORY              = 14; // body: lines 'service broker epoch interest'
+  //Broker worker processes (BrokerWorker) and DlgServer
+  const uint32_t WORKER_HELLO                = 15;
+  const uint32_t WORKER_LOAD                 = 16; // body: lines 'service messages subscribers'
+  const uint32_t CREATE_BROKER               = 17; // header epoch is the new broker's epoch
+  const uint32_t BROKER_CREATED              = 18; // body: broker endpoint
+  const uint32_t MOVE_BROKER                 = 19; // body: endpoint of the new broker
+  //Broker to its clients: come back to the server, header epoch is the old one
+  const uint32_t BROKER_MOVED                = 20;
+  //Request/reply: a request goes to one subscriber of the service, the
+  //reply goes back to the requester (to address) with the same correlation
+  const uint32_t REQUEST_MESSAGE             = 21;
+  const uint32_t REPLY_MESSAGE               = 22;
+  //Subscriber to its broker: body is a prefix of routing keys of schema
+  //messages it wants, empty - all of them
+  const uint32_t SET_KEY_FILTER              = 23;
+  //Anyone to DlgServer, the reply has the same type and DlgServer::GetStats() text
+  const uint32_t GET_STATS                   = 24;
+  //Types of applications, see DlgServer::RegisterHandler(); up to MESSAGE_TYPE_MAX
+  const uint32_t MESSAGE_TYPE_USER           = 64;
+
+  //Body of GRANT_CREDIT message
+  struct DlgCredit
+  {
+    uint32_t messages;
+    uint32_t bytes;
+  };
+
+  //Several publish messages of one service packed into a single
+  //PUBLISH_BATCH_MESSAGE. Every entry keeps type, body and header frames
+  //of the original message as they are (with their size prefixes).
+  class DlgBatch
+  {
+    std::vector<uint8_t> m_buffer;
+    size_t               m_count;
+  public:
+    DlgBatch() : m_count(0) {};
+
+    bool   Append(DlgMessage* msg);
+    void   Clear()          { m_buffer.clear(); m_count = 0; }
+    size_t GetCount() const { return m_count;         }
+    size_t GetSize() const  { return m_buffer.size(); }
+
+    //Fills type and body of the batch message
+    bool ToMessage(DlgMessage* msg);
+    //Service, addresses and identity are taken from the batch message.
+    //Messages unpacked before an error are left in 'messages'.
+    static bool Unpack(DlgMessage* batch, std::vector<DlgMessage*>& messages);
+  };
+
+  //Message priorities: lower value is served first.
+  const uint32_t PRIORITY_HIGH               = 0;
+  const uint32_t PRIORITY_NORMAL             = 1;
+  const uint32_t PRIORITY_LOW                = 2;
+  const uint32_t N_PRIORITIES                = 3;
 
 
 }
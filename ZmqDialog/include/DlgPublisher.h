@@ -5,12 +5,24 @@
 #include <stdint.h>
 #include <unistd.h>
 
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <map>
+#include <vector>
+
 #include <zmq.hpp>
 #include "DlgServer.h"
 #include "Config.h"
 #include "Debug.h"
 #include "DlgMessage.h"
 #include "Exception.h"
+#include "ServiceCache.h"
+#include "Ring.h"
+#include "ClientState.h"
+#include "MessageRegistry.h"
 
 
 ////**********************************************************////
@@ -19,18 +31,120 @@
 namespace ZmqDialog
 {
 
+class DlgPublisher;
+
+//Publishing without allocations: messages of one type are built once by
+//DlgPublisher::Prepare() and come back to the handle after they are sent.
+//
+//  DlgPublishHandle *handle = publisher.Prepare(PUBLISH_BINARY_MESSAGE);
+//  DlgMessage *msg = handle->Acquire();
+//  memcpy(msg->PrepareMessageBuffer(size), data, size);
+//  handle->Publish(msg);
+class DlgPublishHandle
+{
+  friend class DlgPublisher;
+  DlgPublisher*            m_publisher;
+  std::string              m_name;
+  DlgMessage               m_prototype;
+  mpmc_ring_t<DlgMessage*> m_free;
+  std::atomic<uint64_t>    m_allocated;
+
+  DlgPublishHandle(DlgPublisher *publisher, const std::string &name,
+                   const std::string &service, uint32_t msgType, size_t poolSize,
+                   uint64_t fingerprint);
+  ~DlgPublishHandle();
+public:
+  //Header of the prototype, the body of the last use is left for
+  //PrepareMessageBuffer(). A new message if all of them are in flight.
+  DlgMessage* Acquire();
+  //msg of Acquire(), it comes back to the handle once it is sent
+  bool Publish(DlgMessage *msg);
+  bool Publish(const void *buf, size_t size);
+  //A message which isn't published after all
+  void Release(DlgMessage *msg);
+
+  //Messages built so far, it stops growing in the steady state
+  uint64_t GetAllocated() const { return m_allocated; }
+
+private:
+  DlgPublishHandle(const DlgPublishHandle&);
+  DlgPublishHandle& operator=(const DlgPublishHandle&);
+};
+
 class DlgPublisher
 {
+  friend class DlgPublishHandle;
   std::string      m_name;
   std::string      m_service;
   std::string      m_server;
   zmq::socket_t*   m_socket;
+  std::string      m_endpoint;       // where m_socket is connected
+  zmq::socket_t*   m_directSocket;   // own PUB socket in the brokerless mode
+  std::string      m_directEndpoint;
   std::mutex       m_mutex;
-  bool             m_isRunning;
+  std::atomic<bool> m_isRunning;
   std::thread*     m_thread;
+  std::atomic<int> m_state;          // ClientState of publisher_thread
+  std::atomic<bool> m_isConnected;  // m_socket is set, for other threads
+  bool             m_isBrokerConnected;
+
+  //Send pipeline: callers of any thread queue messages, publisher_thread
+  //owns the sockets and sends them. m_wakeup interrupts its poll.
+  struct queued_t
+  {
+    DlgMessage*       msg;
+    DlgPublishHandle* handle;  // the message goes back there, or is deleted
+  };
+  mpmc_ring_t<queued_t>*                m_sendQueue;
+  std::vector<DlgPublishHandle*>        m_handles;
+  wakeup_t                              m_wakeup;
+  std::atomic<bool>                     m_isFlushRequested;
+  //ReConnect()/ReRegister(): the thread closes and opens its own sockets
+  std::atomic<bool>                     m_isReconnectRequested;
+  std::string                           m_reconnectServer;
+  std::string                           m_reconnectService;  // ReRegister() only
+  std::vector<std::promise<bool> >      m_reconnectWaiters;  // callers of post_reconnect()
+  //see GetStats(); the counters are written by publisher_thread only
+  stat_counter_t                        m_sentMessages;
+  stat_counter_t                        m_sentBytes;
+  stat_counter_t                        m_sentBatches;
+  stat_counter_t                        m_sendErrors;
+  std::atomic<uint64_t>                 m_queueWaits;    // by callers, seldom
+  std::atomic<bool>                     m_isTimed;       // see EnableTimestamps()
+
+  //Opt-in batching: messages are coalesced until the batch reaches
+  //m_batchBytes or its first message is m_batchDelay usecs old.
+  //The batch belongs to publisher_thread.
+  std::atomic<bool>                     m_isBatching;
+  size_t                                m_batchBytes;
+  uint32_t                              m_batchDelay;
+  DlgBatch                              m_batch;
+  std::chrono::steady_clock::time_point m_batchDeadline;
+
+  //Registration through a ServiceCache entry, bypassing the server
+  std::atomic<bool>                     m_isCacheRequested;
+  bool                                  m_isCacheWaiting;
+  std::string                           m_cachedEndpoint;
+  uint64_t                              m_cachedEpoch;
+  std::chrono::steady_clock::time_point m_cacheDeadline;
+
+  //Requests in flight: correlation -> handler of the reply, under m_mutex.
+  //The thread fails those whose deadline has passed.
+  struct request_t
+  {
+    std::function<void(DlgMessage*)>      handler;
+    std::chrono::steady_clock::time_point deadline;
+  };
+  std::atomic<uint64_t>                 m_nextCorrelation;
+  std::map<uint64_t, request_t>         m_requests;
+  std::atomic<int64_t>                  m_nextExpiry;    // steady_clock ticks, 0 - no requests
 
 
 public:
+  //Gets the reply and owns it, nullptr if there is none: the service has
+  //no subscriber, the broker dropped the request or the timeout expired
+  typedef std::function<void(DlgMessage*)> reply_handler_t;
+
   DlgPublisher(const std::string &name);
   DlgPublisher(const std::string &name, const std::string &service);
   DlgPublisher(const std::string &name, const std::string &service,
@@ -39,24 +153,95 @@ public:
 
   bool SetServerName(const std::string &serverName);
 
+  //publisher_thread connects, the call returns its result
   bool Connect();
   bool Connect(const std::string &serverName);
   bool Connect(const char* serverName);
+  //A connected publisher's thread reconnects (and registers anew) as soon as
+  //it sees the request, messages posted after the call go to the new peer
   bool ReConnect(const std::string &serverName);
 
+  //Returns once the message is queued for the publisher's thread; msg stays
+  //with the caller (a copy is queued). PostMessage() queues msg itself and
+  //deletes it when it is sent. Either may be called from any thread.
   bool PublishMessage(DlgMessage *msg);
+  bool PostMessage(DlgMessage *msg);
 
+  //Handle for publishing msgType (PUBLISH_TEXT_MESSAGE or PUBLISH_BINARY_MESSAGE)
+  //to the current service without allocations, nullptr on error. The
+  //publisher owns it; a new service (ReRegister) needs new handles.
+  //fingerprint goes to the headers, see DlgTyped.h.
+  DlgPublishHandle* Prepare(uint32_t msgType = PUBLISH_BINARY_MESSAGE,
+                            size_t poolSize = PUBLISHER_HANDLE_POOL,
+                            uint64_t fingerprint = 0);
+
+  //Asynchronous request to one subscriber of the service (see
+  //DlgSubscriber::Reply). Returns at once, any number of requests may be in
+  //flight; the handler is called by the publisher's thread, with nullptr if
+  //no reply came in timeout usecs. msg stays with the caller.
+  //Brokers of BROKER_XPUB mode don't know their subscribers and answer
+  //every request with no reply.
+  bool Request(DlgMessage *msg, const reply_handler_t &handler, uint32_t timeout = REQUEST_TIMEOUT);
+  std::future<DlgMessage*> Request(DlgMessage *msg, uint32_t timeout = REQUEST_TIMEOUT);
+  size_t PendingRequests();
+
+  bool EnableBatching(size_t maxBytes = PUBLISHER_BATCH_BYTES,
+                      uint32_t maxDelay = PUBLISHER_BATCH_DELAY);
+  bool DisableBatching();
+  //The batch goes out as soon as publisher_thread sees the request
+  bool Flush();
+
+  //Goes straight to the broker if its endpoint is in the ServiceCache
   bool Register();
+  //At the server the publisher is connected to; false if the thread
+  //couldn't connect or send the registration
   bool ReRegister(const std::string &serviceName);
 
-  bool IsConnected(){ return m_socket; }
+  //Brokerless mode: binds own PUB socket at 'address' (any port) and
+  //registers the endpoint at DlgServer, subscribers connect to it directly
+  bool RegisterDirect(const std::string &address);
+  bool IsDirect() { return m_directSocket; }
+
+  bool IsConnected(){ return m_isConnected; }
+  ClientState GetState() const { return (ClientState)m_state.load(); }
+  //Data messages the thread has sent (batched ones one by one), lock-free
+  void GetStats(client_stats_t &stats);
+
+  //Published messages carry timestamps of their way to subscribers
+  //(HEADER_FLAG_TIMED), see DlgSubscriber::GetLatency()
+  void EnableTimestamps(bool isEnabled) { m_isTimed = isEnabled; }
 private:
   bool connect_to(const char* serverName);
   void close_connection();
+  bool post_reconnect(const std::string &server, const std::string &service);
+  void reconnect();
+  bool bind_direct(const char* address);
+  void close_direct();
+  zmq::socket_t* data_socket() { return m_directSocket ? m_directSocket : m_socket; }
   void publisher_thread();
+  bool post_message(DlgMessage *msg, DlgPublishHandle *handle = nullptr);
+  void dispose(const queued_t &item);
+  void stamp_published(DlgMessage *msg);
+  void drain_queue();
+  void send_queued(const queued_t &item);
+  long batch_timeout();
+  bool is_batch_due();
+  long request_timeout();
+  void expire_requests();
+  ClientState next_state();
+  bool flush_batch();
+  DlgMessage* register_message(uint64_t epoch);
+  bool send_register(uint64_t epoch);
+  void register_cached();
+  void fallback_to_server();
 
   //Parsing received messages
+  static const message_registry_t<DlgPublisher>& handlers();
   bool register_publisher(DlgMessage *msg);
+  bool register_direct_publisher(DlgMessage *msg);
+  bool stale_epoch(DlgMessage *msg);
+  bool broker_moved(DlgMessage *msg);
+  bool reply_message(DlgMessage *msg);
 };
 
 }//end of namespace ZmqDialog
@@ -0,0 +1,217 @@
+#ifndef __DLG_SCHEMA_H__
+#define __DLG_SCHEMA_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#include "DlgMessage.h"
+
+namespace ZmqDialog
+{
+
+  //Payload of a message described by a schema (see DlgSchema.cpp, which
+  //generates Reader and Builder classes from it). All numbers are little
+  //endian, offsets are from the start of the payload:
+  //
+  //   0  uint32  schema id        - hash of the message name
+  //   4  uint16  version          - of the writer's schema
+  //   6  uint16  fixed size       - prefix and fixed fields of the writer
+  //   8  uint16  key slot         - offset of the routing key slot, 0 - none
+  //  10  uint16  reserved
+  //  12  fixed fields, naturally aligned; a string/bytes field is a slot
+  //      of uint32 offset and uint32 size of its data after the fixed part
+  //
+  //Fields are only appended in new versions: a reader takes the default
+  //for a field beyond the writer's fixed size and skips what it doesn't know.
+  const uint32_t SCHEMA_PREFIX_SIZE = 12;
+  const uint32_t SCHEMA_SLOT_SIZE   = 8;
+
+  //Bytes inside a payload, not terminated
+  struct schema_bytes_t
+  {
+    const char* data;
+    uint32_t    size;
+
+    std::string str() const { return std::string(data, size); }
+    bool operator==(const char* s) const { return strlen(s) == size && memcmp(data, s, size) == 0; }
+  };
+
+  template <class T>
+  inline T schema_load(const uint8_t* p)
+  {
+    T value;
+    memcpy(&value, p, sizeof(T));
+    return value;
+  }
+
+  template <class T>
+  inline void schema_store(uint8_t* p, T value)
+  {
+    memcpy(p, &value, sizeof(T));
+  }
+
+  ////**********************************************************////
+  ////                   SchemaReader class                     ////
+  ////**********************************************************////
+
+  //Reads fields where they are in the received frame
+  class SchemaReader
+  {
+  protected:
+    const uint8_t* m_data;
+    size_t         m_size;
+    uint32_t       m_fixedSize;  // 0 - not a payload of the schema
+
+    SchemaReader(const void* data, size_t size, uint32_t id) { open(data, size, id); }
+    SchemaReader(DlgMessage* msg, uint32_t id)
+    {
+      size_t size = 0;
+      const void* data = msg->GetMessageData(size);
+      open(data, size, id);
+    }
+
+    template <class T>
+    T Get(uint32_t offset, T value) const
+    {
+      if (offset + sizeof(T) <= m_fixedSize)
+        value = schema_load<T>(m_data + offset);
+      return value;
+    }
+
+    schema_bytes_t GetBytes(uint32_t slot) const
+    {
+      schema_bytes_t bytes = { "", 0 };
+      if (slot + SCHEMA_SLOT_SIZE > m_fixedSize)
+        return bytes;
+      uint32_t offset = schema_load<uint32_t>(m_data + slot);
+      uint32_t size   = schema_load<uint32_t>(m_data + slot + 4);
+      if (offset < m_fixedSize || (uint64_t)offset + size > m_size)
+        return bytes;
+      bytes.data = (const char*)m_data + offset;
+      bytes.size = size;
+      return bytes;
+    }
+
+  public:
+    bool     IsValid() const    { return m_fixedSize != 0; }
+    uint16_t GetVersion() const { return IsValid() ? schema_load<uint16_t>(m_data + 4) : 0; }
+
+    //Key of any schema payload, for brokers which know no schema
+    static bool RoutingKey(const void* data, size_t size, schema_bytes_t& key)
+    {
+      const uint8_t* p = (const uint8_t*)data;
+      if (!p || size < SCHEMA_PREFIX_SIZE)
+        return false;
+      uint32_t fixedSize = schema_load<uint16_t>(p + 6);
+      uint32_t slot      = schema_load<uint16_t>(p + 8);
+      if (slot == 0 || fixedSize > size || slot + SCHEMA_SLOT_SIZE > fixedSize)
+        return false;
+      uint32_t offset = schema_load<uint32_t>(p + slot);
+      uint32_t length = schema_load<uint32_t>(p + slot + 4);
+      if (offset < fixedSize || (uint64_t)offset + length > size)
+        return false;
+      key.data = (const char*)p + offset;
+      key.size = length;
+      return true;
+    }
+
+  private:
+    void open(const void* data, size_t size, uint32_t id)
+    {
+      m_data      = (const uint8_t*)data;
+      m_size      = size;
+      m_fixedSize = 0;
+      if (!m_data || size < SCHEMA_PREFIX_SIZE || schema_load<uint32_t>(m_data) != id)
+        return;
+      uint32_t fixedSize = schema_load<uint16_t>(m_data + 6);
+      if (fixedSize >= SCHEMA_PREFIX_SIZE && fixedSize <= size)
+        m_fixedSize = fixedSize;
+    }
+  };
+
+
+  ////**********************************************************////
+  ////                  SchemaBuilder class                     ////
+  ////**********************************************************////
+
+  //Fixed fields are set in place, string/bytes fields are referenced and
+  //copied by Write(), so their data has to live until then
+  template <uint32_t FIXED_SIZE, uint32_t N_VARIABLE>
+  class SchemaBuilder
+  {
+    struct variable_t
+    {
+      uint32_t    slot;
+      const void* data;
+      uint32_t    size;
+    };
+    uint8_t    m_fixed[FIXED_SIZE];
+    variable_t m_variables[N_VARIABLE + 1];
+
+  protected:
+    SchemaBuilder(uint32_t id, uint16_t version, uint16_t keySlot)
+    {
+      memset(m_fixed, 0, sizeof(m_fixed));
+      memset(m_variables, 0, sizeof(m_variables));
+      schema_store<uint32_t>(m_fixed, id);
+      schema_store<uint16_t>(m_fixed + 4, version);
+      schema_store<uint16_t>(m_fixed + 6, (uint16_t)FIXED_SIZE);
+      schema_store<uint16_t>(m_fixed + 8, keySlot);
+    }
+
+    template <class T>
+    void Set(uint32_t offset, T value) { schema_store<T>(m_fixed + offset, value); }
+
+    void SetBytes(uint32_t index, uint32_t slot, const void* data, uint32_t size)
+    {
+      m_variables[index].slot = slot;
+      m_variables[index].data = data;
+      m_variables[index].size = size;
+    }
+
+  public:
+    size_t Size() const
+    {
+      size_t size = FIXED_SIZE;
+      for (uint32_t i = 0; i < N_VARIABLE; i++)
+        size += m_variables[i].size;
+      return size;
+    }
+
+    //out has Size() bytes
+    void Write(void* out) const
+    {
+      uint8_t* p = (uint8_t*)out;
+      memcpy(p, m_fixed, FIXED_SIZE);
+      uint32_t offset = FIXED_SIZE;
+      for (uint32_t i = 0; i < N_VARIABLE; i++)
+        {
+          const variable_t& v = m_variables[i];
+          if (v.slot == 0)
+            continue;
+          schema_store<uint32_t>(p + v.slot, offset);
+          schema_store<uint32_t>(p + v.slot + 4, v.size);
+          if (v.size)
+            memcpy(p + offset, v.data, v.size);
+          offset += v.size;
+        }
+    }
+
+    //The body of msg, in place; the header is flagged so brokers look for a key
+    bool Write(DlgMessage* msg) const
+    {
+      void* body = msg->PrepareMessageBuffer(Size());
+      DlgHeader header;
+      if (!body || !msg->GetHeader(header))
+        return false;
+      Write(body);
+      header.flags |= HEADER_FLAG_SCHEMA;
+      return msg->SetHeader(header);
+    }
+  };
+
+} // namespace ZmqDialog
+
+#endif // __DLG_SCHEMA_H__
@@ -5,8 +5,11 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <deque>
+#include <memory>
 #include <thread>
 #include <mutex>
+#include <atomic>
 
 #include <zmq.hpp>
 #include <unistd.h>
@@ -15,26 +18,77 @@
 #include "Debug.h"
 #include "Exception.h"
 #include "Config.h"
+#include "Affinity.h"
 #include "DlgMessage.h"
+#include "DlgSchema.h"
+#include "PriorityLanes.h"
+#include "FlatMap.h"
+#include "MessageRegistry.h"
+#include "DlgStats.h"
 
 namespace ZmqDialog
 {
    extern const char* server_address;
 
+  int64_t current_time(); // usecs
+
   ////**********************************************************////
   ////                        ZMQ class                         ////
   ////**********************************************************////
+  //Sockets are tuned by the role they play
+  enum SocketRole
+  {
+    SOCKET_SERVER  = 0, // DlgServer ROUTER
+    SOCKET_BROKER  = 1, // aBroker ROUTER and XPUB
+    SOCKET_CLIENT  = 2, // DlgPublisher/DlgSubscriber DEALER
+    SOCKET_DIRECT  = 3, // PUB/SUB of the brokerless mode
+    N_SOCKET_ROLES = 4
+  };
+
+  //Negative value leaves ZMQ default
+  struct SocketOptions
+  {
+    int     sndhwm;
+    int     rcvhwm;
+    int     sndbuf;             // SO_SNDBUF
+    int     rcvbuf;             // SO_RCVBUF
+    int     linger;             // msecs
+    int     immediate;
+    int     tcpKeepalive;
+    int     tcpKeepaliveIdle;   // secs
+    int64_t affinity;           // I/O threads bitmask
+
+    SocketOptions() : sndhwm(-1), rcvhwm(-1), sndbuf(-1), rcvbuf(-1), linger(-1), immediate(-1),
+                      tcpKeepalive(-1), tcpKeepaliveIdle(-1), affinity(-1) {}
+  };
+
   class ZMQ
   {
     static zmq::context_t* m_context;
     static ZMQ*            m_instance;
+    static int             m_ioThreads;
+    static SocketOptions   m_options[N_SOCKET_ROLES];
   private:
     ZMQ();
   public:
     static ZMQ* Instance();
     ~ZMQ();
     zmq::context_t* Context() { return m_context; }
-    zmq::socket_t*  CreateSocket(int socket_type);
+    zmq::socket_t*  CreateSocket(int socket_type, SocketRole role = SOCKET_CLIENT);
+
+    //Tuning: the context is configured before the first Instance() call,
+    //socket options apply to sockets created afterwards.
+    static bool SetIOThreads(int ioThreads);
+    static void SetSocketOptions(SocketRole role, const SocketOptions& options);
+    static const SocketOptions& GetSocketOptions(SocketRole role) { return m_options[role]; }
+
+    //'key = value' lines, '#' starts a comment. Keys are
+    //  io_threads
+    //  <role>.sndhwm|rcvhwm|sndbuf|rcvbuf|linger|immediate|tcp_keepalive|tcp_keepalive_idle|affinity
+    //  cpus.<thread role> = cpu list (see Affinity)
+    //where role is server, broker, client or direct and thread role is
+    //server, broker, client or zmq_io
+    static bool LoadConfig(const char* fileName);
   };
 
 
@@ -44,17 +98,77 @@ namespace ZmqDialog
 
   class DlgMessage;
 
+  //What broker does when a subscriber has too many messages waiting for credit
+  enum OverflowPolicy
+  {
+    OVERFLOW_DROP_OLDEST     = 0, // drop (and count) the oldest waiting message
+    OVERFLOW_DROP_SUBSCRIBER = 1  // forget the slow subscriber
+  };
+
+  //How broker fans published messages out to subscribers
+  enum BrokerMode
+  {
+    BROKER_ROUTER = 0, // one ROUTER send per subscriber, with credit flow control
+    BROKER_XPUB   = 1  // one XPUB send, ZMQ I/O threads do the fan-out
+  };
+
   class aSubscriber
   {
     std::string             m_id;
     int64_t                 m_expiry;    //  Expiries at unless heartbeat
+    //Credit-based flow control: broker sends nothing without credit,
+    //subscriber grants more credit as the application consumes messages.
+    uint64_t                m_creditMessages;
+    int64_t                 m_creditBytes;  // may go below zero by one message
+    bool                    m_limitBytes;   // false until bytes are granted
+    uint64_t                m_dropped;
+    std::deque<std::shared_ptr<DlgMessage> > m_pending; // waiting for credit
+    std::string             m_keyFilter; // prefix of routing keys, see SET_KEY_FILTER
   public:
-  aSubscriber(const char* id, int64_t expiry = 0) : m_expiry(expiry)
+  aSubscriber(const char* id, int64_t expiry = 0) : m_expiry(expiry),
+      m_creditMessages(0), m_creditBytes(0), m_limitBytes(false), m_dropped(0)
     {
       m_id = id;
     }
 
     std::string GetID() const { return m_id; }
+
+    void GrantCredit(uint32_t messages, uint32_t bytes)
+    {
+      m_creditMessages += messages;
+      m_creditBytes    += bytes;
+      if (bytes != 0)
+        m_limitBytes = true;
+    }
+    bool HasCredit() const
+    {
+      return m_creditMessages > 0 && (!m_limitBytes || m_creditBytes > 0);
+    }
+    void ConsumeCredit(size_t bytes)
+    {
+      --m_creditMessages;
+      m_creditBytes -= (int64_t)bytes;
+    }
+    //Subscriber came again and will grant its whole window anew
+    void ResetCredit()
+    {
+      m_creditMessages = 0;
+      m_creditBytes    = 0;
+      m_limitBytes     = false;
+    }
+
+    std::deque<std::shared_ptr<DlgMessage> >& Pending() { return m_pending; }
+    uint64_t GetDropped() const { return m_dropped; }
+    void     CountDrop()        { ++m_dropped;      }
+
+    void               SetKeyFilter(const std::string& prefix) { m_keyFilter = prefix; }
+    const std::string& GetKeyFilter() const { return m_keyFilter; }
+    //Messages without a routing key pass any filter
+    bool Accepts(const schema_bytes_t* key) const
+    {
+      return m_keyFilter.empty() || !key ||
+        (key->size >= m_keyFilter.size() && memcmp(key->data, m_keyFilter.data(), m_keyFilter.size()) == 0);
+    }
   };
 
 
@@ -82,16 +196,43 @@ namespace ZmqDialog
 
   class aService
   {
+  public:
+    //Broker of the service lives in a BrokerWorker process
+    struct placement_t
+    {
+      std::string              worker;      // identity of the worker, empty - not placed
+      std::string              broker;      // endpoint, empty while the broker is created
+      uint64_t                 epoch;
+      std::string              movingFrom;  // worker of the old broker during a move
+      uint64_t                 rate;        // messages/sec, the last load report
+      size_t                   subscribers;
+      std::vector<DlgMessage*> waiting;     // requests which wait for the broker
+
+      placement_t() : epoch(0), rate(0), subscribers(0) {}
+    };
+  private:
     std::string                         m_name;
-    aBroker*                            m_broker;
+    aBroker*                            m_broker;   // created on first use
+    placement_t                         m_placement;
     std::mutex                          m_mutex;
+    //Directory of the brokerless (direct) mode
+    std::map<std::string, std::string>  m_directPublishers;  // identity -> endpoint
+    std::vector<std::string>            m_directSubscribers; // identities
   public:
     explicit aService(const char* name);
     virtual ~aService();
 
     bool ReleaseMessage(DlgMessage* msg);
+    bool     HasBroker() const { return m_broker; }
+    aBroker* CreateBroker(BrokerMode mode, const std::string& address);
     aBroker* GetBroker() { return m_broker; }
-  
+    bool         IsPlaced() const { return !m_placement.worker.empty(); }
+    placement_t& Placement()      { return m_placement; }
+
+    bool AddDirectPublisher(const std::string& id, const std::string& endpoint);
+    bool AddDirectSubscriber(const std::string& id);
+    std::string              GetDirectEndpoints() const;
+    const std::vector<std::string>& GetDirectSubscribers() const { return m_directSubscribers; }
   };
 
 
@@ -104,29 +245,91 @@ namespace ZmqDialog
     std::string                         m_name;
     std::thread*                        m_thread;
     std::mutex                          m_mutex;
-    std::map<std::string, aSubscriber*> m_subscribers;
-    std::map<std::string, aPublisher*>  m_publishers;
-    std::vector<DlgMessage*>            m_requests;
+    flat_map_t<aSubscriber>             m_subscribers;    // fan-out scans them in place
+    flat_map_t<aPublisher>              m_publishers;
+    priority_lanes_t<DlgMessage*>       m_requests;
     bool                                m_isRunning;
     zmq::socket_t*                      m_socket;
     std::string                         m_port;
+    OverflowPolicy                      m_overflowPolicy;
+    BrokerMode                          m_mode;
+    zmq::socket_t*                      m_xpubSocket;     // BROKER_XPUB only
+    std::string                         m_xpubPort;
+    int                                 m_xpubSubscriptions;
+    uint64_t                            m_epoch;          // set by DlgServer
+    //Brokers of the same service behind federated servers which have
+    //subscribers; published messages are forwarded there once
+    struct remote_t
+    {
+      std::string    endpoint;
+      uint64_t       epoch;
+      zmq::socket_t* socket;   // DEALER, registered there as a publisher
+    };
+    std::vector<remote_t>               m_remotes;
+    //written by the broker thread only, see GetStats()
+    stat_counter_t                      m_messagesIn;     // also for load reports of workers
+    stat_counter_t                      m_bytesIn;
+    stat_counter_t                      m_messagesOut;
+    stat_counter_t                      m_bytesOut;
+    stat_counter_t                      m_dropped;
+    stat_counter_t                      m_removed;
+    latency_histogram_t                 m_residence;      // STAMP_BROKER_IN -> STAMP_BROKER_OUT
+    std::atomic<bool>                   m_isMoving;
+    std::string                         m_movedTo;
+    size_t                              m_nextResponder;  // round robin over m_subscribers
   public:
-    aBroker(const char* name);
+    aBroker(const char* name, BrokerMode mode = BROKER_ROUTER, const char* address = server_address);
     ~aBroker();
     bool AddRequest(DlgMessage* msg);
     bool AddSubscriber(const char *id);
+    //Like AddSubscriber, but a known subscriber is accepted and starts over
+    bool Resubscribe(const char *id);
     bool AddPublisher(const char *id);
     bool SendMessage(DlgMessage* msg, aSubscriber* s);
+    void SetDequeuePolicy(DequeuePolicy policy);
+    void SetOverflowPolicy(OverflowPolicy policy) { m_overflowPolicy = policy; }
     std::string GetPort() const { return m_port; };
+    BrokerMode  GetMode() const { return m_mode; }
+    //Subscribers of XPUB broker connect here instead of GetPort()
+    std::string GetXPubPort() const { return m_xpubPort; }
+    //Clients with a cached endpoint present it, see ServiceCache
+    uint64_t    GetEpoch() const    { return m_epoch; }
+    void        SetEpoch(uint64_t epoch) { m_epoch = epoch; }
+    size_t      GetSubscriberCount();
+    uint64_t    GetPublished();
+    //Counters are read as they are, queues are measured under the lock
+    void        GetStats(broker_stats_t& stats);
+    //The service has got a new broker: clients are sent back to the server
+    void        MoveTo(const std::string& endpoint);
+    //Remote brokers to forward to, endpoint -> epoch; links to others are closed
+    void        SetRemotes(const std::map<std::string, uint64_t>& remotes);
   private:
+    static const message_registry_t<aBroker>& handlers();
     void broker_thread();
+    void receive_message();
+    void receive_subscription();
+    void fan_out(DlgMessage* msg);
+    void forward(DlgMessage* msg);
+    void close_remote(remote_t& remote);
+    void notify_moved();
+    bool deliver(const std::shared_ptr<DlgMessage>& msg, aSubscriber* s);
+    void remove_subscriber(size_t i);
+    void no_responder(DlgMessage* request);
+    void flush_pending(aSubscriber* s);
+    bool has_publisher(const std::string& id);
     void delete_publisher(const char* id);
     void destroy_publishers();  
     
     bool publish_text_message(DlgMessage *msg);
     bool publish_binary_message(DlgMessage *msg);
+    bool publish_batch_message(DlgMessage *msg);
     bool subscribe_to_service(DlgMessage *msg);
     bool register_publisher(DlgMessage *msg);
+    bool grant_credit(DlgMessage *msg);
+    bool key_filter(DlgMessage *msg);
+    bool request_message(DlgMessage *msg);
+    bool reply_message(DlgMessage *msg);
+    bool check_epoch(DlgMessage *msg, const std::string& identity, bool isSubscriber);
   };
 
 
@@ -134,29 +337,133 @@ namespace ZmqDialog
   ////                  DlgServer class                         ////
   ////**********************************************************////
 
+  //Another DlgServer of the federation, as the main thread knows it
+  struct aPeer
+  {
+    struct remote_service_t
+    {
+      std::string broker;       // endpoint of its broker
+      uint64_t    epoch;
+      bool        isInterested; // the broker has subscribers
+    };
+    std::string                             endpoint; // address:port of its router
+    zmq::socket_t*                          socket;   // DEALER connected there
+    std::map<std::string, remote_service_t> services;
+  };
+
+  //A BrokerWorker process, as the main thread knows it
+  struct aWorker
+  {
+    std::string identity;
+    uint64_t    load;     // messages/sec, the last report
+  };
+
 class DlgServer
   {
     zmq::socket_t*  m_router;
     std::thread*    m_main_thread;
+    std::string     m_address;
+    std::string     m_endpoint;   // address:port, the name among peers
+    std::vector<aPeer>       m_peers;
+    std::vector<std::string> m_newPeers;  // added by AddPeer, connected by main_thread
+    std::atomic<bool>        m_hasNewPeers;
+    std::mutex               m_peerMutex;
+    std::vector<aWorker>       m_workers;
+    std::map<uint32_t, size_t> m_ring;   // consistent hashing: point -> index in m_workers
+    uint64_t                   m_workerThreshold;
+    stat_counter_t             m_received;   // main_thread only
+    stat_counter_t             m_unhandled;
 
   protected:
-    std::map<std::string, aService*>    m_services;
+    flat_map_t<aService*>               m_services;
+    message_registry_t<DlgServer>       m_handlers;       // of main_thread
+    DequeuePolicy                       m_dequeuePolicy;
+    OverflowPolicy                      m_overflowPolicy;
+    BrokerMode                          m_brokerMode;
+    uint64_t                            m_nextEpoch;
   public:
     DlgServer();
+    DlgServer(const char* address, int port);
     ~DlgServer();
   
     bool Start();
     void Stop();
 
+    //Dequeue policy of the brokers' priority lanes (strict by default)
+    void SetDequeuePolicy(DequeuePolicy policy);
+    //What brokers do with subscribers that don't keep up (drop oldest by default)
+    void SetOverflowPolicy(OverflowPolicy policy);
+    //Mode of brokers created from now on (BROKER_ROUTER by default)
+    void SetBrokerMode(BrokerMode mode) { m_brokerMode = mode; }
+
+    //Federation: servers exchange their directories and which services
+    //have subscribers, brokers forward only to remote brokers with interest.
+    //Peering is symmetric, one side's AddPeer is enough.
+    bool AddPeer(const std::string& endpoint);
+    void PrintPeers();
+
+    //Brokers of new services go to BrokerWorker processes once any has
+    //connected; a worker above the threshold (messages/sec) gives its
+    //hottest service to the least loaded worker.
+    void SetWorkerLoadThreshold(uint64_t messagesPerSec) { m_workerThreshold = messagesPerSec; }
+    void PrintWorkers();
+
+    //Control messages of applications: the handler runs on the main thread
+    //for msgType from MESSAGE_TYPE_USER on and owns the message if it
+    //returns true. Call before Start().
+    bool RegisterHandler(uint32_t msgType, const std::function<bool(DlgMessage*)> &handler,
+                         const char* what = "handle application message");
+    //From a handler: answers the client which sent request, with the
+    //correlation and priority of its header
+    bool Reply(DlgMessage *request, uint32_t msgType, const std::string &body);
+
+    //Counters of the server and of every broker it runs, one line each:
+    //  server <endpoint> received <n> unhandled <n> services <n> workers <n>
+    //  service <name> in <msgs> <bytes> out <msgs> <bytes> dropped <n> removed <n>
+    //          queued <n> pending <n> subscribers <n> publishers <n>
+    //          residence <count> <p50> <p99> <p99.9>   (ns, timed messages)
+    //  service <name> worker <identity> rate <msgs/sec> subscribers <n>
+    //It is built by the main thread for a GET_STATS request: any process asks
+    //with RequestStats(), server is address:port and timeout in usecs.
+    static bool RequestStats(const std::string& server, std::string& stats,
+                             uint32_t timeout = STATS_REQUEST_TIMEOUT);
+    void PrintStats();
+
   private:
+    //flags of m_handlers entries
+    static const uint32_t FOR_SERVICE = 1;  // the service is created first
+
     void main_thread();
 
     bool create_service(const char* name);
+    aBroker* get_broker(const std::string& serviceName);
     volatile static bool m_isRunning; 
 
     
     bool subscribe_to_service(DlgMessage *msg);
     bool register_publisher(DlgMessage *msg);
+    bool subscribe_direct(DlgMessage *msg);
+    bool register_direct_publisher(DlgMessage *msg);
+    bool send_direct_endpoints(const std::string& serviceName, const std::string& identity,
+                               const std::string& endpoints);
+
+    aPeer* connect_peer(const std::string& endpoint);
+    bool   send_directory(aPeer& peer);
+    void   send_directories();
+    void   update_remotes();
+    bool   peer_hello(DlgMessage *msg);
+    bool   peer_directory(DlgMessage *msg);
+
+    aWorker* find_worker(const std::string& identity);
+    aWorker* place_service(const std::string& serviceName);
+    bool     create_placed_broker(const std::string& serviceName, aService* service, const aWorker& worker);
+    bool     reply_placed(aService* service, DlgMessage *msg, uint32_t replyType);
+    void     rebalance(aWorker& worker);
+    bool     worker_hello(DlgMessage *msg);
+    bool     worker_load(DlgMessage *msg);
+    bool     broker_created(DlgMessage *msg);
+    bool     get_stats(DlgMessage *msg);
+    std::string format_stats();
     
   };
 
@@ -0,0 +1,69 @@
+#ifndef __DLG_STATS_H__
+#define __DLG_STATS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+
+#include "Latency.h"
+
+namespace ZmqDialog
+{
+
+  ////**********************************************************////
+  ////                   stat_counter_t class                   ////
+  ////**********************************************************////
+
+  //A counter with one writer thread, read by any thread. An increment is a
+  //relaxed load and store, no locked instruction, so counters stay on in
+  //production; readers see a value at most a few increments old.
+  class stat_counter_t
+  {
+    std::atomic<uint64_t> m_value;
+  public:
+    stat_counter_t() : m_value(0) {}
+
+    void Add(uint64_t n = 1)
+    {
+      m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    uint64_t Get() const { return m_value.load(std::memory_order_relaxed); }
+
+  private:
+    stat_counter_t(const stat_counter_t&);
+    stat_counter_t& operator=(const stat_counter_t&);
+  };
+
+  //Snapshot of a broker, see aBroker::GetStats()
+  struct broker_stats_t
+  {
+    uint64_t messagesIn;    // published to the service
+    uint64_t bytesIn;
+    uint64_t messagesOut;   // sent to subscribers (XPUB: once per message)
+    uint64_t bytesOut;
+    uint64_t dropped;       // for slow subscribers
+    uint64_t removed;       // subscribers that didn't keep up
+    size_t   queued;        // waiting for fan-out
+    size_t   pending;       // waiting for credit, all subscribers
+    size_t   subscribers;
+    size_t   publishers;
+    latency_summary_t residence; // from queued to fanned out, timed messages only
+  };
+
+  //Snapshot of a DlgPublisher or a DlgSubscriber, see their GetStats()
+  struct client_stats_t
+  {
+    uint64_t messages;      // sent by the publisher thread / received by the subscriber thread
+    uint64_t bytes;
+    uint64_t batches;       // publisher: batches sent
+    uint64_t errors;        // messages which couldn't be sent
+    uint64_t dropped;       // subscriber: dropped by a full queue
+    uint64_t queueWaits;    // publisher: posts which waited for a full queue
+    size_t   queued;        // not yet sent / not yet extracted
+    size_t   queueHighWater;
+  };
+
+} // namespace ZmqDialog
+
+#endif // __DLG_STATS_H__
@@ -6,6 +6,13 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <queue>
+#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <future>
 
 #include <zmq.hpp>
 #include "DlgServer.h"
@@ -13,6 +20,12 @@
 #include "Debug.h"
 #include "DlgMessage.h"
 #include "Exception.h"
+#include "PriorityLanes.h"
+#include "Ring.h"
+#include "ServiceCache.h"
+#include "DlgDispatcher.h"
+#include "ClientState.h"
+#include "MessageRegistry.h"
 
 #include <ctime>
 
@@ -31,13 +44,93 @@ private:
   std::string             m_service;
   std::string             m_server;
   zmq::socket_t*          m_socket;
+  std::string             m_endpoint;        // where m_socket is connected
+  zmq::socket_t*          m_directSocket;    // SUB socket of the brokerless mode
+  std::vector<std::string> m_directEndpoints;
   std::mutex              m_mutex;
-  bool                    m_isRunning;
+  std::atomic<bool>       m_isRunning;
   std::thread*            m_thread;
+  std::atomic<int>        m_state;            // ClientState of subscriber_thread
+  std::atomic<bool>       m_isConnected;      // m_socket is set, for other threads
+  wakeup_t                m_wakeup;           // interrupts the poll of the thread
+  //Subscriptions and replies of the application, the thread owns the
+  //sockets and sends them
+  mpmc_ring_t<DlgMessage*>* m_sendQueue;
 
-  std::queue<DlgMessage*> m_messages;
+  //Credit-based flow control with the broker
+  bool                    m_isBrokerConnected;
+  uint32_t                m_creditMessages;   // window, messages
+  uint32_t                m_creditBytes;      // window, bytes (0 - unlimited)
+  std::atomic<uint32_t>   m_consumedMessages; // not yet returned to broker
+  std::atomic<uint32_t>   m_consumedBytes;
+
+  //Subscription through a ServiceCache entry, bypassing the server
+  std::atomic<bool>       m_isCacheRequested; // Subscribe() found an entry
+  bool                    m_isCacheWaiting;   // the cached broker hasn't answered yet
+  std::string             m_cachedEndpoint;
+  uint64_t                m_cachedEpoch;
+  std::chrono::steady_clock::time_point m_cacheDeadline;
+
+  priority_lanes_t<DlgMessage*> m_messages;
+  std::condition_variable       m_messageCondition; // WaitMessage() sleeps here
+  std::shared_ptr<std::function<void()> > m_notify; // see SetNotify()
+  //Messages go to a handler of the dispatcher instead of m_messages
+  DlgDispatcher*                            m_dispatcher;
+  std::shared_ptr<DlgDispatcher::strand_t>  m_strand;
+
+  //Lock-free queue instead of m_messages, see SetQueue()
+  typedef ring_lanes_t<DlgMessage*, spsc_ring_t<DlgMessage*> > spsc_lanes_t;
+  typedef ring_lanes_t<DlgMessage*, mpmc_ring_t<DlgMessage*> > mpmc_lanes_t;
+  QueueMode               m_queueMode;
+  QueueOverflow           m_queueOverflow;
+  spsc_lanes_t*           m_spsc;
+  mpmc_lanes_t*           m_mpmc;
+  std::atomic<int>        m_waiters;          // consumers in WaitMessage()
+  //QUEUE_OVERFLOW_BLOCK: messages a full ring didn't take, in order, with
+  //their priority. The thread reads no socket until consumers make room.
+  std::deque<std::pair<DlgMessage*, uint32_t> > m_blocked;
+  std::atomic<bool>       m_isBlocked;
+  std::atomic<bool>       m_hasHandler;       // the lock is taken only if there is
+  std::atomic<bool>       m_hasNotify;        // a handler or a notify hook
+  std::atomic<size_t>     m_queueHighWater;
+  std::atomic<uint64_t>   m_droppedMessages;
+  stat_counter_t          m_receivedMessages; // by the thread, see GetStats()
+  stat_counter_t          m_receivedBytes;
+  latency_histogram_t     m_latency[N_LATENCY_HOPS]; // of timed messages, see GetLatency()
+
+  //More services over the same thread and queue (AddService). Every one
+  //has its own DEALER to the server and then to its broker, as m_socket:
+  //an aBroker serves one service on its own port, so there is no
+  //connection two services could share. socket is nullptr if it failed.
+  struct link_t
+  {
+    std::string           service;
+    std::string           identity;           // name/service, unique at the server
+    zmq::socket_t*        socket;
+    std::string           endpoint;
+    bool                  isBrokerConnected;
+    std::atomic<uint32_t> consumedMessages;
+    std::atomic<uint32_t> consumedBytes;
+  };
+  flat_map_t<link_t*>     m_links;            // service -> link, the thread changes it
+  std::mutex              m_linkMutex;        // m_links and m_linkRequests
+  std::atomic<bool>       m_hasLinks;
+  std::vector<std::pair<std::string, bool> > m_linkRequests; // service, add/remove
+  std::atomic<bool>       m_isLinkRequested;
+  //ReConnect()/ReSubscribe(): the thread closes and opens its own sockets
+  std::atomic<bool>       m_isReconnectRequested;
+  std::string             m_reconnectServer;
+  std::string             m_reconnectService; // ReSubscribe() only
+  std::vector<std::promise<bool> > m_reconnectWaiters; // callers of post_reconnect()
+  std::string             m_keyFilter;        // see SetKeyFilter()
+  std::atomic<bool>       m_isFilterRequested;
+  std::vector<zmq::pollitem_t> m_pollItems;
+  std::vector<link_t*>         m_pollLinks;
+  link_t*                      m_link;        // of the message receive_link() dispatches
 
 public:
+  //Owns the message
+  typedef std::function<void(DlgMessage*)> message_handler_t;
 
   DlgSubscriber(const std::string &name);
   DlgSubscriber(const std::string &name, const std::string &serviceName);
@@ -50,31 +143,155 @@ public:
 
   bool SetServiceName(const std::string &serviceName);
 
+  //subscriber_thread connects, the call returns its result
   bool Connect();
   bool Connect(const std::string &serverName);
   bool Connect(const char* serverName);
+  //A connected subscriber's thread reconnects as soon as it sees the request,
+  //ReSubscribe() subscribes there too
   bool ReConnect(const std::string &serverName);
 
-  bool IsConnected() { return m_socket; }
+  bool IsConnected() { return m_isConnected; }
+  ClientState GetState() const { return (ClientState)m_state.load(); }
 
+  //Goes straight to the broker if its endpoint is in the ServiceCache
   bool Subscribe();
   bool Subscribe(const std::string &serviceName);
   bool Subscribe(const char* serviceName);
+  //At the server the subscriber is connected to; false if the thread
+  //couldn't connect or send the subscription
   bool ReSubscribe(const std::string &serviceName);
 
-  bool HasData() { return !m_messages.empty(); }
+  //One subscriber follows more services over its thread and queue:
+  //DlgMessage::GetServiceName() tells which service a message is of.
+  //Every service still has a connection to its broker, polled by the thread.
+  //Brokers of BROKER_ROUTER mode only, not XPUB brokers or direct publishers.
+  bool AddService(const std::string &serviceName);
+  bool RemoveService(const std::string &serviceName);
+  std::vector<std::string> GetServices();
 
+  //Brokerless mode: server replies with publishers' endpoints and
+  //the subscriber connects to them directly
+  bool SubscribeDirect();
+  bool SubscribeDirect(const std::string &serviceName);
+
+  bool HasData();
+  //Sleeps until a message is queued or timeout (usecs) expires,
+  //returns false on timeout
+  bool WaitMessage(uint32_t timeout);
+
+  //Messages of higher priority are extracted first
   bool ExtractMessage(DlgMessage *& msg);
+  //The same for polling consumers: an empty queue isn't an error
+  bool TryExtractMessage(DlgMessage *& msg);
+  //Appends up to max messages to out under one lock, returns their number
+  size_t ExtractMessages(std::vector<DlgMessage*> &out, size_t max);
+
+  //Extracted messages of type REQUEST_MESSAGE wait for an answer, the reply
+  //goes through the broker to the requester. Returns once a copy is queued
+  //for the subscriber's thread; reply stays with the caller.
+  bool Reply(DlgMessage *request, DlgMessage *reply);
+
+  //QUEUE_LOCKED only, rings are always dequeued by strict priority
+  void SetDequeuePolicy(DequeuePolicy policy);
+
+  //Queue of received messages, set before Connect(). Rings hold capacity
+  //messages per priority; keep it above the credit window and they never
+  //overflow. QUEUE_SPSC allows one consumer thread at a time.
+  bool SetQueue(QueueMode mode, size_t capacity = SUBSCRIBER_QUEUE_CAPACITY,
+                QueueOverflow overflow = QUEUE_OVERFLOW_BLOCK);
+  size_t   GetQueueSize();
+  size_t   GetQueueHighWater() const { return m_queueHighWater; }
+  uint64_t GetDroppedMessages() const { return m_droppedMessages; }
+  //Messages the thread has received for the application, lock-free
+  void GetStats(client_stats_t &stats);
+
+  //Latencies of messages timed by their publisher (see
+  //DlgPublisher::EnableTimestamps), recorded as the application takes them.
+  //The hops through a broker are missing for direct publishers and for
+  //brokers of another host; messages published on another host aren't
+  //recorded at all.
+  const latency_histogram_t& GetLatency(LatencyHop hop) const { return m_latency[hop]; }
+  void ResetLatency();
+
+  //Called by the subscriber's thread each time a message is queued, so that
+  //consumers can wait without polling HasData() (see DlgCoroutine.h).
+  //It must be short and must not extract messages itself.
+  void SetNotify(const std::function<void()> &notify);
+
+  //Messages are passed to the handler on a thread of the dispatcher, in
+  //order, instead of being queued for ExtractMessage(). Messages queued so
+  //far go to the handler first. Credit is returned as handlers take them.
+  bool SetHandler(DlgDispatcher &dispatcher, const message_handler_t &handler);
+  bool SetBatchHandler(DlgDispatcher &dispatcher, const DlgDispatcher::batch_handler_t &handler,
+                       size_t maxBatch = DISPATCH_MAX_BATCH);
+  //Waits for a running handler and drops messages it hasn't got yet,
+  //new messages are queued for ExtractMessage() again
+  void RemoveHandler();
+
+  //The broker sends at most this much unread data (call before Subscribe)
+  bool SetCreditWindow(uint32_t messages, uint32_t bytes = 0);
+
+  //The broker passes schema messages (see DlgSchema.h) only if their routing
+  //key starts with prefix, an empty prefix takes the filter off. Messages
+  //without a key pass. The service of Subscribe() only, not AddService(),
+  //and brokers of BROKER_ROUTER mode.
+  bool SetKeyFilter(const std::string &prefix);
 
 private:
+  static const message_registry_t<DlgSubscriber>& handlers();
   void subscriber_thread();
+  ClientState next_state();
+  bool has_consumed();
+  void receive_message(zmq::socket_t *socket);
+  bool post_message(DlgMessage *msg);
+  void drain_queue();
 
   bool connect_to(const char* name);
   void close_connection();
+  bool post_reconnect(const std::string &server, const std::string &service);
+  void reconnect();
+  bool connect_direct(const char* endpoint);
+  void close_direct();
+  bool grant_credit(uint32_t messages, uint32_t bytes);
+  bool send_key_filter();
+  void return_credit(bool isIdle);
+  DlgMessage* subscribe_message(uint64_t epoch);
+  bool send_subscribe(uint64_t epoch);
+  void subscribe_cached();
+  void fallback_to_server();
 
   bool subscribe_to_service(DlgMessage *msg);
   bool publish_text_message(DlgMessage *msg);
   bool publish_binary_message(DlgMessage *msg);
+  bool publish_batch_message(DlgMessage *msg);
+  bool request_message(DlgMessage *msg);
+  bool direct_publishers(DlgMessage *msg);
+  bool subscribe_to_xpub(DlgMessage *msg);
+  bool stale_epoch(DlgMessage *msg);
+  bool broker_moved(DlgMessage *msg);
+  void push_message(DlgMessage *msg);
+  void notify_consumers();
+  bool push_blocked();
+  void wake_blocked();
+  void count_consumed(DlgMessage *msg);
+  void stamp_dequeued(DlgMessage *msg);
+  //AddService() links, run by the thread
+  void update_links();
+  void link_subscribe(link_t *link, const std::string &endpoint, uint64_t epoch);
+  void receive_link(link_t *link);
+  static const message_registry_t<DlgSubscriber>& link_handlers();
+  bool link_subscribed(DlgMessage *msg);
+  bool link_moved(DlgMessage *msg);
+  bool link_no_broker(DlgMessage *msg);
+  void link_return_credit(link_t *link, bool isIdle);
+  void close_link(link_t *link);
+  bool enqueue(DlgMessage *msg, uint32_t priority);
+  bool dispatch_message(DlgMessage *msg);
+  //m_mutex must be held for QUEUE_LOCKED
+  bool pop_queued(DlgMessage *&msg);
+  bool queue_empty();
+  size_t ring_size() const { return m_spsc ? m_spsc->Size() : m_mpmc->Size(); }
 };
 
 }//end of namespace ZmqDialog
@@ -0,0 +1,151 @@
+#ifndef __DLG_TYPED_H__
+#define __DLG_TYPED_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#include <cstddef>
+#include <type_traits>
+
+#include "DlgPublisher.h"
+#include "DlgSubscriber.h"
+
+//Name of a message type, given once at global scope for every struct
+//sent through TypedPublisher/TypedSubscriber:
+//
+//  DLG_TYPED_MESSAGE(timeval)
+#define DLG_TYPED_MESSAGE(T)                                            \
+  namespace ZmqDialog {                                                 \
+    template <> struct typed_name_t<T>                                  \
+    {                                                                   \
+      static constexpr const char* Name() { return #T; }                \
+    };                                                                  \
+  }
+
+namespace ZmqDialog
+{
+
+  template <class T>
+  struct typed_name_t;
+
+  constexpr uint64_t typed_fnv1a(const char* str, uint64_t hash = 14695981039346656037ULL)
+  {
+    return *str ? typed_fnv1a(str + 1, (hash ^ (uint8_t)*str) * 1099511628211ULL) : hash;
+  }
+
+  //Name, size and alignment of T; publishers and subscribers built with
+  //different definitions of a struct don't match unless its size is kept
+  template <class T>
+  constexpr uint64_t typed_fingerprint()
+  {
+    //never 0, which is an untyped message
+    return (typed_fnv1a(typed_name_t<T>::Name()) ^ ((uint64_t)sizeof(T) << 40) ^ ((uint64_t)alignof(T) << 32)) | 1;
+  }
+
+  //The body is padding and then T: with the size prefix of the frame the
+  //struct starts at a multiple of its alignment in the frame storage
+  template <class T>
+  constexpr size_t typed_offset()
+  {
+    return (alignof(T) - sizeof(uint32_t) % alignof(T)) % alignof(T);
+  }
+
+  template <class T>
+  struct typed_check_t
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "typed messages must be trivially copyable");
+    static_assert(alignof(T) <= alignof(std::max_align_t), "typed messages can't be over-aligned");
+  };
+
+
+  ////**********************************************************////
+  ////                 TypedPublisher class                     ////
+  ////**********************************************************////
+
+  //Publishes T to the service of the publisher through a DlgPublishHandle:
+  //a publish is one copy of T into a message which is reused.
+  template <class T>
+  class TypedPublisher : typed_check_t<T>
+  {
+    DlgPublishHandle* m_handle;
+  public:
+    explicit TypedPublisher(DlgPublisher &publisher, size_t poolSize = PUBLISHER_HANDLE_POOL)
+    {
+      m_handle = publisher.Prepare(PUBLISH_BINARY_MESSAGE, poolSize, typed_fingerprint<T>());
+    }
+
+    //false if the publisher has no service
+    bool IsValid() const { return m_handle; }
+
+    bool Publish(const T &value, uint32_t priority = PRIORITY_NORMAL)
+    {
+      if (!m_handle)
+        return false;
+      DlgMessage *msg = m_handle->Acquire();
+      uint8_t *body = (uint8_t*)msg->PrepareMessageBuffer(typed_offset<T>() + sizeof(T));
+      if (!body || (priority != PRIORITY_NORMAL && !msg->SetPriority(priority)))
+        {
+          m_handle->Release(msg);
+          return false;
+        }
+      memcpy(body + typed_offset<T>(), &value, sizeof(T));
+      return m_handle->Publish(msg);
+    }
+  };
+
+
+  ////**********************************************************////
+  ////                 TypedSubscriber class                    ////
+  ////**********************************************************////
+
+  //Extracts T from a subscriber without copying it. Messages of another
+  //type are told by the fingerprint of their header, dropped and counted.
+  template <class T>
+  class TypedSubscriber : typed_check_t<T>
+  {
+    DlgSubscriber& m_subscriber;
+    uint64_t       m_rejected;
+  public:
+    explicit TypedSubscriber(DlgSubscriber &subscriber) : m_subscriber(subscriber), m_rejected(0) {}
+
+    //The T of msg, nullptr if msg is of another type. It points into msg.
+    static const T* View(DlgMessage *msg)
+    {
+      DlgHeader header;
+      if (!msg->GetHeader(header) || header.fingerprint != typed_fingerprint<T>())
+        return nullptr;
+      size_t size = 0;
+      const uint8_t *body = (const uint8_t*)msg->GetMessageData(size);
+      if (!body || size != typed_offset<T>() + sizeof(T))
+        return nullptr;
+      body += typed_offset<T>();
+      if ((uintptr_t)body % alignof(T) != 0)
+        {
+          Print(DBG_LEVEL_ERROR, "TypedSubscriber::View(): misaligned %s.\n", typed_name_t<T>::Name());
+          return nullptr;
+        }
+      return (const T*)body;
+    }
+
+    //Next message of T, nullptr if there is none. The caller owns msg,
+    //the result is valid until msg is deleted.
+    const T* Extract(DlgMessage *&msg)
+    {
+      while (m_subscriber.TryExtractMessage(msg))
+        {
+          const T *value = View(msg);
+          if (value)
+            return value;
+          m_rejected++;
+          delete msg;
+        }
+      msg = nullptr;
+      return nullptr;
+    }
+
+    uint64_t GetRejected() const { return m_rejected; }
+  };
+
+} // namespace ZmqDialog
+
+#endif // __DLG_TYPED_H__
@@ -0,0 +1,206 @@
+#ifndef __FLAT_MAP_H__
+#define __FLAT_MAP_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace ZmqDialog
+{
+
+  ////**********************************************************////
+  ////                     key_view_t class                     ////
+  ////**********************************************************////
+
+  //Non owning string key, so lookups by const char* or by a frame of
+  //a message don't build a std::string
+  struct key_view_t
+  {
+    const char* data;
+    size_t      size;
+
+    key_view_t(const char* s)              : data(s), size(strlen(s)) {}
+    key_view_t(const char* s, size_t n)    : data(s), size(n) {}
+    key_view_t(const std::string& s)       : data(s.data()), size(s.size()) {}
+
+    bool operator==(const std::string& s) const
+    {
+      return size == s.size() && memcmp(data, s.data(), size) == 0;
+    }
+
+    //FNV-1a
+    uint32_t Hash() const
+    {
+      uint32_t hash = 2166136261u;
+      for (size_t i = 0; i < size; ++i)
+        {
+          hash ^= (uint8_t)data[i];
+          hash *= 16777619u;
+        }
+      return hash;
+    }
+  };
+
+
+  ////**********************************************************////
+  ////                     flat_map_t class                     ////
+  ////**********************************************************////
+
+  //String keyed hash map for the registries of the server and brokers.
+  //Entries live in one dense vector (iteration is a linear scan), an open
+  //addressing table with linear probing keeps their indexes. Erase moves
+  //the last entry into the hole, so it invalidates pointers and indexes
+  //of the last entry. Not thread safe: owner has to lock it.
+  template <class T>
+  class flat_map_t
+  {
+  public:
+    struct entry_t
+    {
+      std::string first;
+      T           second;
+      uint32_t    hash;
+
+      entry_t(const key_view_t& key, const T& value, uint32_t h)
+        : first(key.data, key.size), second(value), hash(h) {}
+    };
+    typedef typename std::vector<entry_t>::iterator       iterator;
+    typedef typename std::vector<entry_t>::const_iterator const_iterator;
+
+    static const size_t npos = (size_t)-1;
+
+  private:
+    std::vector<entry_t>  m_entries;
+    std::vector<uint32_t> m_slots;   // index of an entry + 1, 0 is a free slot
+    size_t                m_mask;
+
+  public:
+    flat_map_t() : m_slots(16, 0), m_mask(15) {}
+
+    size_t Size() const  { return m_entries.size();  }
+    bool   Empty() const { return m_entries.empty(); }
+
+    iterator       begin()       { return m_entries.begin(); }
+    iterator       end()         { return m_entries.end();   }
+    const_iterator begin() const { return m_entries.begin(); }
+    const_iterator end() const   { return m_entries.end();   }
+
+    entry_t&       At(size_t index)       { return m_entries[index]; }
+    const entry_t& At(size_t index) const { return m_entries[index]; }
+
+    size_t IndexOf(const key_view_t& key) const
+    {
+      uint32_t hash = key.Hash();
+      for (size_t slot = hash & m_mask; m_slots[slot] != 0; slot = (slot + 1) & m_mask)
+        {
+          const entry_t& entry = m_entries[m_slots[slot] - 1];
+          if (entry.hash == hash && key == entry.first)
+            return m_slots[slot] - 1;
+        }
+      return npos;
+    }
+
+    T* Find(const key_view_t& key)
+    {
+      size_t index = IndexOf(key);
+      return index == npos ? nullptr : &m_entries[index].second;
+    }
+
+    bool Contains(const key_view_t& key) const { return IndexOf(key) != npos; }
+
+    //Returns the entry of the key, isInserted tells whether it is new
+    T& Insert(const key_view_t& key, const T& value, bool* isInserted = nullptr)
+    {
+      size_t index = IndexOf(key);
+      if (isInserted)
+        *isInserted = (index == npos);
+      if (index != npos)
+        return m_entries[index].second;
+
+      if ((m_entries.size() + 1) * 2 > m_slots.size())
+        grow();
+      uint32_t hash = key.Hash();
+      m_entries.push_back(entry_t(key, value, hash));
+      place(hash, (uint32_t)m_entries.size());
+      return m_entries.back().second;
+    }
+
+    bool Erase(const key_view_t& key)
+    {
+      size_t index = IndexOf(key);
+      if (index == npos)
+        return false;
+      EraseAt(index);
+      return true;
+    }
+
+    void EraseAt(size_t index)
+    {
+      unplace(index);
+      size_t last = m_entries.size() - 1;
+      if (index != last)
+        {
+          //the last entry takes the hole, its slot follows it
+          size_t slot = find_slot(last);
+          m_slots[slot] = (uint32_t)index + 1;
+          std::swap(m_entries[index], m_entries[last]);
+        }
+      m_entries.pop_back();
+    }
+
+    void Clear()
+    {
+      m_entries.clear();
+      m_slots.assign(m_slots.size(), 0);
+    }
+
+  private:
+    void place(uint32_t hash, uint32_t ref)
+    {
+      size_t slot = hash & m_mask;
+      while (m_slots[slot] != 0)
+        slot = (slot + 1) & m_mask;
+      m_slots[slot] = ref;
+    }
+
+    size_t find_slot(size_t index) const
+    {
+      size_t slot = m_entries[index].hash & m_mask;
+      while (m_slots[slot] != index + 1)
+        slot = (slot + 1) & m_mask;
+      return slot;
+    }
+
+    //Backward shift deletion, the table never has tombstones
+    void unplace(size_t index)
+    {
+      size_t hole = find_slot(index);
+      m_slots[hole] = 0;
+      for (size_t slot = (hole + 1) & m_mask; m_slots[slot] != 0; slot = (slot + 1) & m_mask)
+        {
+          size_t home = m_entries[m_slots[slot] - 1].hash & m_mask;
+          //the entry may move to the hole only if the hole is between its home and it
+          if (((slot - home) & m_mask) >= ((slot - hole) & m_mask))
+            {
+              m_slots[hole] = m_slots[slot];
+              m_slots[slot] = 0;
+              hole = slot;
+            }
+        }
+    }
+
+    void grow()
+    {
+      m_slots.assign(m_slots.size() * 2, 0);
+      m_mask = m_slots.size() - 1;
+      for (size_t i = 0; i < m_entries.size(); ++i)
+        place(m_entries[i].hash, (uint32_t)i + 1);
+    }
+  };
+
+} // namespace ZmqDialog
+
+#endif // __FLAT_MAP_H__
@@ -0,0 +1,245 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "Config.h"
+
+#if LATENCY_CLOCK_TSC
+#include <x86intrin.h>
+#endif
+
+namespace ZmqDialog
+{
+
+  ////**********************************************************////
+  ////                  latency_clock_t class                   ////
+  ////**********************************************************////
+
+  //Ticks of the clock of DlgHeader timestamps: nanoseconds of
+  //CLOCK_MONOTONIC, or the TSC with LATENCY_CLOCK_TSC (x86 with an
+  //invariant TSC). Ticks are kept raw in messages and only differences
+  //are converted, so processes don't have to agree on a TSC rate. Either
+  //clock compares timestamps of processes of one host only: a timed
+  //message carries the HostId() of its publisher and nobody else stamps
+  //it or records its spans unless it has the same HostId().
+  class latency_clock_t
+  {
+  public:
+    static uint64_t Now()
+    {
+#if LATENCY_CLOCK_TSC
+      return __rdtsc();
+#else
+      timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+    }
+
+    static uint64_t ToNs(uint64_t ticks)
+    {
+#if LATENCY_CLOCK_TSC
+      return (uint64_t)((double)ticks * NsPerTick());
+#else
+      return ticks;
+#endif
+    }
+
+    //The clock of this host since its boot, never 0
+    static uint64_t HostId()
+    {
+      static const uint64_t id = []()
+        {
+          char boot[64] = { 0 };
+          FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+          if (f)
+            {
+              if (!fgets(boot, sizeof(boot), f))
+                boot[0] = 0;
+              fclose(f);
+            }
+          uint64_t hash = 14695981039346656037ULL;
+          for (const char *c = boot; *c && *c != '\n'; c++)
+            hash = (hash ^ (uint8_t)*c) * 1099511628211ULL;
+          if (!boot[0])
+            hash = (hash ^ (uint64_t)gethostid()) * 1099511628211ULL;
+          return hash ? hash : 1;
+        }();
+      return id;
+    }
+
+#if LATENCY_CLOCK_TSC
+    //measured once against CLOCK_MONOTONIC
+    static double NsPerTick()
+    {
+      static const double nsPerTick = []()
+        {
+          timespec t0, t1;
+          clock_gettime(CLOCK_MONOTONIC, &t0);
+          uint64_t tsc0 = __rdtsc();
+          usleep(10000);
+          clock_gettime(CLOCK_MONOTONIC, &t1);
+          uint64_t tsc1 = __rdtsc();
+          double ns = (double)(t1.tv_sec - t0.tv_sec) * 1e9 + (double)(t1.tv_nsec - t0.tv_nsec);
+          return tsc1 > tsc0 ? ns / (double)(tsc1 - tsc0) : 1.0;
+        }();
+      return nsPerTick;
+    }
+#endif
+  };
+
+  //Parts of the way of a timed message, between the stamps of DlgHeader
+  enum LatencyHop
+  {
+    HOP_PUBLISH_TO_BROKER = 0, // STAMP_PUBLISH    -> STAMP_BROKER_IN
+    HOP_IN_BROKER         = 1, // STAMP_BROKER_IN  -> STAMP_BROKER_OUT
+    HOP_BROKER_TO_DEQUEUE = 2, // STAMP_BROKER_OUT -> STAMP_DEQUEUE
+    HOP_END_TO_END        = 3, // STAMP_PUBLISH    -> STAMP_DEQUEUE
+    N_LATENCY_HOPS        = 4
+  };
+
+  inline const char* LatencyHopName(LatencyHop hop)
+  {
+    switch (hop)
+      {
+      case HOP_PUBLISH_TO_BROKER: return "publish->broker";
+      case HOP_IN_BROKER:         return "in broker";
+      case HOP_BROKER_TO_DEQUEUE: return "broker->dequeue";
+      case HOP_END_TO_END:        return "end to end";
+      default:                    break;
+      }
+    return "unknown";
+  }
+
+  //Percentiles of a latency_histogram_t, nanoseconds
+  struct latency_summary_t
+  {
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+  };
+
+
+  ////**********************************************************////
+  ////                latency_histogram_t class                 ////
+  ////**********************************************************////
+
+  //Log-linear buckets in the manner of HdrHistogram: values below
+  //2^SUB_BITS ns are exact, above that every power of two is split into
+  //2^SUB_BITS buckets, so a percentile is within 1/2^SUB_BITS (3%) of the
+  //true value. A record is a relaxed atomic add from any thread; reading
+  //while others record gives a slightly stale but consistent enough view.
+  class latency_histogram_t
+  {
+    static const unsigned SUB_BITS  = 5;
+    static const unsigned SUB_COUNT = 1u << SUB_BITS;
+    static const unsigned MAX_BITS  = 40;  // ~18 minutes, longer goes in the last bucket
+    static const unsigned N_BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_COUNT;
+
+    std::atomic<uint64_t> m_counts[N_BUCKETS];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_max;
+
+    static unsigned index(uint64_t ns)
+    {
+      if (ns < SUB_COUNT)
+        return (unsigned)ns;
+      unsigned msb = 63 - __builtin_clzll(ns);
+      if (msb >= MAX_BITS)
+        return N_BUCKETS - 1;
+      unsigned sub = (unsigned)(ns >> (msb - SUB_BITS)) - SUB_COUNT;
+      return SUB_COUNT + (msb - SUB_BITS) * SUB_COUNT + sub;
+    }
+
+    //the highest value of the bucket
+    static uint64_t value(unsigned idx)
+    {
+      if (idx < SUB_COUNT)
+        return idx;
+      unsigned k     = idx - SUB_COUNT;
+      unsigned shift = k / SUB_COUNT;
+      uint64_t lower = (uint64_t)(SUB_COUNT + k % SUB_COUNT) << shift;
+      return lower + ((uint64_t)1 << shift) - 1;
+    }
+
+  public:
+    latency_histogram_t() { Reset(); }
+
+    void Record(uint64_t ns)
+    {
+      m_counts[index(ns)].fetch_add(1, std::memory_order_relaxed);
+      m_count.fetch_add(1, std::memory_order_relaxed);
+      uint64_t max = m_max.load(std::memory_order_relaxed);
+      while (ns > max && !m_max.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+        ;
+    }
+
+    //Time between two timestamps of latency_clock_t, skipped if one is missing
+    void RecordSpan(uint64_t from, uint64_t to)
+    {
+      if (from != 0 && to >= from)
+        Record(latency_clock_t::ToNs(to - from));
+    }
+
+    uint64_t GetCount() const { return m_count.load(std::memory_order_relaxed); }
+    uint64_t GetMax() const   { return m_max.load(std::memory_order_relaxed); }
+
+    //percentile is 0..100, e.g. 99.9; 0 without records
+    uint64_t GetPercentile(double percentile) const
+    {
+      uint64_t count = GetCount();
+      if (count == 0)
+        return 0;
+      uint64_t rank = (uint64_t)(percentile / 100.0 * (double)count + 0.5);
+      if (rank == 0)
+        rank = 1;
+      uint64_t seen = 0;
+      for (unsigned i = 0; i < N_BUCKETS; i++)
+        {
+          seen += m_counts[i].load(std::memory_order_relaxed);
+          if (seen >= rank)
+            {
+              uint64_t v = value(i);
+              uint64_t max = GetMax();
+              return (v < max && i != N_BUCKETS - 1) ? v : max;
+            }
+        }
+      return GetMax();
+    }
+
+    latency_summary_t GetSummary() const
+    {
+      latency_summary_t summary;
+      summary.count = GetCount();
+      summary.p50   = GetPercentile(50.0);
+      summary.p99   = GetPercentile(99.0);
+      summary.p999  = GetPercentile(99.9);
+      summary.max   = GetMax();
+      return summary;
+    }
+
+    //Not atomic with concurrent records
+    void Reset()
+    {
+      for (unsigned i = 0; i < N_BUCKETS; i++)
+        m_counts[i].store(0, std::memory_order_relaxed);
+      m_count.store(0, std::memory_order_relaxed);
+      m_max.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    latency_histogram_t(const latency_histogram_t&);
+    latency_histogram_t& operator=(const latency_histogram_t&);
+  };
+
+} // namespace ZmqDialog
+
+#endif // __LATENCY_H__
@@ -0,0 +1,122 @@
+#ifndef __MESSAGE_REGISTRY_H__
+#define __MESSAGE_REGISTRY_H__
+
+#include <stdint.h>
+
+#include <vector>
+#include <functional>
+
+#include "Config.h"
+#include "Debug.h"
+#include "DlgMessage.h"
+
+namespace ZmqDialog
+{
+
+  ////**********************************************************////
+  ////                message_registry_t class                  ////
+  ////**********************************************************////
+
+  //Handlers of the message types a thread receives, in a table indexed by
+  //the type: a dispatch is one load and one indirect call whatever the
+  //number of types. Built-in handlers are methods of Owner, applications
+  //add std::function handlers for types from MESSAGE_TYPE_USER on.
+  //
+  //A handler owns the message and deletes it when it returns true; on
+  //false the registry reports the error and deletes the message.
+  template <class Owner>
+  class message_registry_t
+  {
+  public:
+    typedef bool (Owner::*method_t)(DlgMessage*);
+    typedef std::function<bool(DlgMessage*)> handler_t;
+
+    struct entry_t
+    {
+      method_t    method;   // built-in handler
+      handler_t   handler;  // application handler if there is no method
+      const char* what;     // "Couldn't <what>." on failure
+      uint32_t    flags;    // up to Owner
+    };
+
+  private:
+    std::vector<entry_t> m_table;
+
+    entry_t* slot(uint32_t msgType)
+    {
+      if (msgType >= MESSAGE_TYPE_MAX)
+        return nullptr;
+      if (msgType >= m_table.size())
+        m_table.resize(msgType + 1, entry_t{ nullptr, handler_t(), nullptr, 0 });
+      return &m_table[msgType];
+    }
+
+  public:
+    bool Register(uint32_t msgType, method_t method, const char* what, uint32_t flags = 0)
+    {
+      entry_t* e = slot(msgType);
+      if (!e || !method)
+        return false;
+      e->method  = method;
+      e->handler = handler_t();
+      e->what    = what;
+      e->flags   = flags;
+      return true;
+    }
+
+    bool Register(uint32_t msgType, const handler_t& handler, const char* what, uint32_t flags = 0)
+    {
+      entry_t* e = slot(msgType);
+      if (!e || !handler)
+        return false;
+      e->method  = nullptr;
+      e->handler = handler;
+      e->what    = what;
+      e->flags   = flags;
+      return true;
+    }
+
+    bool Unregister(uint32_t msgType)
+    {
+      if (msgType >= m_table.size() || !Find(msgType))
+        return false;
+      m_table[msgType] = entry_t{ nullptr, handler_t(), nullptr, 0 };
+      return true;
+    }
+
+    //nullptr if the type has no handler
+    const entry_t* Find(uint32_t msgType) const
+    {
+      if (msgType >= m_table.size())
+        return nullptr;
+      const entry_t* e = &m_table[msgType];
+      return (e->method || e->handler) ? e : nullptr;
+    }
+
+    void Call(Owner* owner, const entry_t* e, DlgMessage* msg, const char* where) const
+    {
+      bool isOk = e->method ? (owner->*e->method)(msg) : e->handler(msg);
+      if (!isOk)
+        {
+          Print(DBG_LEVEL_ERROR, "%s: Couldn't %s.\n", where, e->what ? e->what : "handle message");
+          delete msg;
+        }
+    }
+
+    //Takes ownership of msg, messages of types without a handler are dropped
+    void Dispatch(Owner* owner, uint32_t msgType, DlgMessage* msg, const char* where) const
+    {
+      const entry_t* e = Find(msgType);
+      if (!e)
+        {
+          Print(DBG_LEVEL_VERBOSE, "%s: message of type %u is not handled.\n", where, msgType);
+          delete msg;
+          return;
+        }
+      Call(owner, e, msg, where);
+    }
+  };
+
+} // namespace ZmqDialog
+
+#endif // __MESSAGE_REGISTRY_H__
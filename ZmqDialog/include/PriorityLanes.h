@@ -0,0 +1,121 @@
+#ifndef __PRIORITY_LANES_H__
+#define __PRIORITY_LANES_H__
+
+#include <stdint.h>
+
+#include <deque>
+
+#include "Config.h"
+#include "DlgMessage.h"
+
+namespace ZmqDialog
+{
+
+  enum DequeuePolicy
+  {
+    DEQUEUE_STRICT   = 0, // higher lane always goes first
+    DEQUEUE_WEIGHTED = 1  // weighted round robin between lanes
+  };
+
+  ////**********************************************************////
+  ////                 priority_lanes_t class                   ////
+  ////**********************************************************////
+
+  //One FIFO per priority. Not thread safe: owner has to lock it.
+  template <class T>
+  class priority_lanes_t
+  {
+    std::deque<T>  m_lanes[N_PRIORITIES];
+    uint32_t       m_weights[N_PRIORITIES];
+    uint32_t       m_credits[N_PRIORITIES]; // what is left of the current round
+    DequeuePolicy  m_policy;
+    size_t         m_size;
+  public:
+    priority_lanes_t() : m_policy(DEQUEUE_STRICT), m_size(0)
+    {
+      const uint32_t weights[N_PRIORITIES] =
+	{ PRIORITY_WEIGHT_HIGH, PRIORITY_WEIGHT_NORMAL, PRIORITY_WEIGHT_LOW };
+      for(uint32_t i = 0; i < N_PRIORITIES; ++i)
+	{
+	  m_weights[i] = weights[i];
+	  m_credits[i] = weights[i];
+	}
+    }
+
+    void SetPolicy(DequeuePolicy policy) { m_policy = policy; }
+    DequeuePolicy GetPolicy() const      { return m_policy;   }
+
+    //Zero weight is treated as one, otherwise the lane would starve
+    void SetWeight(uint32_t priority, uint32_t weight)
+    {
+      if(priority >= N_PRIORITIES)
+	return;
+      m_weights[priority] = weight ? weight : 1;
+      m_credits[priority] = m_weights[priority];
+    }
+
+    bool   Empty() const                 { return m_size == 0; }
+    size_t Size() const                  { return m_size;      }
+    size_t Size(uint32_t priority) const
+    {
+      return priority < N_PRIORITIES ? m_lanes[priority].size() : 0;
+    }
+
+    //Unknown priorities go to the lowest lane
+    void Push(const T& item, uint32_t priority)
+    {
+      if(priority >= N_PRIORITIES)
+	priority = N_PRIORITIES - 1;
+      m_lanes[priority].push_back(item);
+      ++m_size;
+    }
+
+    bool Pop(T& item)
+    {
+      if(m_size == 0)
+	return false;
+      if(m_policy == DEQUEUE_STRICT)
+	{
+	  for(uint32_t i = 0; i < N_PRIORITIES; ++i)
+	    if(!m_lanes[i].empty())
+	      return pop_from(i, item);
+	  return false;
+	}
+      //DEQUEUE_WEIGHTED: every lane may take up to its weight per round,
+      //so a high priority item waits for at most one round of the others.
+      for(int round = 0; round < 2; ++round)
+	{
+	  for(uint32_t i = 0; i < N_PRIORITIES; ++i)
+	    {
+	      if(!m_lanes[i].empty() && m_credits[i] > 0)
+		{
+		  --m_credits[i];
+		  return pop_from(i, item);
+		}
+	    }
+	  for(uint32_t i = 0; i < N_PRIORITIES; ++i)
+	    m_credits[i] = m_weights[i];
+	}
+      return false;
+    }
+
+    void Clear()
+    {
+      for(uint32_t i = 0; i < N_PRIORITIES; ++i)
+	m_lanes[i].clear();
+      m_size = 0;
+    }
+
+  private:
+    bool pop_from(uint32_t priority, T& item)
+    {
+      item = m_lanes[priority].front();
+      m_lanes[priority].pop_front();
+      --m_size;
+      return true;
+    }
+  };
+
+} // namespace ZmqDialog
+
+#endif // __PRIORITY_LANES_H__
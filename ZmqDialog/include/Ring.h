@@ -0,0 +1,273 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "Config.h"
+#include "DlgMessage.h"
+
+namespace ZmqDialog
+{
+
+  //Queue of received messages in DlgSubscriber
+  enum QueueMode
+  {
+    QUEUE_LOCKED = 0, // priority lanes under a mutex, unbounded (default)
+    QUEUE_SPSC   = 1, // lock-free rings, one consumer thread
+    QUEUE_MPMC   = 2  // lock-free rings, any number of consumer threads
+  };
+
+  //What the receiving thread does with a message when the ring is full.
+  //With the credit window of the subscriber below the capacity it never is.
+  enum QueueOverflow
+  {
+    QUEUE_OVERFLOW_BLOCK       = 0, // wait for the consumer (the broker holds the rest)
+    QUEUE_OVERFLOW_DROP_NEWEST = 1, // drop (and count) the incoming message
+    QUEUE_OVERFLOW_DROP_OLDEST = 2  // drop (and count) the oldest one, QUEUE_MPMC only
+  };
+
+  inline size_t ring_capacity(size_t capacity)
+  {
+    size_t n = 2;
+    while (n < capacity)
+      n <<= 1;
+    return n;
+  }
+
+  ////**********************************************************////
+  ////                    spsc_ring_t class                     ////
+  ////**********************************************************////
+
+  //Bounded single producer / single consumer ring. Each side keeps a copy
+  //of the other side's index and reads the shared one only when its copy
+  //says the ring is full (empty), so the cache lines are rarely shared.
+  template <class T>
+  class spsc_ring_t
+  {
+    T*                  m_items;
+    size_t              m_mask;
+    char                m_pad0[64];
+    std::atomic<size_t> m_head;        // consumer
+    size_t              m_cachedTail;
+    char                m_pad1[64];
+    std::atomic<size_t> m_tail;        // producer
+    size_t              m_cachedHead;
+    char                m_pad2[64];
+  public:
+    explicit spsc_ring_t(size_t capacity)
+      : m_head(0), m_cachedTail(0), m_tail(0), m_cachedHead(0)
+    {
+      capacity = ring_capacity(capacity);
+      m_items = new T[capacity];
+      m_mask  = capacity - 1;
+    }
+    ~spsc_ring_t() { delete[] m_items; }
+
+    size_t Capacity() const { return m_mask + 1; }
+    //Exact for the producer and the consumer, a snapshot for others
+    size_t Size() const  { return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire); }
+    bool   Empty() const { return Size() == 0; }
+
+    //Producer only
+    bool TryPush(const T& item)
+    {
+      size_t tail = m_tail.load(std::memory_order_relaxed);
+      if (tail - m_cachedHead > m_mask)
+        {
+          m_cachedHead = m_head.load(std::memory_order_acquire);
+          if (tail - m_cachedHead > m_mask)
+            return false;
+        }
+      m_items[tail & m_mask] = item;
+      m_tail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    //Consumer only
+    bool TryPop(T& item)
+    {
+      size_t head = m_head.load(std::memory_order_relaxed);
+      if (head == m_cachedTail)
+        {
+          m_cachedTail = m_tail.load(std::memory_order_acquire);
+          if (head == m_cachedTail)
+            return false;
+        }
+      item = m_items[head & m_mask];
+      m_head.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+  private:
+    spsc_ring_t(const spsc_ring_t&);
+    spsc_ring_t& operator=(const spsc_ring_t&);
+  };
+
+
+  ////**********************************************************////
+  ////                    mpmc_ring_t class                     ////
+  ////**********************************************************////
+
+  //Bounded multi producer / multi consumer ring (D. Vyukov). Every cell has
+  //a sequence number which tells whether it may be written or read in the
+  //current lap, so a push or a pop is one CAS on its index.
+  template <class T>
+  class mpmc_ring_t
+  {
+    struct cell_t
+    {
+      std::atomic<size_t> sequence;
+      T                   item;
+    };
+    cell_t*             m_cells;
+    size_t              m_mask;
+    char                m_pad0[64];
+    std::atomic<size_t> m_enqueue;
+    char                m_pad1[64];
+    std::atomic<size_t> m_dequeue;
+    char                m_pad2[64];
+  public:
+    explicit mpmc_ring_t(size_t capacity) : m_enqueue(0), m_dequeue(0)
+    {
+      capacity = ring_capacity(capacity);
+      m_cells = new cell_t[capacity];
+      m_mask  = capacity - 1;
+      for (size_t i = 0; i < capacity; i++)
+        m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    ~mpmc_ring_t() { delete[] m_cells; }
+
+    size_t Capacity() const { return m_mask + 1; }
+    //A snapshot
+    size_t Size() const
+    {
+      size_t enqueue = m_enqueue.load(std::memory_order_acquire);
+      size_t dequeue = m_dequeue.load(std::memory_order_acquire);
+      return enqueue > dequeue ? enqueue - dequeue : 0;
+    }
+    bool   Empty() const { return Size() == 0; }
+
+    bool TryPush(const T& item)
+    {
+      size_t pos = m_enqueue.load(std::memory_order_relaxed);
+      cell_t* cell;
+      while (true)
+        {
+          cell = &m_cells[pos & m_mask];
+          intptr_t diff = (intptr_t)cell->sequence.load(std::memory_order_acquire) - (intptr_t)pos;
+          if (diff == 0)
+            {
+              if (m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+            }
+          else if (diff < 0)
+            return false;   // full
+          else
+            pos = m_enqueue.load(std::memory_order_relaxed);
+        }
+      cell->item = item;
+      cell->sequence.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool TryPop(T& item)
+    {
+      size_t pos = m_dequeue.load(std::memory_order_relaxed);
+      cell_t* cell;
+      while (true)
+        {
+          cell = &m_cells[pos & m_mask];
+          intptr_t diff = (intptr_t)cell->sequence.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+          if (diff == 0)
+            {
+              if (m_dequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+            }
+          else if (diff < 0)
+            return false;   // empty
+          else
+            pos = m_dequeue.load(std::memory_order_relaxed);
+        }
+      item = cell->item;
+      cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+      return true;
+    }
+
+  private:
+    mpmc_ring_t(const mpmc_ring_t&);
+    mpmc_ring_t& operator=(const mpmc_ring_t&);
+  };
+
+
+  ////**********************************************************////
+  ////                   ring_lanes_t class                     ////
+  ////**********************************************************////
+
+  //A ring per priority; the consumer takes from the highest lane which
+  //isn't empty (DEQUEUE_STRICT), so a lane keeps its FIFO order.
+  template <class T, class Ring>
+  class ring_lanes_t
+  {
+    Ring* m_lanes[N_PRIORITIES];
+  public:
+    explicit ring_lanes_t(size_t capacity)
+    {
+      for (uint32_t i = 0; i < N_PRIORITIES; ++i)
+        m_lanes[i] = new Ring(capacity);
+    }
+    ~ring_lanes_t()
+    {
+      for (uint32_t i = 0; i < N_PRIORITIES; ++i)
+        delete m_lanes[i];
+    }
+
+    size_t Capacity() const { return m_lanes[0]->Capacity(); }
+    size_t Size() const
+    {
+      size_t size = 0;
+      for (uint32_t i = 0; i < N_PRIORITIES; ++i)
+        size += m_lanes[i]->Size();
+      return size;
+    }
+    bool Empty() const
+    {
+      for (uint32_t i = 0; i < N_PRIORITIES; ++i)
+        if (!m_lanes[i]->Empty())
+          return false;
+      return true;
+    }
+
+    //Unknown priorities go to the lowest lane
+    bool TryPush(const T& item, uint32_t priority)
+    {
+      if (priority >= N_PRIORITIES)
+        priority = N_PRIORITIES - 1;
+      return m_lanes[priority]->TryPush(item);
+    }
+
+    bool TryPop(T& item)
+    {
+      for (uint32_t i = 0; i < N_PRIORITIES; ++i)
+        if (m_lanes[i]->TryPop(item))
+          return true;
+      return false;
+    }
+
+    //The oldest item of the lane, for QUEUE_OVERFLOW_DROP_OLDEST
+    bool TryPop(T& item, uint32_t priority)
+    {
+      if (priority >= N_PRIORITIES)
+        priority = N_PRIORITIES - 1;
+      return m_lanes[priority]->TryPop(item);
+    }
+
+  private:
+    ring_lanes_t(const ring_lanes_t&);
+    ring_lanes_t& operator=(const ring_lanes_t&);
+  };
+
+} // namespace ZmqDialog
+
+#endif // __RING_H__
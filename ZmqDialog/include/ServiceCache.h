@@ -0,0 +1,44 @@
+#ifndef __SERVICE_CACHE_H__
+#define __SERVICE_CACHE_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <map>
+#include <mutex>
+
+namespace ZmqDialog
+{
+
+  ////**********************************************************////
+  ////                   ServiceCache class                     ////
+  ////**********************************************************////
+
+  //Process wide cache of service -> broker endpoint mappings learned from
+  //DlgServer replies. Clients try the cached broker first and ask the
+  //server only on a miss, a stale epoch or when the broker doesn't answer.
+  class ServiceCache
+  {
+    struct entry_t
+    {
+      std::string endpoint;
+      uint64_t    epoch;
+    };
+
+    static std::map<std::string, entry_t> m_entries;
+    static std::mutex                     m_mutex;
+    static bool                           m_isEnabled;
+  public:
+    static void Enable(bool isEnabled);
+    static bool IsEnabled() { return m_isEnabled; }
+
+    static bool Find(const std::string& service, std::string& endpoint, uint64_t& epoch);
+    static void Update(const std::string& service, const std::string& endpoint, uint64_t epoch);
+    //Removes the entry only if it still has this epoch
+    static void Invalidate(const std::string& service, uint64_t epoch);
+    static void Clear();
+  };
+
+} // namespace ZmqDialog
+
+#endif // __SERVICE_CACHE_H__
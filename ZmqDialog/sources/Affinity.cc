@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "Affinity.h"
+#include "Debug.h"
+
+#ifndef MPOL_LOCAL
+#define MPOL_LOCAL 4
+#endif
+
+namespace ZmqDialog
+{
+  std::vector<int>                   Affinity::m_cpus[N_THREAD_ROLES];
+  std::atomic<unsigned>              Affinity::m_next[N_THREAD_ROLES];
+  std::vector<Affinity::placement_t> Affinity::m_placements;
+  std::mutex                         Affinity::m_mutex;
+
+  static const char* role_name(ThreadRole role)
+  {
+    const char* NAMES[N_THREAD_ROLES] = { "server", "broker", "client", "zmq-io" };
+    return NAMES[role];
+  }
+
+  bool Affinity::SetCpus(ThreadRole role, const std::string& cpuList)
+  {
+    std::vector<int> cpus;
+    const char* p = cpuList.c_str();
+    while(*p)
+      {
+	char* end = nullptr;
+	long first = strtol(p, &end, 10);
+	if(end == p || first < 0)
+	  {
+	    Print(DBG_LEVEL_ERROR, "Affinity::SetCpus(): bad cpu list '%s'\n", cpuList.c_str());
+	    return false;
+	  }
+	long last = first;
+	p = end;
+	if(*p == '-')
+	  {
+	    last = strtol(p + 1, &end, 10);
+	    if(end == p + 1 || last < first)
+	      {
+		Print(DBG_LEVEL_ERROR, "Affinity::SetCpus(): bad cpu range in '%s'\n", cpuList.c_str());
+		return false;
+	      }
+	    p = end;
+	  }
+	for(long cpu = first; cpu <= last; cpu++)
+	  cpus.push_back((int)cpu);
+	if(*p == ',')
+	  p++;
+	else if(*p)
+	  {
+	    Print(DBG_LEVEL_ERROR, "Affinity::SetCpus(): bad cpu list '%s'\n", cpuList.c_str());
+	    return false;
+	  }
+      }
+    return SetCpus(role, cpus);
+  }
+
+  bool Affinity::SetCpus(ThreadRole role, const std::vector<int>& cpus)
+  {
+    if(role >= N_THREAD_ROLES)
+      return false;
+    for(size_t i = 0; i < cpus.size(); i++)
+      if(cpus[i] < 0 || cpus[i] >= CPU_SETSIZE)
+	{
+	  Print(DBG_LEVEL_ERROR, "Affinity::SetCpus(): cpu %d is out of range\n", cpus[i]);
+	  return false;
+	}
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cpus[role] = cpus;
+    m_next[role] = 0;
+    return true;
+  }
+
+  bool Affinity::Apply(ThreadRole role, const std::string& name)
+  {
+    bool isPinned = false;
+    int  cpu      = -1;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(!m_cpus[role].empty())
+	cpu = m_cpus[role][m_next[role]++ % m_cpus[role].size()];
+    }
+    if(cpu >= 0)
+      {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if(err != 0)
+	  Print(DBG_LEVEL_ERROR, "Affinity::Apply(): couldn't pin %s thread '%s' to cpu %d (%s)\n",
+		role_name(role), name.c_str(), cpu, strerror(err));
+	else
+	  {
+	    isPinned = true;
+	    //first touch of a pinned thread is local anyway, MPOL_LOCAL
+	    //keeps it so if the kernel would prefer another node
+	    if(syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) != 0)
+	      Print(DBG_LEVEL_DEBUG, "Affinity::Apply(): set_mempolicy failed (%s)\n", strerror(errno));
+	  }
+      }
+
+    placement_t placement;
+    placement.name     = std::string(role_name(role)) + " '" + name + "'";
+    placement.cpu      = CurrentCpu();
+    placement.node     = NodeOfCpu(placement.cpu);
+    placement.isPinned = isPinned;
+    Print(DBG_LEVEL_VERBOSE, "Affinity: %s runs on cpu %d, node %d%s\n", placement.name.c_str(),
+	  placement.cpu, placement.node, isPinned ? " (pinned)" : "");
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_placements.push_back(placement);
+    return isPinned || cpu < 0;
+  }
+
+  int Affinity::CurrentCpu()
+  {
+    return sched_getcpu();
+  }
+
+  int Affinity::NodeOfCpu(int cpu)
+  {
+    if(cpu < 0)
+      return -1;
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if(!dir)
+      return -1;
+    int node = 0; // no NUMA information means one node
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL)
+      if(strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+	{
+	  node = atoi(entry->d_name + 4);
+	  break;
+	}
+    closedir(dir);
+    return node;
+  }
+
+  void Affinity::PrintReport()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Print(DBG_LEVEL_INFO, "Thread placement:\n");
+    for(int role = 0; role < N_THREAD_ROLES; role++)
+      {
+	std::string cpus;
+	for(size_t i = 0; i < m_cpus[role].size(); i++)
+	  cpus += (i ? "," : "") + std::to_string(m_cpus[role][i]);
+	Print(DBG_LEVEL_INFO, "  %-8s cpus: %s\n", role_name((ThreadRole)role), cpus.empty() ? "any" : cpus.c_str());
+      }
+    for(size_t i = 0; i < m_placements.size(); i++)
+      Print(DBG_LEVEL_INFO, "  %s: cpu %d, node %d%s\n", m_placements[i].name.c_str(),
+	    m_placements[i].cpu, m_placements[i].node, m_placements[i].isPinned ? " (pinned)" : "");
+  }
+
+} // namespace ZmqDialog
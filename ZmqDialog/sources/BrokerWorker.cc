@@ -0,0 +1,209 @@
+#include <stdio.h>
+
+#include "BrokerWorker.h"
+
+namespace ZmqDialog
+{
+
+  BrokerWorker::BrokerWorker(const std::string& name, const char* address) :
+    m_name(name), m_address(address), m_socket(nullptr), m_thread(nullptr), m_isRunning(false)
+  {
+  }
+
+  BrokerWorker::~BrokerWorker()
+  {
+    Stop();
+    if (m_thread && m_thread->joinable())
+      m_thread->join();
+    delete m_thread;
+    for (auto &v : m_brokers)
+      delete v.second;
+    m_brokers.clear();
+    delete_retired(INT64_MAX);
+    if (m_socket)
+      m_socket->close();
+    delete m_socket;
+  }
+
+  bool BrokerWorker::Connect(const std::string& server)
+  {
+    if (m_thread)
+      {
+	Print(DBG_LEVEL_ERROR, "BrokerWorker::Connect(): %s is connected to %s already.\n",
+	      m_name.c_str(), m_server.c_str());
+	return false;
+      }
+    m_server = server;
+    char endpoint[256];
+    try
+      {
+	m_socket = ZMQ::Instance()->CreateSocket(ZMQ_DEALER, SOCKET_CLIENT);
+	m_socket->setsockopt(ZMQ_IDENTITY, m_name.c_str(), m_name.size()+1);
+	snprintf(endpoint, sizeof(endpoint), "tcp://%s", server.c_str());
+	m_socket->connect(endpoint);
+      }
+    catch(zmq::error_t& e)
+      {
+	Print(DBG_LEVEL_ERROR, "BrokerWorker::Connect(): zmq::exception %s\n", e.what());
+	throw Exception("BrokerWorker::Connect(): fatal error.");
+      }
+    m_isRunning = true;
+    m_thread = new std::thread(&BrokerWorker::worker_thread, this);
+    return true;
+  }
+
+  void BrokerWorker::Stop()
+  {
+    m_isRunning = false;
+  }
+
+  void BrokerWorker::worker_thread()
+  {
+    Print(DBG_LEVEL_DEBUG, "Start of %s worker's thread.\n", m_name.c_str());
+    Affinity::Apply(THREAD_SERVER, m_name);
+    DlgMessage hello(std::string(""), m_name, m_server, WORKER_HELLO, std::string(""));
+    if (!hello.Send(m_socket))
+      Print(DBG_LEVEL_ERROR, "BrokerWorker: %s couldn't greet the server.\n", m_name.c_str());
+
+    int64_t reported_at = current_time();
+    while (m_isRunning)
+      {
+	zmq::pollitem_t items[] = {
+	  { static_cast<void*>(*m_socket), 0, ZMQ_POLLIN, 0 } };
+	zmq::poll(&items[0], 1, (long)HEARTBEAT_INTERVAL/1000);
+
+	int64_t now = current_time();
+	if (now - reported_at >= HEARTBEAT_INTERVAL)
+	  {
+	    send_load(now - reported_at);
+	    delete_retired(now);
+	    reported_at = now;
+	  }
+
+	if (!(items[0].revents & ZMQ_POLLIN))
+	  continue;
+	DlgMessage *msg = new DlgMessage;
+	if (!msg->Recv(m_socket))
+	  {
+	    Print(DBG_LEVEL_ERROR, "BrokerWorker: message receiving error.\n");
+	    delete msg;
+	    continue;
+	  }
+	uint32_t msgType = 0;
+	if (!msg->GetMessageType(msgType))
+	  {
+	    Print(DBG_LEVEL_ERROR, "BrokerWorker: bad message received (cannot get message type).\n");
+	    delete msg;
+	    continue;
+	  }
+	//the registry deletes what isn't handled
+	handlers().Dispatch(this, msgType, msg, "BrokerWorker::worker_thread()");
+      }
+    Print(DBG_LEVEL_DEBUG, "End of %s worker's thread.\n", m_name.c_str());
+  }
+
+  //Orders of the server
+  const message_registry_t<BrokerWorker>& BrokerWorker::handlers()
+  {
+    static const message_registry_t<BrokerWorker> registry = []()
+      {
+	message_registry_t<BrokerWorker> r;
+	r.Register(CREATE_BROKER, &BrokerWorker::create_broker, "create broker");
+	r.Register(MOVE_BROKER,   &BrokerWorker::move_broker,   "move broker");
+	return r;
+      }();
+    return registry;
+  }
+
+  //Line per broker: service, messages/sec since the last report, subscribers
+  void BrokerWorker::send_load(int64_t elapsed)
+  {
+    std::string body;
+    for (auto &v : m_brokers)
+      {
+	uint64_t published = v.second->GetPublished();
+	uint64_t rate = (published - m_reported[v.first]) * 1000000 / (elapsed > 0 ? elapsed : 1);
+	m_reported[v.first] = published;
+	char line[512];
+	snprintf(line, sizeof(line), "%s %llu %lu\n", v.first.c_str(), (unsigned long long)rate,
+		 (unsigned long)v.second->GetSubscriberCount());
+	body += line;
+      }
+    DlgMessage load(std::string(""), m_name, m_server, WORKER_LOAD, body);
+    if (!load.Send(m_socket))
+      Print(DBG_LEVEL_ERROR, "BrokerWorker: %s couldn't report its load.\n", m_name.c_str());
+  }
+
+  void BrokerWorker::delete_retired(int64_t now)
+  {
+    size_t i = 0;
+    while (i < m_retired.size())
+      {
+	if (m_retired[i].deleteAt > now)
+	  {
+	    i++;
+	    continue;
+	  }
+	delete m_retired[i].broker;
+	m_retired[i] = m_retired.back();
+	m_retired.pop_back();
+      }
+  }
+
+  bool BrokerWorker::create_broker(DlgMessage *msg)
+  {
+    std::string serviceName;
+    uint64_t epoch = 0;
+    if (!msg->GetServiceName(serviceName) || !msg->GetEpoch(epoch))
+      {
+	Print(DBG_LEVEL_ERROR, "BrokerWorker::create_broker: bad message received.\n");
+	return false;
+      }
+    aBroker* broker = m_brokers[serviceName];
+    if (!broker)
+      {
+	broker = new aBroker(serviceName.c_str(), BROKER_ROUTER, m_address.c_str());
+	m_brokers[serviceName] = broker;
+	m_reported[serviceName] = 0;
+      }
+    broker->SetEpoch(epoch);
+    Print(DBG_LEVEL_VERBOSE, "BrokerWorker: %s runs broker of '%s' at %s.\n",
+	  m_name.c_str(), serviceName.c_str(), broker->GetPort().c_str());
+
+    DlgMessage reply(serviceName, m_name, m_server, BROKER_CREATED, broker->GetPort());
+    reply.SetEpoch(epoch);
+    if (!reply.Send(m_socket))
+      {
+	Print(DBG_LEVEL_ERROR, "BrokerWorker::create_broker: couldn't send a reply.\n");
+	return false;
+      }
+    delete msg;
+    return true;
+  }
+
+  //The broker stays until its clients have gone over to the new one
+  bool BrokerWorker::move_broker(DlgMessage *msg)
+  {
+    std::string serviceName;
+    std::string endpoint;
+    if (!msg->GetServiceName(serviceName) || !msg->GetMessageBody(endpoint))
+      {
+	Print(DBG_LEVEL_ERROR, "BrokerWorker::move_broker: bad message received.\n");
+	return false;
+      }
+    std::map<std::string, aBroker*>::iterator it = m_brokers.find(serviceName);
+    if (it == m_brokers.end())
+      {
+	Print(DBG_LEVEL_ERROR, "BrokerWorker::move_broker: no broker of '%s'.\n", serviceName.c_str());
+	return false;
+      }
+    it->second->MoveTo(endpoint);
+    retired_t retired = { it->second, current_time() + BROKER_DRAIN_TIME };
+    m_retired.push_back(retired);
+    m_brokers.erase(it);
+    m_reported.erase(serviceName);
+    delete msg;
+    return true;
+  }
+
+} // namespace ZmqDialog
@@ -0,0 +1,123 @@
+#include <algorithm>
+
+#include "DlgDispatcher.h"
+#include "Affinity.h"
+#include "Debug.h"
+
+namespace ZmqDialog
+{
+
+  DlgDispatcher::DlgDispatcher(size_t nThreads)
+  {
+    m_isRunning = true;
+    if(nThreads == 0)
+      nThreads = 1;
+    for(size_t i = 0; i < nThreads; i++)
+      m_threads.push_back(new std::thread(&DlgDispatcher::dispatch_thread, this));
+  }
+
+  DlgDispatcher::~DlgDispatcher()
+  {
+    m_mutex.lock();
+    m_isRunning = false;
+    m_mutex.unlock();
+    m_condition.notify_all();
+    for(size_t i = 0; i < m_threads.size(); i++)
+      {
+	if(m_threads[i]->joinable())
+	  m_threads[i]->join();
+	delete m_threads[i];
+      }
+    m_threads.clear();
+
+    //messages which weren't handled
+    for(size_t i = 0; i < m_ready.size(); i++)
+      {
+	std::deque<DlgMessage*>& messages = m_ready[i]->messages;
+	for(size_t j = 0; j < messages.size(); j++)
+	  delete messages[j];
+	messages.clear();
+      }
+    m_ready.clear();
+  }
+
+  std::shared_ptr<DlgDispatcher::strand_t> DlgDispatcher::Attach(const batch_handler_t& handler, size_t maxBatch)
+  {
+    std::shared_ptr<strand_t> strand(new strand_t);
+    strand->handler     = handler;
+    strand->maxBatch    = maxBatch ? maxBatch : 1;
+    strand->isScheduled = false;
+    strand->isHandled   = false;
+    strand->isDetached  = false;
+    return strand;
+  }
+
+  void DlgDispatcher::Detach(const std::shared_ptr<strand_t>& strand)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    strand->isDetached = true;
+    m_handled.wait(lock, [&strand] { return !strand->isHandled; });
+    for(size_t i = 0; i < strand->messages.size(); i++)
+      delete strand->messages[i];
+    strand->messages.clear();
+  }
+
+  void DlgDispatcher::Post(const std::shared_ptr<strand_t>& strand, DlgMessage* msg)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if(strand->isDetached)
+      {
+	lock.unlock();
+	delete msg;
+	return;
+      }
+    strand->messages.push_back(msg);
+    if(strand->isScheduled)
+      return;
+    strand->isScheduled = true;
+    m_ready.push_back(strand);
+    lock.unlock();
+    m_condition.notify_one();
+  }
+
+  void DlgDispatcher::dispatch_thread()
+  {
+    Affinity::Apply(THREAD_CLIENT, "dispatcher");
+    std::vector<DlgMessage*> batch;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(true)
+      {
+	m_condition.wait(lock, [this] { return !m_isRunning || !m_ready.empty(); });
+	if(!m_isRunning)
+	  break;
+	std::shared_ptr<strand_t> strand = m_ready.front();
+	m_ready.pop_front();
+	if(strand->isDetached)
+	  {
+	    strand->isScheduled = false;
+	    continue;
+	  }
+
+	size_t n = std::min(strand->maxBatch, strand->messages.size());
+	batch.assign(strand->messages.begin(), strand->messages.begin() + n);
+	strand->messages.erase(strand->messages.begin(), strand->messages.begin() + n);
+	strand->isHandled = true;
+	lock.unlock();
+
+	strand->handler(batch);
+	batch.clear();
+
+	lock.lock();
+	strand->isHandled = false;
+	//the rest waits behind the other strands
+	if(!strand->messages.empty() && !strand->isDetached)
+	  m_ready.push_back(strand);
+	else
+	  strand->isScheduled = false;
+	if(strand->isDetached)
+	  m_handled.notify_all();
+      }
+    Print(DBG_LEVEL_DEBUG, "End of dispatcher thread\n");
+  }
+
+} // namespace ZmqDialog
@@ -32,13 +32,13 @@ namespace ZmqDialog
     if(idx >= (int)m_data.size())
       return false;
     uint32_t buf_size = (uint32_t)size;
-    byte_array_t s(sizeof(buf_size)+size);
+    if(idx < 0) // negative index or next to last
+      m_data.push_back(byte_array_t());
+    //rewritten in place, a frame reallocates only when it grows
+    byte_array_t& s = (idx < 0) ? m_data.back() : m_data[idx];
+    s.resize(sizeof(buf_size)+size);
     memcpy(s.data(),&buf_size,sizeof(buf_size));
     memcpy(s.data()+sizeof(buf_size),buf,buf_size);
-    if(idx >= 0 && idx < (int)m_data.size())
-      m_data[idx] = s;
-    else // negative index or next to last
-      m_data.push_back(s);
     return true;
   }
 
@@ -47,28 +47,32 @@ namespace ZmqDialog
     if(idx > (int)m_data.size())
       return false;
     uint32_t str_size = strlen(str)+1;
+    if(idx >= 0 && idx < (int)m_data.size())
+      {
+	byte_array_t& frame = m_data[idx];
+	frame.resize(sizeof(str_size)+str_size);
+	memcpy(frame.data(),&str_size,sizeof(str_size));
+	memcpy(frame.data()+sizeof(str_size),str,str_size);
+	return true;
+      }
     byte_array_t s(sizeof(str_size)+str_size);
     memcpy(s.data(),&str_size,sizeof(str_size));
     memcpy(s.data()+sizeof(str_size),str,str_size);
-    if(idx >= 0 && idx < (int)m_data.size())
-      m_data[idx] = s;
-    else // negative index or next to last
+    //negative index or next to last
+    try
       {
-	try
-	  {
-	    m_data.push_back(s);
-	  }
-	catch(std::exception& e)
-	  {
-	    Print(DBG_LEVEL_ERROR, "message_array_t::Update(): std::exception %s\n", e.what());
-	    throw Exception("message_array_t::Update(): fatal error.\n");
-	  }
-	catch(...)
-	  {
-	    Print(DBG_LEVEL_ERROR, "message_array_t::Update(): Something went wrong with m_data.push_back().\n");
-	    throw Exception("message_array_t::Update(): fatal error.\n");
-	  } 
+	m_data.push_back(s);
+      }
+    catch(std::exception& e)
+      {
+	Print(DBG_LEVEL_ERROR, "message_array_t::Update(): std::exception %s\n", e.what());
+	throw Exception("message_array_t::Update(): fatal error.\n");
       }
+    catch(...)
+      {
+	Print(DBG_LEVEL_ERROR, "message_array_t::Update(): Something went wrong with m_data.push_back().\n");
+	throw Exception("message_array_t::Update(): fatal error.\n");
+      } 
     return true;
   }
 
@@ -223,6 +227,8 @@ namespace ZmqDialog
     PushBack(to.c_str());
     PushBack(&msgType,sizeof(msgType));
     PushBack(body.c_str());
+    DlgHeader header = { PRIORITY_NORMAL, 0, 0, 0, 0, { 0, 0, 0, 0 }, 0 };
+    PushBack(&header,sizeof(header));
   }
 
   DlgMessage::DlgMessage() : message_array_t() 
@@ -233,12 +239,22 @@ namespace ZmqDialog
     uint32_t msgType = EMPTY_MESSAGE;
     PushBack(&msgType,sizeof(msgType));
     PushBack(""); // empty body
+    DlgHeader header = { PRIORITY_NORMAL, 0, 0, 0, 0, { 0, 0, 0, 0 }, 0 };
+    PushBack(&header,sizeof(header)); // header
   }
 
   DlgMessage::~DlgMessage()
   {
   }
 
+  size_t DlgMessage::GetSize() const
+  {
+    size_t size = 0;
+    for(size_t i = 0; i < m_data.size(); i++)
+      size += m_data[i].size();
+    return size;
+  }
+
   bool DlgMessage::GetServiceName(std::string& name)
   {
     const int idx = 0;
@@ -376,6 +392,18 @@ namespace ZmqDialog
     return true;
   }
 
+  const void* DlgMessage::GetMessageData(size_t& size)
+  {
+    const int idx = 4;
+    if(GetMessageArray()->GetNParts() < N_FIELDS || m_data[idx].size() < sizeof(uint32_t))
+      return nullptr;
+    uint32_t s = *(uint32_t*)m_data[idx].data();
+    if(s != m_data[idx].size()-sizeof(uint32_t))
+      return nullptr;
+    size = s;
+    return m_data[idx].data()+sizeof(uint32_t);
+  }
+
   bool DlgMessage::GetIdentity(std::string& identity)
   {  
     identity = (char*)m_identity.data();
@@ -389,6 +417,89 @@ namespace ZmqDialog
     return true;
   }
 
+  bool DlgMessage::GetHeader(DlgHeader& header)
+  {
+    const int idx = 5;
+    if(GetMessageArray()->GetNParts() < N_FIELDS || m_data[idx].size() != sizeof(uint32_t)+sizeof(DlgHeader))
+      return false;
+    uint32_t s = *(uint32_t*)m_data[idx].data();
+    if(s != sizeof(DlgHeader))
+      return false;
+    memcpy(&header,m_data[idx].data()+sizeof(uint32_t),sizeof(DlgHeader));
+    return true;
+  }
+
+  bool DlgMessage::GetPriority(uint32_t& priority)
+  {
+    DlgHeader header;
+    if(!GetHeader(header))
+      return false;
+    priority = header.priority;
+    return true;
+  }
+
+  bool DlgMessage::GetEpoch(uint64_t& epoch)
+  {
+    DlgHeader header;
+    if(!GetHeader(header))
+      return false;
+    epoch = header.epoch;
+    return true;
+  }
+
+  bool DlgMessage::GetCorrelation(uint64_t& correlation)
+  {
+    DlgHeader header;
+    if(!GetHeader(header))
+      return false;
+    correlation = header.correlation;
+    return true;
+  }
+
+  bool DlgMessage::SetHeader(const DlgHeader& header)
+  {
+    const int idx = 5;
+    //Header has fixed size, so it is rewritten in place
+    if(GetMessageArray()->GetNParts() >= N_FIELDS && m_data[idx].size() == sizeof(uint32_t)+sizeof(DlgHeader))
+      {
+	memcpy(m_data[idx].data()+sizeof(uint32_t),&header,sizeof(DlgHeader));
+	return true;
+      }
+    return GetMessageArray()->Update(idx,(void*)&header,sizeof(header));
+  }
+
+  bool DlgMessage::SetPriority(uint32_t priority)
+  {
+    if(priority >= N_PRIORITIES)
+      {
+	Print(DBG_LEVEL_ERROR,"DlgMessage::SetPriority(): wrong priority %u\n", priority);
+	return false;
+      }
+    DlgHeader header;
+    if(!GetHeader(header))
+      return false;
+    header.priority = priority;
+    return SetHeader(header);
+  }
+
+  bool DlgMessage::SetEpoch(uint64_t epoch)
+  {
+    DlgHeader header;
+    if(!GetHeader(header))
+      return false;
+    header.epoch = epoch;
+    return SetHeader(header);
+  }
+
+  bool DlgMessage::SetCorrelation(uint64_t correlation)
+  {
+    DlgHeader header;
+    if(!GetHeader(header))
+      return false;
+    header.correlation = correlation;
+    return SetHeader(header);
+  }
+
   bool DlgMessage::SetServiceName(const std::string& name)
   {
     return GetMessageArray()->Update(0,name.c_str());
@@ -419,6 +530,17 @@ namespace ZmqDialog
     return GetMessageArray()->Update(4,buf,size);
   }
 
+  void* DlgMessage::PrepareMessageBuffer(size_t size)
+  {
+    const int idx = 4;
+    if(GetMessageArray()->GetNParts() < N_FIELDS)
+      return nullptr;
+    uint32_t buf_size = (uint32_t)size;
+    m_data[idx].resize(sizeof(buf_size)+size);
+    memcpy(m_data[idx].data(),&buf_size,sizeof(buf_size));
+    return m_data[idx].data()+sizeof(buf_size);
+  }
+
   void DlgMessage::PrintMessage(FILE* out)
   {
     std::string str;
@@ -473,6 +595,17 @@ namespace ZmqDialog
 	return;	
       }
 
+    uint32_t priority = 0;
+    if (GetPriority(priority))
+      {
+	fprintf(out,"Priority: '%u'\n", priority);
+      }
+    else
+      {
+	fprintf(out,"Cannot get message header.\n");
+	return;
+      }
+
     if (GetIdentity(str))
       {
 	fprintf(out, "Identity: '%s'\n", str.c_str());
@@ -492,5 +625,67 @@ namespace ZmqDialog
 
   }
 
-} // namespace ZmqDialog
+  ////////////////////////// class DlgBatch ///////////////////////////
 
+  bool DlgBatch::Append(DlgMessage* msg)
+  {
+    const int idx[] = { 3, 4, 5 }; // type, body, header
+    if(!msg || msg->GetMessageArray()->GetNParts() < msg->N_FIELDS)
+      return false;
+    for(size_t i = 0; i < sizeof(idx)/sizeof(idx[0]); i++)
+      {
+	const std::vector<uint8_t>& frame = msg->m_data[idx[i]];
+	m_buffer.insert(m_buffer.end(), frame.begin(), frame.end());
+      }
+    m_count++;
+    return true;
+  }
+
+  bool DlgBatch::ToMessage(DlgMessage* msg)
+  {
+    if(!msg->SetMessageType(PUBLISH_BATCH_MESSAGE))
+      return false;
+    return msg->SetMessageBuffer(m_buffer.data(), m_buffer.size());
+  }
+
+  bool DlgBatch::Unpack(DlgMessage* batch, std::vector<DlgMessage*>& messages)
+  {
+    uint32_t msgType = 0;
+    if(!batch->GetMessageType(msgType) || msgType != PUBLISH_BATCH_MESSAGE)
+      return false;
+    const std::vector<uint8_t>& body = batch->m_data[4];
+    if(body.size() < sizeof(uint32_t))
+      return false;
+    const uint8_t* p   = body.data() + sizeof(uint32_t);
+    const uint8_t* end = body.data() + body.size();
+    const int idx[] = { 3, 4, 5 };
+    while(p < end)
+      {
+	DlgMessage* msg = new DlgMessage;
+	for(int i = 0; i < 3; i++)
+	  msg->m_data[i] = batch->m_data[i];
+	msg->m_identity = batch->m_identity;
+	for(size_t i = 0; i < sizeof(idx)/sizeof(idx[0]); i++)
+	  {
+	    uint32_t size = 0;
+	    if(end - p < (ptrdiff_t)sizeof(size))
+	      {
+		delete msg;
+		return false;
+	      }
+	    memcpy(&size, p, sizeof(size));
+	    if((size_t)(end - p) < sizeof(size) + size)
+	      {
+		Print(DBG_LEVEL_ERROR, "DlgBatch::Unpack(): broken batch entry.\n");
+		delete msg;
+		return false;
+	      }
+	    msg->m_data[idx[i]].assign(p, p + sizeof(size) + size);
+	    p += sizeof(size) + size;
+	  }
+	messages.push_back(msg);
+      }
+    return true;
+  }
+
+} // namespace ZmqDialog
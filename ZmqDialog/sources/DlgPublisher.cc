@@ -6,7 +6,13 @@
 namespace ZmqDialog {
 
 DlgPublisher::DlgPublisher(const std::string &name) : m_name(name), m_service(""),
-                          m_server(""), m_socket(nullptr)
+                          m_server(""), m_socket(nullptr),
+  m_directSocket(nullptr), m_state(CLIENT_DISCONNECTED), m_isConnected(false), m_isBrokerConnected(false),
+  m_sendQueue(new mpmc_ring_t<queued_t>(PUBLISHER_QUEUE_CAPACITY)),
+  m_isFlushRequested(false), m_isReconnectRequested(false), m_queueWaits(0), m_isTimed(false),
+  m_isBatching(false), m_batchBytes(PUBLISHER_BATCH_BYTES), m_batchDelay(PUBLISHER_BATCH_DELAY),
+  m_isCacheRequested(false), m_isCacheWaiting(false), m_cachedEpoch(0),
+  m_nextCorrelation(1), m_nextExpiry(0)
 {
     m_isRunning = true;
     m_thread = new std::thread(&DlgPublisher::publisher_thread, this);
@@ -14,7 +20,13 @@ DlgPublisher::DlgPublisher(const std::string &name) : m_name(name), m_service(""
 
 
 DlgPublisher::DlgPublisher(const std::string &name, const std::string &service) :
-  m_name(name), m_service(service), m_server(""), m_socket(nullptr)
+  m_name(name), m_service(service), m_server(""), m_socket(nullptr),
+  m_directSocket(nullptr), m_state(CLIENT_DISCONNECTED), m_isConnected(false), m_isBrokerConnected(false),
+  m_sendQueue(new mpmc_ring_t<queued_t>(PUBLISHER_QUEUE_CAPACITY)),
+  m_isFlushRequested(false), m_isReconnectRequested(false), m_queueWaits(0), m_isTimed(false),
+  m_isBatching(false), m_batchBytes(PUBLISHER_BATCH_BYTES), m_batchDelay(PUBLISHER_BATCH_DELAY),
+  m_isCacheRequested(false), m_isCacheWaiting(false), m_cachedEpoch(0),
+  m_nextCorrelation(1), m_nextExpiry(0)
 {
     m_isRunning = true;
     m_thread = new std::thread(&DlgPublisher::publisher_thread, this);
@@ -22,7 +34,13 @@ DlgPublisher::DlgPublisher(const std::string &name, const std::string &service)
 
 DlgPublisher::DlgPublisher(const std::string &name, const std::string &service,
                            const std::string &serverName) : m_name(name),
-                           m_service(service), m_server(serverName), m_socket(nullptr)
+                           m_service(service), m_server(serverName), m_socket(nullptr),
+  m_directSocket(nullptr), m_state(CLIENT_DISCONNECTED), m_isConnected(false), m_isBrokerConnected(false),
+  m_sendQueue(new mpmc_ring_t<queued_t>(PUBLISHER_QUEUE_CAPACITY)),
+  m_isFlushRequested(false), m_isReconnectRequested(false), m_queueWaits(0), m_isTimed(false),
+  m_isBatching(false), m_batchBytes(PUBLISHER_BATCH_BYTES), m_batchDelay(PUBLISHER_BATCH_DELAY),
+  m_isCacheRequested(false), m_isCacheWaiting(false), m_cachedEpoch(0),
+  m_nextCorrelation(1), m_nextExpiry(0)
 {
     m_isRunning = true;
     m_thread = new std::thread(&DlgPublisher::publisher_thread, this);
@@ -30,16 +48,39 @@ DlgPublisher::DlgPublisher(const std::string &name, const std::string &service,
 
 DlgPublisher::~DlgPublisher()
 {
+  //the thread sends what is queued and the batch before it ends
+  DisableBatching();
   m_isRunning = false;
+  m_wakeup.Signal();
   if (m_thread->joinable())
       m_thread->join();
   delete m_thread;
+  for (size_t i = 0; i < m_reconnectWaiters.size(); i++)
+      m_reconnectWaiters[i].set_value(false);
+  m_reconnectWaiters.clear();
 
+  queued_t item;
+  while (m_sendQueue->TryPop(item))
+      dispose(item);
+  delete m_sendQueue;
+  for (size_t i = 0; i < m_handles.size(); i++)
+      delete m_handles[i];
+  m_handles.clear();
+
+  //nobody will answer them now
+  std::map<uint64_t, request_t>::iterator it;
+  for (it = m_requests.begin(); it != m_requests.end(); ++it)
+      it->second.handler(nullptr);
+  m_requests.clear();
+
+ close_direct();
  close_connection();
 }
 
 bool DlgPublisher::SetServerName(const std::string &serverName)
 {
+    //the thread writes m_server when it connects
+    std::lock_guard<std::mutex> lock(m_mutex);
     if (m_server != "")
     {
         Print(DBG_LEVEL_ERROR,
@@ -57,6 +98,7 @@ bool DlgPublisher::Connect()
 {
     if (IsConnected())
     {
+        std::lock_guard<std::mutex> lock(m_mutex);
         Print(DBG_LEVEL_ERROR,
               "DlgPublisher::Connect(): "
               "Publisher %s already has active connection with %s .\n"
@@ -64,33 +106,102 @@ bool DlgPublisher::Connect()
               m_name.c_str(), m_server.c_str());
         return false;
     }
-    if (m_server == "")
-    {
-      Print(DBG_LEVEL_DEBUG,
-      "DlgPublisher::Connect(): Publisher %s has no server to connect\n", m_name.c_str());
-      return false;
-    }
-    return connect_to(m_server.c_str());
+    //the thread connects to m_server, or reports that there is none
+    return post_reconnect("", "");
 }
 
 bool DlgPublisher::Connect(const std::string &serverName)
 {
-    m_server = serverName;
-    return connect_to(m_server.c_str());
+    return ReConnect(serverName);
 }
 
 bool DlgPublisher::Connect(const char *serverName)
 {
-    m_server = std::string(serverName);
-    return connect_to(m_server.c_str());
+    return ReConnect(std::string(serverName));
 }
 
+//The thread owns m_socket: connected or not, it connects itself
 bool DlgPublisher::ReConnect(const std::string &serverName)
 {
-    if (IsConnected())
-        close_connection();
-    m_server = serverName;
-    return Connect();
+    return post_reconnect(serverName, "");
+}
+
+//An empty server is the current one. Waits for the thread's result, but
+//from the thread itself (a reply handler) it only posts the request.
+bool DlgPublisher::post_reconnect(const std::string &server, const std::string &service)
+{
+    if (!m_isRunning)
+        return false;
+    bool isThread = (std::this_thread::get_id() == m_thread->get_id());
+    std::future<bool> result;
+    m_mutex.lock();
+    m_reconnectServer  = server;
+    m_reconnectService = service;
+    if (!isThread)
+    {
+        m_reconnectWaiters.push_back(std::promise<bool>());
+        result = m_reconnectWaiters.back().get_future();
+    }
+    m_mutex.unlock();
+    m_isReconnectRequested = true;
+    m_wakeup.Signal();
+    return isThread || result.get();
+}
+
+//publisher_thread only. What was queued before the request goes to the old
+//peer, a new service is registered the way Register() does it. A failed
+//connect leaves the publisher CLIENT_DISCONNECTED.
+void DlgPublisher::reconnect()
+{
+    m_mutex.lock();
+    std::string server  = m_reconnectServer;
+    std::string service = m_reconnectService;
+    std::vector<std::promise<bool> > waiters;
+    waiters.swap(m_reconnectWaiters);
+    m_mutex.unlock();
+
+    if (m_socket)
+        flush_batch();
+    m_isCacheWaiting = false;
+    if (!service.empty())
+        close_direct();
+    if (!server.empty())
+    {
+        m_mutex.lock();
+        m_server = server;
+        m_mutex.unlock();
+    }
+
+    bool isDone = false;
+    if (m_server.empty())
+        Print(DBG_LEVEL_ERROR, "DlgPublisher::reconnect(): Publisher %s has no server to connect.\n",
+              m_name.c_str());
+    else if (!connect_to(m_server.c_str()))
+    {
+        Print(DBG_LEVEL_ERROR, "DlgPublisher::reconnect(): Publisher %s couldn't connect to %s.\n",
+              m_name.c_str(), m_server.c_str());
+    }
+    else if (service.empty())
+        isDone = true;
+    else
+    {
+        m_service = service;
+        std::string endpoint;
+        uint64_t epoch = 0;
+        if (ServiceCache::Find(m_service, endpoint, epoch))
+        {
+            m_mutex.lock();
+            m_cachedEndpoint = endpoint;
+            m_cachedEpoch    = epoch;
+            m_mutex.unlock();
+            register_cached();
+            isDone = true;
+        }
+        else
+            isDone = send_register(0);
+    }
+    for (size_t i = 0; i < waiters.size(); i++)
+        waiters[i].set_value(isDone);
 }
 
 bool DlgPublisher::Register()
@@ -111,16 +222,35 @@ bool DlgPublisher::Register()
       return false;
   }
 
-  DlgMessage *msg = new DlgMessage(m_service, m_name, m_server, REGISTER_PUBLISHER, std::string(""));
-  if (!msg->SetIdentity(m_name))
+  //the thread owns the socket, it connects to the cached broker itself
+  std::string endpoint;
+  uint64_t epoch = 0;
+  if (ServiceCache::Find(m_service, endpoint, epoch))
   {
-      Print(DBG_LEVEL_ERROR,
-            "DlgPublisher::Register(): Coldn't set identity for %s publisher\n",
-            m_name.c_str());
-      delete msg;
-      return false;
+      m_mutex.lock();
+      m_cachedEndpoint = endpoint;
+      m_cachedEpoch    = epoch;
+      m_mutex.unlock();
+      m_isCacheRequested = true;
+      m_wakeup.Signal();
+      return true;
   }
+  return post_message(register_message(0));
+}
+
+//Epoch 0 goes to the server, anything else to the cached broker
+DlgMessage* DlgPublisher::register_message(uint64_t epoch)
+{
+  DlgMessage *msg = new DlgMessage(m_service, m_name, m_server, REGISTER_PUBLISHER, std::string(""));
+  msg->SetEpoch(epoch);
+  msg->SetIdentity(m_name);
+  return msg;
+}
 
+//publisher_thread only
+bool DlgPublisher::send_register(uint64_t epoch)
+{
+  DlgMessage *msg = register_message(epoch);
   if (!msg->Send(m_socket))
   {
       Print(DBG_LEVEL_ERROR,
@@ -134,20 +264,76 @@ bool DlgPublisher::Register()
   return true;
 }
 
-bool DlgPublisher::ReRegister(const std::string &serviceName)
+void DlgPublisher::register_cached()
 {
-    if (IsConnected())
-        close_connection();
+    m_mutex.lock();
+    std::string endpoint = m_cachedEndpoint;
+    uint64_t    epoch    = m_cachedEpoch;
+    m_mutex.unlock();
+    Print(DBG_LEVEL_DEBUG, "DlgPublisher: %s tries cached broker '%s' of %s.\n",
+          m_name.c_str(), endpoint.c_str(), m_service.c_str());
+    m_isCacheWaiting = true;
+    m_cacheDeadline  = std::chrono::steady_clock::now() + std::chrono::microseconds(DIRECTORY_CACHE_TIMEOUT);
+    if (!connect_to(endpoint.c_str()) || !send_register(epoch))
+        fallback_to_server();
+}
+
+//The cached broker is gone, moved or doesn't answer: ask the server
+void DlgPublisher::fallback_to_server()
+{
+    Print(DBG_LEVEL_DEBUG, "DlgPublisher: %s falls back to server %s.\n", m_name.c_str(), m_server.c_str());
+    ServiceCache::Invalidate(m_service, m_cachedEpoch);
+    m_isCacheWaiting = false;
+    if (!connect_to(m_server.c_str()))
+        return;
+    send_register(0);
+}
 
-    if (!Connect(server_address))
+bool DlgPublisher::ReRegister(const std::string &serviceName)
+{
+    if (serviceName.empty())
     {
         Print(DBG_LEVEL_ERROR,
-              "DlgPublisher::ReRegister(): "
-              "Couldn't connect to new server %s.\n", server_address);
+              "DlgPublisher::ReRegister(): Publisher %s has no service to register at.\n",
+              m_name.c_str());
         return false;
     }
-    m_service = serviceName;
-    return Register();
+    //the thread closes its sockets and registers itself at the current server
+    return post_reconnect("", serviceName);
+}
+
+bool DlgPublisher::RegisterDirect(const std::string &address)
+{
+  if (!IsConnected())
+  {
+      Print(DBG_LEVEL_ERROR,
+            "DlgPublisher::RegisterDirect(): Publisher %s has no any active connections\n",
+            m_name.c_str());
+      return false;
+  }
+
+  if (m_service == "")
+  {
+      Print(DBG_LEVEL_ERROR,
+            "DlgPublisher::RegisterDirect(): Publisher %s has no any active services\n",
+            m_name.c_str());
+      return false;
+  }
+
+  if (!bind_direct(address.c_str()))
+      return false;
+
+  DlgMessage *msg = new DlgMessage(m_service, m_name, m_server, REGISTER_DIRECT_PUBLISHER, m_directEndpoint);
+  msg->SetIdentity(m_name);
+  if (!post_message(msg))
+  {
+      Print(DBG_LEVEL_ERROR,
+            "DlgPublisher::RegisterDirect(): Publisher %s coldn't send "
+            "a request to register at %s service\n",
+            m_name.c_str(), m_service.c_str());
+      return false;
+  }
+  return true;
 }
 
 bool DlgPublisher::PublishMessage(DlgMessage *msg)
@@ -165,54 +351,422 @@ bool DlgPublisher::PublishMessage(DlgMessage *msg)
       return false;
     }
 
+  return post_message(new DlgMessage(*msg));
+}
 
-  if (!msg->Send(m_socket))
+bool DlgPublisher::PostMessage(DlgMessage *msg)
+{
+  if (!msg->SetIdentity(m_name) || !msg->SetServiceName(m_service))
+    {
+      Print(DBG_LEVEL_ERROR, "DlgPublisher::PostMessage(): Couldn't prepare message of '%s' \n", m_name.c_str());
+      delete msg;
+      return false;
+    }
+  return post_message(msg);
+}
+
+//Takes ownership of msg. A full queue means the thread is behind, the
+//caller waits for it rather than lose the message.
+bool DlgPublisher::post_message(DlgMessage *msg, DlgPublishHandle *handle)
+{
+  if (m_isTimed)
+    stamp_published(msg);
+  queued_t item = { msg, handle };
+  bool hasWaited = false;
+  while (!m_sendQueue->TryPush(item))
+    {
+      if (!hasWaited)
+        {
+          hasWaited = true;
+          m_queueWaits.fetch_add(1, std::memory_order_relaxed);
+        }
+      if (!m_isRunning)
+        {
+          dispose(item);
+          return false;
+        }
+      m_wakeup.Signal();
+      std::this_thread::yield();
+    }
+  m_wakeup.Notify();
+  return true;
+}
+
+//Data messages only, the time is taken by the caller before the queue
+void DlgPublisher::stamp_published(DlgMessage *msg)
+{
+  uint32_t msgType = 0;
+  DlgHeader header;
+  if (!msg->GetMessageType(msgType) || !msg->GetHeader(header) ||
+      (msgType != PUBLISH_TEXT_MESSAGE && msgType != PUBLISH_BINARY_MESSAGE))
+    return;
+  header.flags |= HEADER_FLAG_TIMED;
+  for (int i = 0; i < N_STAMPS; i++)
+    header.stamps[i] = 0;
+  header.stamps[STAMP_PUBLISH] = latency_clock_t::Now();
+  header.host = latency_clock_t::HostId();
+  msg->SetHeader(header);
+}
+
+void DlgPublisher::dispose(const queued_t &item)
+{
+  if (item.handle)
+    item.handle->Release(item.msg);
+  else
+    delete item.msg;
+}
+
+DlgPublishHandle* DlgPublisher::Prepare(uint32_t msgType, size_t poolSize, uint64_t fingerprint)
+{
+  if (m_service == "" ||
+      (msgType != PUBLISH_TEXT_MESSAGE && msgType != PUBLISH_BINARY_MESSAGE))
     {
-      Print(DBG_LEVEL_ERROR, "DlgPublisher::PublishMessage(): Couldn't send message \n");
+      Print(DBG_LEVEL_ERROR, "DlgPublisher::Prepare(): Publisher %s cannot publish type %u to '%s'.\n",
+            m_name.c_str(), msgType, m_service.c_str());
+      return nullptr;
+    }
+  DlgPublishHandle *handle = new DlgPublishHandle(this, m_name, m_service, msgType, poolSize, fingerprint);
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_handles.push_back(handle);
+  return handle;
+}
+
+bool DlgPublisher::Request(DlgMessage *msg, const reply_handler_t &handler, uint32_t timeout)
+{
+  if (IsDirect())
+    {
+      Print(DBG_LEVEL_ERROR, "DlgPublisher::Request(): requests need a broker, %s is direct.\n", m_name.c_str());
+      return false;
+    }
+  uint64_t correlation = m_nextCorrelation++;
+  if (!msg->SetIdentity(m_name) || !msg->SetServiceName(m_service) ||
+      !msg->SetFromAddress(m_name) || !msg->SetMessageType(REQUEST_MESSAGE) ||
+      !msg->SetCorrelation(correlation))
+    {
+      Print(DBG_LEVEL_ERROR, "DlgPublisher::Request(): Couldn't prepare request of '%s' \n", m_name.c_str());
       return false;
     }
 
+  //queued behind the messages published before it
+  request_t request = { handler, std::chrono::steady_clock::now() + std::chrono::microseconds(timeout) };
+  int64_t expiry = request.deadline.time_since_epoch().count();
+  m_mutex.lock();
+  m_requests[correlation] = request;
+  if (m_nextExpiry == 0 || expiry < m_nextExpiry)
+    m_nextExpiry = expiry;
+  m_mutex.unlock();
+  if (!post_message(new DlgMessage(*msg)))
+    {
+      Print(DBG_LEVEL_ERROR, "DlgPublisher::Request(): Couldn't send request \n");
+      m_mutex.lock();
+      m_requests.erase(correlation);
+      m_mutex.unlock();
+      return false;
+    }
   return true;
 }
 
+std::future<DlgMessage*> DlgPublisher::Request(DlgMessage *msg, uint32_t timeout)
+{
+  std::shared_ptr<std::promise<DlgMessage*> > reply(new std::promise<DlgMessage*>());
+  std::future<DlgMessage*> future = reply->get_future();
+  if (!Request(msg, [reply](DlgMessage *msg) { reply->set_value(msg); }, timeout))
+    reply->set_value(nullptr);
+  return future;
+}
+
+size_t DlgPublisher::PendingRequests()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_requests.size();
+}
+
+bool DlgPublisher::EnableBatching(size_t maxBytes, uint32_t maxDelay)
+{
+    if (maxBytes == 0)
+    {
+        Print(DBG_LEVEL_ERROR,
+              "DlgPublisher::EnableBatching(): batch size must be positive.\n");
+        return false;
+    }
+    m_batchBytes = maxBytes;
+    m_batchDelay = maxDelay;
+    m_isBatching = true;
+    return true;
+}
+
+bool DlgPublisher::DisableBatching()
+{
+    m_isBatching = false;
+    return Flush();
+}
+
+bool DlgPublisher::Flush()
+{
+    m_isFlushRequested = true;
+    m_wakeup.Signal();
+    return true;
+}
+
+void DlgPublisher::GetStats(client_stats_t &stats)
+{
+    stats.messages       = m_sentMessages.Get();
+    stats.bytes          = m_sentBytes.Get();
+    stats.batches        = m_sentBatches.Get();
+    stats.errors         = m_sendErrors.Get();
+    stats.dropped        = 0;
+    stats.queueWaits     = m_queueWaits.load(std::memory_order_relaxed);
+    stats.queued         = m_sendQueue->Size();
+    stats.queueHighWater = 0;
+}
+
+//publisher_thread only
+bool DlgPublisher::flush_batch()
+{
+    if (m_batch.GetCount() == 0)
+        return true;
+
+    DlgMessage msg(m_service, m_name, std::string(""), PUBLISH_BATCH_MESSAGE, std::string(""));
+    bool isSent = m_batch.ToMessage(&msg) && msg.SetIdentity(m_name) && msg.Send(data_socket());
+    if (isSent)
+        m_sentBatches.Add();
+    else
+        Print(DBG_LEVEL_ERROR,
+              "DlgPublisher::flush_batch(): Couldn't send batch of %lu messages\n",
+              (unsigned long)m_batch.GetCount());
+    m_batch.Clear();
+    return isSent;
+}
+
+//Poll timeout until deadline: msecs rounded up, so the poll doesn't end
+//before it. Poll counts whole msecs, a shorter wait takes one.
+static long msecs_until(const std::chrono::steady_clock::time_point &deadline)
+{
+    std::chrono::steady_clock::duration left = deadline - std::chrono::steady_clock::now();
+    if (left <= std::chrono::steady_clock::duration::zero())
+        return 0;
+    std::chrono::milliseconds msecs = std::chrono::duration_cast<std::chrono::milliseconds>(left);
+    if (msecs < left)
+        ++msecs;
+    return (long)msecs.count();
+}
+
+//msecs until the batch is due, -1 without a batch
+long DlgPublisher::batch_timeout()
+{
+    if (m_batch.GetCount() == 0)
+        return -1;
+    return msecs_until(m_batchDeadline);
+}
+
+bool DlgPublisher::is_batch_due()
+{
+    return m_batch.GetCount() != 0 && std::chrono::steady_clock::now() >= m_batchDeadline;
+}
+
+//msecs until the nearest request deadline, -1 without requests
+long DlgPublisher::request_timeout()
+{
+    int64_t expiry = m_nextExpiry;
+    if (expiry == 0)
+        return -1;
+    return msecs_until(std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(expiry)));
+}
+
+//publisher_thread only: requests without a reply in time get nullptr
+void DlgPublisher::expire_requests()
+{
+    int64_t expiry = m_nextExpiry;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (expiry == 0 || now.time_since_epoch().count() < expiry)
+        return;
+
+    std::vector<reply_handler_t> expired;
+    m_mutex.lock();
+    int64_t next = 0;
+    std::map<uint64_t, request_t>::iterator it = m_requests.begin();
+    while (it != m_requests.end())
+    {
+        if (it->second.deadline <= now)
+        {
+            expired.push_back(reply_handler_t());
+            expired.back().swap(it->second.handler);
+            m_requests.erase(it++);
+            continue;
+        }
+        int64_t deadline = it->second.deadline.time_since_epoch().count();
+        if (next == 0 || deadline < next)
+            next = deadline;
+        ++it;
+    }
+    m_nextExpiry = next;
+    m_mutex.unlock();
+
+    if (!expired.empty())
+        Print(DBG_LEVEL_DEBUG, "DlgPublisher %s: %lu request(s) without a reply.\n",
+              m_name.c_str(), (unsigned long)expired.size());
+    //the handlers may send other requests
+    for (size_t i = 0; i < expired.size(); i++)
+        expired[i](nullptr);
+}
+
+//Sends what is queued, at most PUBLISHER_MAX_SEND_BATCH messages a cycle
+void DlgPublisher::drain_queue()
+{
+    queued_t item;
+    for (int n = 0; n < PUBLISHER_MAX_SEND_BATCH && m_sendQueue->TryPop(item); ++n)
+    {
+        //posted after ReConnect(), it goes to the new peer
+        if (m_isReconnectRequested.exchange(false))
+            reconnect();
+        send_queued(item);
+    }
+}
+
+//Data goes to data_socket() (or into the batch), anything else to m_socket
+void DlgPublisher::send_queued(const queued_t &item)
+{
+    DlgMessage *msg = item.msg;
+    uint32_t msgType = 0;
+    msg->GetMessageType(msgType);
+    bool isData = (msgType == PUBLISH_TEXT_MESSAGE || msgType == PUBLISH_BINARY_MESSAGE);
+    if (isData && m_isBatching)
+    {
+        if (m_batch.GetCount() == 0)
+            m_batchDeadline = std::chrono::steady_clock::now() +
+                              std::chrono::microseconds(m_batchDelay);
+        if (m_batch.Append(msg))
+        {
+            m_sentMessages.Add();
+            m_sentBytes.Add(msg->GetSize());
+        }
+        else
+        {
+            m_sendErrors.Add();
+            Print(DBG_LEVEL_ERROR, "DlgPublisher::send_queued(): Couldn't add message to batch\n");
+        }
+        if (m_batch.GetSize() >= m_batchBytes)
+            flush_batch();
+        dispose(item);
+        return;
+    }
+    //nothing overtakes the batch
+    flush_batch();
+    size_t size = msg->GetSize();
+    if (!msg->Send(isData ? data_socket() : m_socket))
+    {
+        m_sendErrors.Add();
+        Print(DBG_LEVEL_ERROR, "DlgPublisher::send_queued(): Couldn't send message \n");
+    }
+    else if (isData)
+    {
+        m_sentMessages.Add();
+        m_sentBytes.Add(size);
+    }
+    dispose(item);
+}
+
 bool DlgPublisher::connect_to(const char *serverName)
 {
-  if (IsConnected())
+  if (m_socket)
       close_connection();
 
-  m_socket = ZMQ::Instance()->CreateSocket(ZMQ_DEALER);
-  m_socket->setsockopt(ZMQ_IDENTITY, m_name.c_str(), m_name.size() + 1);
-
+  //the endpoint may come from the network (a broker port): a bad one is
+  //an error of this connection, the thread goes on
   char endpoint[256];
   try
     {
-      sprintf(endpoint, "tcp://%s", serverName);
+      if (snprintf(endpoint, sizeof(endpoint), "tcp://%s", serverName) >= (int)sizeof(endpoint))
+        {
+          Print(DBG_LEVEL_ERROR, "DlgPublisher::connect_to() endpoint '%s' is too long\n", serverName);
+          return false;
+        }
+      m_socket = ZMQ::Instance()->CreateSocket(ZMQ_DEALER, SOCKET_CLIENT);
+      m_socket->setsockopt(ZMQ_IDENTITY, m_name.c_str(), m_name.size() + 1);
       m_socket->connect(endpoint);
     }
   catch(zmq::error_t& e)
     {
       Print(DBG_LEVEL_ERROR, "DlgPublisher::connect_to() zmq::exception %s\n", e.what());
-      throw Exception("DlgPublisher::connect_to() fatal error.");
+      close_connection();
+      return false;
     }
   catch(std::exception& e)
     {
       Print(DBG_LEVEL_ERROR, "DlgPublisher::connect_to() std::exception %s\n", e.what());
-      throw Exception("DlgPublisher::connect_to() fatal error.");
+      close_connection();
+      return false;
     }
   catch(...)
     {
       Print(DBG_LEVEL_ERROR, "DlgPublisher::connect_to() unknown exeption.\n");
-      throw Exception("DlgPublisher::connect_to() fatal error.");
+      close_connection();
+      return false;
     }
+ m_endpoint = serverName;
+ m_isConnected = true;
+ //out of CLIENT_DISCONNECTED, or a handshake with another peer
+ m_wakeup.Signal();
  return true;
 }
 
+bool DlgPublisher::bind_direct(const char *address)
+{
+  close_direct();
+
+  char endpoint[256];
+  try
+    {
+      m_directSocket = ZMQ::Instance()->CreateSocket(ZMQ_PUB, SOCKET_DIRECT);
+      sprintf(endpoint, "tcp://%s:0", address); // bind to any port
+      m_directSocket->bind(endpoint);
+      size_t size = sizeof(endpoint);
+      m_directSocket->getsockopt(ZMQ_LAST_ENDPOINT, &endpoint, &size);
+    }
+  catch(zmq::error_t& e)
+    {
+      Print(DBG_LEVEL_ERROR, "DlgPublisher::bind_direct() zmq::exception %s\n", e.what());
+      close_direct();
+      return false;
+    }
+  //To skip "tcp://" part -> (endpoint + 6)
+  m_directEndpoint = std::string(endpoint + 6);
+  Print(DBG_LEVEL_DEBUG, "DlgPublisher::bind_direct(): %s publishes at '%s'\n",
+        m_name.c_str(), m_directEndpoint.c_str());
+  return true;
+}
+
+void DlgPublisher::close_direct()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   if (m_directSocket)
+       m_directSocket->close();
+   delete m_directSocket;
+   m_directSocket = nullptr;
+   m_directEndpoint = "";
+}
+
 void DlgPublisher::close_connection()
 {
+   m_isBrokerConnected = false;
+   m_isConnected = false;
    if (m_socket)
        m_socket->close();
    delete m_socket;
    m_socket = nullptr;
+   m_endpoint.clear();
+}
+
+//CLIENT_HANDSHAKE lasts from Connect() to the broker's answer
+ClientState DlgPublisher::next_state()
+{
+    if (!m_isRunning)
+        return CLIENT_DRAINING;
+    if (!m_socket)
+        return CLIENT_DISCONNECTED;
+    if (m_isBrokerConnected && !m_isCacheWaiting)
+        return CLIENT_CONNECTED;
+    return CLIENT_HANDSHAKE;
 }
 
 void DlgPublisher::publisher_thread()
@@ -220,17 +774,65 @@ void DlgPublisher::publisher_thread()
     Print(DBG_LEVEL_DEBUG,
           "Start of %s publisher's thread\n",
           m_name.c_str());
+    Affinity::Apply(THREAD_CLIENT, m_name);
 
-    while (m_isRunning)
+    while (true)
     {
-        if (!IsConnected())
+        if (m_isRunning && m_isReconnectRequested.exchange(false))
+            reconnect();
+
+        ClientState state = next_state();
+        if (state != m_state.exchange(state))
+            Print(DBG_LEVEL_DEBUG, "Publisher %s is %s\n", m_name.c_str(), ClientStateName(state));
+        if (state == CLIENT_DRAINING)
+            break;
+
+        //nothing to send to, sleeps until Connect() or the destructor
+        if (state == CLIENT_DISCONNECTED)
+        {
+            zmq::pollitem_t wake = { nullptr, m_wakeup.Fd(), ZMQ_POLLIN, 0 };
+            m_wakeup.Sleep();
+            if (m_socket || !m_isRunning || m_isReconnectRequested)
+                wake.revents = 0;
+            else
+                zmq::poll(&wake, 1, request_timeout());
+            m_wakeup.Awake(wake.revents & ZMQ_POLLIN);
+            expire_requests();
             continue;
+        }
+
+        if (m_isCacheRequested.exchange(false))
+            register_cached();
+
+        drain_queue();
+        if (m_isFlushRequested.exchange(false) || !m_isBatching || is_batch_due())
+            flush_batch();
 
         zmq::pollitem_t items[] = {
-            { static_cast<void*>(*m_socket), 0, ZMQ_POLLIN, 0 }
+            { static_cast<void*>(*m_socket), 0, ZMQ_POLLIN, 0 },
+            { nullptr, m_wakeup.Fd(), ZMQ_POLLIN, 0 }
         };
 
-        zmq::poll(items, 1, (long)TIMEOUT_INTERVAL/1000);
+        //sleeps until a reply, a producer, the batch or a request deadline
+        long timeout = batch_timeout();
+        long requestTimeout = request_timeout();
+        if (requestTimeout >= 0 && (timeout < 0 || timeout > requestTimeout))
+            timeout = requestTimeout;
+        if (m_isCacheWaiting && (timeout < 0 || timeout > (long)DIRECTORY_CACHE_TIMEOUT/1000))
+            timeout = (long)DIRECTORY_CACHE_TIMEOUT/1000;
+        //a producer which didn't see the thread asleep has its message queued
+        m_wakeup.Sleep();
+        if (!m_sendQueue->Empty() || m_isFlushRequested || m_isCacheRequested || m_isReconnectRequested ||
+            !m_isRunning)
+            timeout = 0;
+        zmq::poll(items, 2, timeout);
+        m_wakeup.Awake(items[1].revents & ZMQ_POLLIN);
+
+        if (m_isCacheWaiting && !(items[0].revents & ZMQ_POLLIN) &&
+            std::chrono::steady_clock::now() >= m_cacheDeadline)
+            fallback_to_server();
+
+        expire_requests();
 
         if (items[0].revents & ZMQ_POLLIN)
         {
@@ -250,22 +852,43 @@ void DlgPublisher::publisher_thread()
                 delete msg;
                 continue;
               }
-            //reply from server
-            if (msgType == REGISTER_PUBLISHER && !register_publisher(msg))
-              {
-                Print(DBG_LEVEL_ERROR,"DlgPublisher::publisher_thread(): "
-                                      "Couldn't register publisher.\n");
-                delete msg;
-                continue;
-              }
+            handlers().Dispatch(this, msgType, msg, "DlgPublisher::publisher_thread()");
         }
 
     }
+    //what was published before the publisher is destroyed still goes out
+    if (m_socket)
+    {
+        while (!m_sendQueue->Empty())
+            drain_queue();
+        flush_batch();
+    }
     Print(DBG_LEVEL_DEBUG,
           "End of %s publisher's thread\n",
           m_name.c_str());
 }
 
+//Handlers of messages from the server, the broker and subscribers
+const message_registry_t<DlgPublisher>& DlgPublisher::handlers()
+{
+    static const message_registry_t<DlgPublisher> registry = []()
+    {
+        message_registry_t<DlgPublisher> r;
+        //reply from server
+        r.Register(REGISTER_PUBLISHER,        &DlgPublisher::register_publisher, "register publisher");
+        //reply from a cached broker which doesn't serve us anymore
+        r.Register(STALE_EPOCH,               &DlgPublisher::stale_epoch,        "fall back to server");
+        //the service has another broker now, ask the server
+        r.Register(BROKER_MOVED,              &DlgPublisher::broker_moved,       "follow the moved broker");
+        r.Register(REGISTER_DIRECT_PUBLISHER, &DlgPublisher::register_direct_publisher,
+                   "register direct publisher");
+        //reply to one of our requests, from a subscriber or from the broker
+        r.Register(REPLY_MESSAGE,             &DlgPublisher::reply_message,      "handle reply");
+        return r;
+    }();
+    return registry;
+}
+
 bool DlgPublisher::register_publisher(DlgMessage *msg)
 {
     Print(DBG_LEVEL_DEBUG,
@@ -284,14 +907,181 @@ bool DlgPublisher::register_publisher(DlgMessage *msg)
                           "Get broker port : '%s'.\n",
           brokerPort.c_str());
 
-    if (!connect_to(brokerPort.c_str()))
+    //the broker runs in a worker process and has to hear from us itself
+    DlgHeader header;
+    if (msg->GetHeader(header) && (header.flags & HEADER_FLAG_JOIN_BROKER))
+    {
+        ServiceCache::Update(m_service, brokerPort, header.epoch);
+        m_mutex.lock();
+        m_cachedEndpoint = brokerPort;
+        m_cachedEpoch    = header.epoch;
+        m_mutex.unlock();
+        register_cached();
+        delete msg;
+        return true;
+    }
+
+    //the reply came from the cached broker itself, if the socket is there already
+    m_isCacheWaiting = false;
+    uint64_t epoch = 0;
+    msg->GetEpoch(epoch);
+    ServiceCache::Update(m_service, brokerPort, epoch);
+    if (brokerPort != m_endpoint && !connect_to(brokerPort.c_str()))
       {
         Print(DBG_LEVEL_ERROR,"DlgSubscriber::subscribe_to_service(): Couldn't connect to broker %s.\n", brokerPort.c_str());
         return false;
       }
+    m_isBrokerConnected = true;
+
+    delete msg;
+    return true;
+}
+
+bool DlgPublisher::stale_epoch(DlgMessage *msg)
+{
+    uint64_t epoch = 0;
+    msg->GetEpoch(epoch);
+    //an answer to a request we have given up on already
+    if (m_isCacheWaiting && epoch == m_cachedEpoch)
+        fallback_to_server();
+    delete msg;
+    return true;
+}
+
+bool DlgPublisher::broker_moved(DlgMessage *msg)
+{
+    uint64_t epoch = 0;
+    msg->GetEpoch(epoch);
+    m_mutex.lock();
+    m_cachedEpoch = epoch;
+    m_mutex.unlock();
+    fallback_to_server();
+    delete msg;
+    return true;
+}
+
+bool DlgPublisher::reply_message(DlgMessage *msg)
+{
+    DlgHeader header;
+    if (!msg->GetHeader(header))
+    {
+        Print(DBG_LEVEL_ERROR,"DlgPublisher::reply_message(): reply without header.\n");
+        return false;
+    }
+    m_mutex.lock();
+    std::map<uint64_t, request_t>::iterator it = m_requests.find(header.correlation);
+    if (it == m_requests.end())
+    {
+        m_mutex.unlock();
+        //its deadline has passed, the handler has got nullptr already
+        Print(DBG_LEVEL_DEBUG,"DlgPublisher::reply_message(): late reply of request %llu.\n",
+              (unsigned long long)header.correlation);
+        delete msg;
+        return true;
+    }
+    reply_handler_t handler;
+    handler.swap(it->second.handler);
+    m_requests.erase(it);
+    m_mutex.unlock();
+
+    //the handler may send another request, so it is called without the lock
+    if (header.flags & HEADER_FLAG_NO_RESPONDER)
+    {
+        delete msg;
+        msg = nullptr;
+    }
+    handler(msg);
+    return true;
+}
 
+bool DlgPublisher::register_direct_publisher(DlgMessage *msg)
+{
+    std::string endpoint;
+    if (!msg->GetMessageBody(endpoint))
+    {
+        Print(DBG_LEVEL_ERROR,"DlgPublisher::register_direct_publisher(): "
+                              "Couldn't get endpoint for %s service.\n",
+              m_service.c_str());
+        return false;
+    }
+    //Stays connected to the server, data goes through m_directSocket
+    Print(DBG_LEVEL_DEBUG,"DlgPublisher::register_direct_publisher(): "
+                          "Server knows %s publishes at '%s'.\n",
+          m_name.c_str(), endpoint.c_str());
+    m_isBrokerConnected = true;
     delete msg;
     return true;
 }
 
+////**********************************************************////
+////                DlgPublishHandle class                    ////
+////**********************************************************////
+
+DlgPublishHandle::DlgPublishHandle(DlgPublisher *publisher, const std::string &name,
+                                   const std::string &service, uint32_t msgType, size_t poolSize,
+                                   uint64_t fingerprint) :
+  m_publisher(publisher), m_name(name),
+  m_prototype(service, name, std::string(""), msgType, std::string("")),
+  m_free(poolSize ? poolSize : 1), m_allocated(0)
+{
+    m_prototype.SetIdentity(name);
+    DlgHeader header;
+    if (m_prototype.GetHeader(header))
+    {
+        header.fingerprint = fingerprint;
+        m_prototype.SetHeader(header);
+    }
+    for (size_t i = 0; i < poolSize; i++)
+        Release(Acquire());
+}
+
+DlgPublishHandle::~DlgPublishHandle()
+{
+    DlgMessage *msg = nullptr;
+    while (m_free.TryPop(msg))
+        delete msg;
+}
+
+DlgMessage* DlgPublishHandle::Acquire()
+{
+    DlgMessage *msg = nullptr;
+    if (!m_free.TryPop(msg))
+    {
+        //the copy doesn't take the identity
+        msg = new DlgMessage(m_prototype);
+        msg->SetIdentity(m_name);
+        m_allocated++;
+        return msg;
+    }
+    DlgHeader header;
+    if (m_prototype.GetHeader(header))
+        msg->SetHeader(header);
+    return msg;
+}
+
+bool DlgPublishHandle::Publish(DlgMessage *msg)
+{
+    return m_publisher->post_message(msg, this);
+}
+
+bool DlgPublishHandle::Publish(const void *buf, size_t size)
+{
+    DlgMessage *msg = Acquire();
+    void *body = msg->PrepareMessageBuffer(size);
+    if (!body)
+    {
+        Release(msg);
+        return false;
+    }
+    if (size)
+        memcpy(body, buf, size);
+    return Publish(msg);
+}
+
+void DlgPublishHandle::Release(DlgMessage *msg)
+{
+    if (!m_free.TryPush(msg))
+        delete msg;
+}
+
 }//end of namespace
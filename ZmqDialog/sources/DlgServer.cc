@@ -1,3 +1,6 @@
+#include <stdio.h>
+#include <stdlib.h>
+
 #include "DlgServer.h"
 
 namespace ZmqDialog
@@ -16,10 +19,22 @@ namespace ZmqDialog
 
   zmq::context_t* ZMQ::m_context  = nullptr;
   ZMQ*            ZMQ::m_instance = nullptr;
+  int             ZMQ::m_ioThreads = DLG_ZMQ_IO_THREADS;
+  SocketOptions   ZMQ::m_options[N_SOCKET_ROLES];
 
   ZMQ::ZMQ()
   {
-    m_context  = new zmq::context_t(1);
+    m_context  = new zmq::context_t(m_ioThreads);
+#ifdef ZMQ_THREAD_AFFINITY_CPU_ADD
+    //I/O threads start with the first socket, so they are placed now
+    const std::vector<int>& cpus = Affinity::GetCpus(THREAD_ZMQ_IO);
+    for(size_t i = 0; i < cpus.size(); i++)
+      if(zmq_ctx_set(static_cast<void*>(*m_context), ZMQ_THREAD_AFFINITY_CPU_ADD, cpus[i]) != 0)
+	Print(DBG_LEVEL_ERROR, "ZMQ(): couldn't add cpu %d to I/O threads (%s)\n", cpus[i], zmq_strerror(zmq_errno()));
+#else
+    if(!Affinity::GetCpus(THREAD_ZMQ_IO).empty())
+      Print(DBG_LEVEL_ERROR, "ZMQ(): this libzmq cannot set affinity of I/O threads\n");
+#endif
   }
 
   ZMQ::~ZMQ()
@@ -36,9 +51,160 @@ namespace ZmqDialog
     return m_instance;
   }
 
-  zmq::socket_t* ZMQ::CreateSocket(int socket_type)
+  zmq::socket_t* ZMQ::CreateSocket(int socket_type, SocketRole role)
+  {
+    zmq::socket_t* socket = new zmq::socket_t(*m_context, socket_type);
+    const SocketOptions& o = m_options[role];
+    const struct { int option; int value; } options[] =
+      {
+	{ ZMQ_SNDHWM,             o.sndhwm           },
+	{ ZMQ_RCVHWM,             o.rcvhwm           },
+	{ ZMQ_SNDBUF,             o.sndbuf           },
+	{ ZMQ_RCVBUF,             o.rcvbuf           },
+	{ ZMQ_LINGER,             o.linger           },
+	{ ZMQ_IMMEDIATE,          o.immediate        },
+	{ ZMQ_TCP_KEEPALIVE,      o.tcpKeepalive     },
+	{ ZMQ_TCP_KEEPALIVE_IDLE, o.tcpKeepaliveIdle }
+      };
+    try
+      {
+	for(size_t i = 0; i < sizeof(options)/sizeof(options[0]); i++)
+	  if(options[i].value >= 0)
+	    socket->setsockopt(options[i].option, &options[i].value, sizeof(options[i].value));
+	if(o.affinity >= 0)
+	  {
+	    uint64_t affinity = (uint64_t)o.affinity;
+	    socket->setsockopt(ZMQ_AFFINITY, &affinity, sizeof(affinity));
+	  }
+      }
+    catch(zmq::error_t& e)
+      {
+	Print(DBG_LEVEL_ERROR, "ZMQ::CreateSocket(): couldn't tune socket: %s\n", e.what());
+      }
+    return socket;
+  }
+
+  bool ZMQ::SetIOThreads(int ioThreads)
+  {
+    if(m_instance)
+      {
+	Print(DBG_LEVEL_ERROR, "ZMQ::SetIOThreads(): context is already created\n");
+	return false;
+      }
+    if(ioThreads < 1)
+      {
+	Print(DBG_LEVEL_ERROR, "ZMQ::SetIOThreads(): wrong number of I/O threads %d\n", ioThreads);
+	return false;
+      }
+    m_ioThreads = ioThreads;
+    return true;
+  }
+
+  void ZMQ::SetSocketOptions(SocketRole role, const SocketOptions& options)
+  {
+    if(role < N_SOCKET_ROLES)
+      m_options[role] = options;
+  }
+
+  static bool set_socket_option(SocketOptions& options, const std::string& name, const std::string& value)
+  {
+    char* end = nullptr;
+    long long v = strtoll(value.c_str(), &end, 0);
+    if(value.empty() || *end != 0)
+      return false;
+    if(name == "affinity")
+      {
+	options.affinity = (int64_t)v;
+	return true;
+      }
+    const struct { const char* name; int* field; } fields[] =
+      {
+	{ "sndhwm",             &options.sndhwm           },
+	{ "rcvhwm",             &options.rcvhwm           },
+	{ "sndbuf",             &options.sndbuf           },
+	{ "rcvbuf",             &options.rcvbuf           },
+	{ "linger",             &options.linger           },
+	{ "immediate",          &options.immediate        },
+	{ "tcp_keepalive",      &options.tcpKeepalive     },
+	{ "tcp_keepalive_idle", &options.tcpKeepaliveIdle }
+      };
+    for(size_t i = 0; i < sizeof(fields)/sizeof(fields[0]); i++)
+      if(name == fields[i].name)
+	{
+	  *fields[i].field = (int)v;
+	  return true;
+	}
+    return false;
+  }
+
+  static std::string trim(const std::string& str)
+  {
+    size_t first = str.find_first_not_of(" \t\r\n");
+    if(first == std::string::npos)
+      return "";
+    size_t last = str.find_last_not_of(" \t\r\n");
+    return str.substr(first, last - first + 1);
+  }
+
+  bool ZMQ::LoadConfig(const char* fileName)
   {
-    return new zmq::socket_t(*m_context, socket_type);
+    FILE* f = fopen(fileName, "r");
+    if(!f)
+      {
+	Print(DBG_LEVEL_ERROR, "ZMQ::LoadConfig(): cannot open '%s'\n", fileName);
+	return false;
+      }
+    const char* SOCKET_ROLES[N_SOCKET_ROLES] = { "server", "broker", "client", "direct" };
+    const char* THREAD_ROLES[N_THREAD_ROLES] = { "server", "broker", "client", "zmq_io" };
+    bool isOk = true;
+    char buf[MAX_CONFIG_LINE_LENGTH];
+    for(int lineNo = 1; fgets(buf, sizeof(buf), f); lineNo++)
+      {
+	std::string line(buf);
+	line = trim(line.substr(0, line.find('#')));
+	if(line.empty())
+	  continue;
+	size_t eq = line.find('=');
+	if(eq == std::string::npos)
+	  {
+	    Print(DBG_LEVEL_ERROR, "ZMQ::LoadConfig(): %s:%d: '=' is expected\n", fileName, lineNo);
+	    isOk = false;
+	    continue;
+	  }
+	std::string key   = trim(line.substr(0, eq));
+	std::string value = trim(line.substr(eq + 1));
+	bool isKnown = false;
+	if(key == "io_threads")
+	  {
+	    isKnown = true;
+	    if(!SetIOThreads(atoi(value.c_str())))
+	      isOk = false;
+	  }
+	size_t dot = key.find('.');
+	std::string prefix = key.substr(0, dot);
+	std::string name   = dot == std::string::npos ? "" : key.substr(dot + 1);
+	if(prefix == "cpus")
+	  for(int role = 0; role < N_THREAD_ROLES; role++)
+	    if(name == THREAD_ROLES[role])
+	      {
+		isKnown = true;
+		if(!Affinity::SetCpus((ThreadRole)role, value))
+		  isOk = false;
+	      }
+	for(int role = 0; role < N_SOCKET_ROLES; role++)
+	  if(prefix == SOCKET_ROLES[role])
+	    {
+	      isKnown = set_socket_option(m_options[role], name, value);
+	      break;
+	    }
+	if(!isKnown)
+	  {
+	    Print(DBG_LEVEL_ERROR, "ZMQ::LoadConfig(): %s:%d: unknown or bad setting '%s'\n", fileName, lineNo, line.c_str());
+	    isOk = false;
+	  }
+      }
+    fclose(f);
+    return isOk;
   }
 
 
@@ -49,12 +215,49 @@ namespace ZmqDialog
   aService::aService(const char *name) : m_broker(nullptr)
   {
     m_name = name;
-    m_broker = new aBroker(name);
+  }
+
+  aBroker* aService::CreateBroker(BrokerMode mode, const std::string& address)
+  {
+    if (!m_broker)
+      m_broker = new aBroker(m_name.c_str(), mode, address.c_str());
+    return m_broker;
+  }
+
+  bool aService::AddDirectPublisher(const std::string& id, const std::string& endpoint)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_directPublishers[id] = endpoint;
+    return true;
+  }
+
+  bool aService::AddDirectSubscriber(const std::string& id)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t i = 0; i < m_directSubscribers.size(); i++)
+      if (m_directSubscribers[i] == id)
+	return true;
+    m_directSubscribers.push_back(id);
+    return true;
+  }
+
+  std::string aService::GetDirectEndpoints() const
+  {
+    std::string endpoints;
+    for (auto &it : m_directPublishers)
+      {
+	if (!endpoints.empty())
+	  endpoints += ";";
+	endpoints += it.second;
+      }
+    return endpoints;
   }
   
   aService::~aService()
   {
     delete m_broker;
+    for (size_t i = 0; i < m_placement.waiting.size(); i++)
+      delete m_placement.waiting[i];
   }
 
   bool aService::ReleaseMessage(DlgMessage* msg)
@@ -68,18 +271,25 @@ namespace ZmqDialog
   ////                   aBroker  class                         ////
   ////**********************************************************////
 
-  aBroker::aBroker(const char* name)
+  aBroker::aBroker(const char* name, BrokerMode mode, const char* address)
   {
   //  const char* server_address          ="192.168.0.112";
     m_name =          name; 
     m_isRunning =     false;
-    m_thread =        new std::thread(&aBroker::broker_thread, this);
-    m_socket =        ZMQ::Instance()->CreateSocket(ZMQ_ROUTER);
+    m_thread =        nullptr;
+    m_overflowPolicy = OVERFLOW_DROP_OLDEST;
+    m_mode =          mode;
+    m_xpubSocket =    nullptr;
+    m_xpubSubscriptions = 0;
+    m_epoch =         0;
+    m_isMoving =      false;
+    m_nextResponder = 0;
+    m_socket =        ZMQ::Instance()->CreateSocket(ZMQ_ROUTER, SOCKET_BROKER);
     
     char port[256];
     size_t size = sizeof(port);
     char endpoint[256];
-    sprintf(endpoint,"tcp://%s:0", server_address); // bind to any port
+    sprintf(endpoint,"tcp://%s:0", address); // bind to any port
     m_socket->bind(endpoint);
     // if(errno != 0 && errno != 11) // the resource can be temporary unavailable
     //   {
@@ -93,6 +303,26 @@ namespace ZmqDialog
     m_port = std::string(port + 6);
 
     Print(DBG_LEVEL_DEBUG,"aBroker: is bound to endpoint '%s'\n", m_port.c_str());
+
+    if (m_mode == BROKER_XPUB)
+      {
+	m_xpubSocket = ZMQ::Instance()->CreateSocket(ZMQ_XPUB, SOCKET_BROKER);
+	//every (un)subscription is reported, so they can be counted
+	int verbose = 1;
+#ifdef ZMQ_XPUB_VERBOSER
+	m_xpubSocket->setsockopt(ZMQ_XPUB_VERBOSER, &verbose, sizeof(verbose));
+#else
+	m_xpubSocket->setsockopt(ZMQ_XPUB_VERBOSE, &verbose, sizeof(verbose));
+#endif
+	m_xpubSocket->bind(endpoint);
+	size = sizeof(port);
+	m_xpubSocket->getsockopt(ZMQ_LAST_ENDPOINT, &port, &size);
+	m_xpubPort = std::string(port + 6);
+	Print(DBG_LEVEL_DEBUG,"aBroker: XPUB is bound to endpoint '%s'\n", m_xpubPort.c_str());
+      }
+
+    //the thread polls m_socket, so it is started when the socket is ready
+    m_thread =        new std::thread(&aBroker::broker_thread, this);
   }
 
   aBroker::~aBroker()
@@ -103,96 +333,394 @@ namespace ZmqDialog
     delete m_thread;
     
     //clear subscribers
-    for(auto &sub : m_subscribers)
-      delete sub.second;
-    m_subscribers.clear();
+    m_subscribers.Clear();
+
+    //close links to remote brokers
+    for (size_t i = 0; i < m_remotes.size(); i++)
+      close_remote(m_remotes[i]);
+    m_remotes.clear();
 
     //clear publishers
     destroy_publishers();
+
+    //clear messages which weren't sent
+    DlgMessage* msg = nullptr;
+    while(m_requests.Pop(msg))
+      delete msg;
     
     m_socket->close();
     delete m_socket;
+    if (m_xpubSocket)
+      m_xpubSocket->close();
+    delete m_xpubSocket;
   }
 
   void aBroker::broker_thread()
   {   
     Print(DBG_LEVEL_DEBUG,"Start of %s broker's thread\n", m_name.c_str());
     assert(this);
+    //first of all, so what this thread allocates (message copies, pending
+    //queues of subscribers) is node local; the members of aBroker itself
+    //were allocated by the constructor on the thread which created it
+    Affinity::Apply(THREAD_BROKER, m_name);
     m_isRunning = true;
     while(m_isRunning)
       {
+	//m_socket belongs to this thread, so clients are told about a move here
+	if (m_isMoving.exchange(false))
+	  notify_moved();
+
 	zmq::pollitem_t items[] = {
-	  { static_cast<void*>(*m_socket), 0, ZMQ_POLLIN, 0 } 
+	  { static_cast<void*>(*m_socket), 0, ZMQ_POLLIN, 0 },
+	  { nullptr, 0, 0, 0 }
 	};
+	int nItems = 1;
+	if (m_xpubSocket)
+	  {
+	    items[1].socket = static_cast<void*>(*m_xpubSocket);
+	    items[1].events = ZMQ_POLLIN;
+	    nItems = 2;
+	  }
 	
-	
+	//don't sleep while there are queued messages
+	m_mutex.lock();
+	long timeout = m_requests.Empty() ? (long)TIMEOUT_INTERVAL/1000 : 0;
+	m_mutex.unlock();
+
 	//recieve messages
-    zmq::poll(&items[0], 1, (long)TIMEOUT_INTERVAL/1000);
-	if (items[0].revents & ZMQ_POLLIN)
+	zmq::poll(&items[0], nItems, timeout);
+	if (items[1].revents & ZMQ_POLLIN)
+	  receive_subscription();
+	for(int n = 0; (items[0].revents & ZMQ_POLLIN) && n < BROKER_MAX_RECV_BATCH; ++n)
 	  {
-	    DlgMessage* msg = new DlgMessage;
-	    if(!msg->Recv(m_socket))
-	      {
-		Print(DBG_LEVEL_ERROR,"broker_thread: message receiving error.\n");
-		delete msg;
-		continue;
-	      }
-	    uint32_t msgType = 0;
-	    if (!msg->GetMessageType(msgType))
-	      {
-		Print(DBG_LEVEL_ERROR,"broker_thread: bad message received (cannot get message type).\n");
-		delete msg;
-		continue;
-	      }
+	    receive_message();
+	    items[0].revents = 0;
+	    zmq::poll(&items[0], 1, 0);
+	  }
+
+	//send messages: the most urgent ones first, a limited number per cycle
+	//so that newly arrived high priority messages don't wait for a whole burst
+	m_mutex.lock();
+	DlgMessage* msg = nullptr;
+	for(int n = 0; n < BROKER_MAX_SEND_BATCH && m_requests.Pop(msg); ++n)
+	  fan_out(msg);
+	m_mutex.unlock();
+      }
+    Print(DBG_LEVEL_DEBUG,"End of %s broker thread\n", m_name.c_str());
+    //    return nullptr;
+  }
+
+  void aBroker::receive_message()
+  {
+    DlgMessage* msg = new DlgMessage;
+    if(!msg->Recv(m_socket))
+      {
+	Print(DBG_LEVEL_ERROR,"broker_thread: message receiving error.\n");
+	delete msg;
+	return;
+      }
+    uint32_t msgType = 0;
+    if (!msg->GetMessageType(msgType))
+      {
+	Print(DBG_LEVEL_ERROR,"broker_thread: bad message received (cannot get message type).\n");
+	delete msg;
+	return;
+      }
+
+    handlers().Dispatch(this, msgType, msg, "broker_thread");
+  }
+
+  //Handlers of the messages brokers receive, the same for every broker
+  const message_registry_t<aBroker>& aBroker::handlers()
+  {
+    static const message_registry_t<aBroker> registry = []()
+      {
+	message_registry_t<aBroker> r;
+	r.Register(REGISTER_PUBLISHER,     &aBroker::register_publisher,   "register publisher");
+	r.Register(SUBSCRIBE_TO_SERVICE,   &aBroker::subscribe_to_service, "subscribe to service");
+	r.Register(PUBLISH_TEXT_MESSAGE,   &aBroker::publish_text_message, "publish text message");
+	r.Register(PUBLISH_BINARY_MESSAGE, &aBroker::publish_binary_message, "publish binary message");
+	r.Register(PUBLISH_BATCH_MESSAGE,  &aBroker::publish_batch_message, "publish batch message");
+	r.Register(GRANT_CREDIT,           &aBroker::grant_credit,         "grant credit");
+	r.Register(SET_KEY_FILTER,         &aBroker::key_filter,           "set key filter");
+	r.Register(REQUEST_MESSAGE,        &aBroker::request_message,      "pass request on");
+	r.Register(REPLY_MESSAGE,          &aBroker::reply_message,        "return reply");
+	return r;
+      }();
+    return registry;
+  }
 
-	    //REGISTER_PUBLISHER_MESSAGE
-	    if (msgType == REGISTER_PUBLISHER && !register_publisher(msg))
+  //Must be called with m_mutex locked, takes ownership of msg
+  void aBroker::fan_out(DlgMessage* msg)
+  {
+    //stamps of another host's clock (a remote publisher) aren't comparable
+    DlgHeader header;
+    if (msg->GetHeader(header) && (header.flags & HEADER_FLAG_TIMED) &&
+	header.host == latency_clock_t::HostId())
+      {
+	header.stamps[STAMP_BROKER_OUT] = latency_clock_t::Now();
+	msg->SetHeader(header);
+	m_residence.RecordSpan(header.stamps[STAMP_BROKER_IN], header.stamps[STAMP_BROKER_OUT]);
+      }
+
+    if (!m_remotes.empty())
+      forward(msg);
+
+    if (m_mode == BROKER_XPUB)
+      {
+	//one send whatever the number of subscribers
+	size_t size = msg->GetSize();
+	if (msg->Send(m_xpubSocket))
+	  {
+	    m_messagesOut.Add();
+	    m_bytesOut.Add(size);
+	  }
+	else
+	  Print(DBG_LEVEL_ERROR,"aBroker::fan_out: couldn't publish message of %s.\n", m_name.c_str());
+	delete msg;
+	return;
+      }
+
+    //the routing key of a schema payload is read in place, once, and only
+    //if a subscriber filters by it
+    schema_bytes_t key;
+    const schema_bytes_t* routingKey = nullptr;
+    bool isKeyRead = false;
+
+    //the message is shared by pending queues of subscribers without credit
+    std::shared_ptr<DlgMessage> shared(msg);
+    size_t i = 0;
+    while(i < m_subscribers.Size())
+      {
+	aSubscriber* s = &m_subscribers.At(i).second;
+	if (!s->GetKeyFilter().empty())
+	  {
+	    if (!isKeyRead)
 	      {
-		Print(DBG_LEVEL_ERROR,"broker_thread: Couldn't register publisher.\n");
-		delete msg;
-		continue;	
+		isKeyRead = true;
+		DlgHeader header;
+		size_t size = 0;
+		if (msg->GetHeader(header) && (header.flags & HEADER_FLAG_SCHEMA) &&
+		    SchemaReader::RoutingKey(msg->GetMessageData(size), size, key))
+		  routingKey = &key;
 	      }
-	    
-	    //SUBSCRIBE_TO_SERVICE_MESSAGE
-	    if (msgType == SUBSCRIBE_TO_SERVICE && !subscribe_to_service(msg))
+	    if (!s->Accepts(routingKey))
 	      {
-		Print(DBG_LEVEL_ERROR,"broker_thread: Couldn't subscribe to service.\n");
-		delete msg;
+		i++;
 		continue;
-	      }	  
-  
-	    //PUBLISH_TEXT_MESSAGE
-	    if (msgType == PUBLISH_TEXT_MESSAGE && !publish_text_message(msg))
-	      {
-	    	Print(DBG_LEVEL_ERROR,"broker_thread: Couldn't publish text message.\n");
-	    	delete msg;
-	    	continue;
-	      }
-	    
-	    //PUBLISH_BINARY_MESSAGE
-	    if (msgType == PUBLISH_BINARY_MESSAGE && !publish_binary_message(msg))
-	      {
-	    	Print(DBG_LEVEL_ERROR,"broker_thread: Couldn't publish binary message.\n");
-	    	delete msg;
-	    	continue;
 	      }
+	  }
+	if (deliver(shared, s))
+	  {
+	    i++;
+	    continue;
+	  }
+	//the last subscriber takes its place and is visited next
+	remove_subscriber(i);
+      }
+  }
+
+  //Must be called with m_mutex locked. A message is forwarded by the broker
+  //of its publisher only, the flag keeps it from going around the federation.
+  void aBroker::forward(DlgMessage* msg)
+  {
+    DlgHeader header;
+    if (!msg->GetHeader(header) || (header.flags & HEADER_FLAG_FORWARDED))
+      return;
+    header.flags |= HEADER_FLAG_FORWARDED;
+    msg->SetHeader(header);
+    for (size_t i = 0; i < m_remotes.size(); i++)
+      if (!msg->Send(m_remotes[i].socket))
+	Print(DBG_LEVEL_ERROR,"aBroker %s: couldn't forward message to '%s'.\n",
+	      m_name.c_str(), m_remotes[i].endpoint.c_str());
+  }
+
+  size_t aBroker::GetSubscriberCount()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_mode == BROKER_XPUB)
+      return m_xpubSubscriptions > 0 ? (size_t)m_xpubSubscriptions : 0;
+    return m_subscribers.Size();
+  }
+
+  void aBroker::SetRemotes(const std::map<std::string, uint64_t>& remotes)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    //links which are gone or point to a restarted broker
+    size_t i = 0;
+    while (i < m_remotes.size())
+      {
+	std::map<std::string, uint64_t>::const_iterator it = remotes.find(m_remotes[i].endpoint);
+	if (it != remotes.end() && it->second == m_remotes[i].epoch)
+	  {
+	    i++;
+	    continue;
+	  }
+	Print(DBG_LEVEL_VERBOSE,"aBroker %s: stops forwarding to '%s'.\n", m_name.c_str(), m_remotes[i].endpoint.c_str());
+	close_remote(m_remotes[i]);
+	m_remotes[i] = m_remotes.back();
+	m_remotes.pop_back();
+      }
 
+    for (std::map<std::string, uint64_t>::const_iterator it = remotes.begin(); it != remotes.end(); ++it)
+      {
+	bool isLinked = false;
+	for (size_t j = 0; j < m_remotes.size() && !isLinked; j++)
+	  isLinked = (m_remotes[j].endpoint == it->first);
+	if (isLinked || it->first == m_port)
+	  continue;
+
+	remote_t remote;
+	remote.endpoint = it->first;
+	remote.epoch    = it->second;
+	remote.socket   = ZMQ::Instance()->CreateSocket(ZMQ_DEALER, SOCKET_BROKER);
+	std::string identity = m_name + "@" + m_port;
+	remote.socket->setsockopt(ZMQ_IDENTITY, identity.c_str(), identity.size()+1);
+	char endpoint[256];
+	snprintf(endpoint, sizeof(endpoint), "tcp://%s", remote.endpoint.c_str());
+	try
+	  {
+	    remote.socket->connect(endpoint);
 	  }
-	//send messages
-	m_mutex.lock();
-	for(std::map<std::string, aSubscriber*>::iterator it = m_subscribers.begin();
-	    it != m_subscribers.end(); it++)
+	catch(zmq::error_t& e)
 	  {
-	    for(size_t i = 0; i < m_requests.size(); i++)
-	      SendMessage(m_requests[i], it->second);
+	    Print(DBG_LEVEL_ERROR,"aBroker %s: couldn't connect to '%s' (%s).\n", m_name.c_str(), endpoint, e.what());
+	    delete remote.socket;
+	    continue;
 	  }
-	for(size_t i = 0; i < m_requests.size(); i++)
-	  delete m_requests[i];
-	m_requests.clear();
-	m_mutex.unlock();
+	//the remote broker takes us for one more publisher
+	DlgMessage reg(m_name, identity, remote.endpoint, REGISTER_PUBLISHER, std::string(""));
+	reg.SetEpoch(remote.epoch);
+	if (!reg.Send(remote.socket))
+	  {
+	    Print(DBG_LEVEL_ERROR,"aBroker %s: couldn't register at '%s'.\n", m_name.c_str(), endpoint);
+	    close_remote(remote);
+	    continue;
+	  }
+	Print(DBG_LEVEL_VERBOSE,"aBroker %s: forwards to '%s'.\n", m_name.c_str(), remote.endpoint.c_str());
+	m_remotes.push_back(remote);
+      }
+  }
+
+  uint64_t aBroker::GetPublished()
+  {
+    return m_messagesIn.Get();
+  }
+
+  void aBroker::GetStats(broker_stats_t& stats)
+  {
+    stats.messagesIn  = m_messagesIn.Get();
+    stats.bytesIn     = m_bytesIn.Get();
+    stats.messagesOut = m_messagesOut.Get();
+    stats.bytesOut    = m_bytesOut.Get();
+    stats.dropped     = m_dropped.Get();
+    stats.removed     = m_removed.Get();
+    stats.residence   = m_residence.GetSummary();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    stats.queued  = m_requests.Size();
+    stats.pending = 0;
+    for (auto &v : m_subscribers)
+      stats.pending += v.second.Pending().size();
+    stats.subscribers = (m_mode == BROKER_XPUB) ? (m_xpubSubscriptions > 0 ? (size_t)m_xpubSubscriptions : 0)
+      : m_subscribers.Size();
+    stats.publishers  = m_publishers.Size();
+  }
+
+  void aBroker::MoveTo(const std::string& endpoint)
+  {
+    m_mutex.lock();
+    m_movedTo = endpoint;
+    m_mutex.unlock();
+    m_isMoving = true;
+  }
+
+  //Subscribers and publishers go back to DlgServer, which knows the new broker.
+  //The broker goes on delivering what it has until it is deleted.
+  void aBroker::notify_moved()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Print(DBG_LEVEL_VERBOSE,"aBroker %s: moved to '%s'.\n", m_name.c_str(), m_movedTo.c_str());
+    std::string from(m_name);
+    for (auto &v : m_subscribers)
+      {
+	DlgMessage moved(m_name, from, v.first, BROKER_MOVED, m_movedTo);
+	moved.SetIdentity(v.first);
+	moved.SetEpoch(m_epoch);
+	moved.Send(m_socket);
+      }
+    for (auto &v : m_publishers)
+      {
+	DlgMessage moved(m_name, from, v.first, BROKER_MOVED, m_movedTo);
+	moved.SetIdentity(v.first);
+	moved.SetEpoch(m_epoch);
+	moved.Send(m_socket);
+      }
+  }
+
+  void aBroker::close_remote(remote_t& remote)
+  {
+    if (remote.socket)
+      remote.socket->close();
+    delete remote.socket;
+    remote.socket = nullptr;
+  }
+
+  //XPUB reports (un)subscriptions as a message: 1 or 0 followed by the filter
+  void aBroker::receive_subscription()
+  {
+    zmq::message_t message;
+    if (!m_xpubSocket->recv(&message) || message.size() == 0)
+      {
+	Print(DBG_LEVEL_ERROR,"aBroker::receive_subscription: bad subscription message.\n");
+	return;
+      }
+    uint8_t isSubscribe = *static_cast<uint8_t*>(message.data());
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (isSubscribe == 1)
+      m_xpubSubscriptions++;
+    else if (isSubscribe == 0 && m_xpubSubscriptions > 0)
+      m_xpubSubscriptions--;
+    Print(DBG_LEVEL_DEBUG,"aBroker %s: %d XPUB subscriber(s).\n", m_name.c_str(), m_xpubSubscriptions);
+  }
+
+  //Sends the message if subscriber has credit, otherwise keeps it until credit
+  //is granted. Returns false if the subscriber has to be removed.
+  bool aBroker::deliver(const std::shared_ptr<DlgMessage>& msg, aSubscriber* s)
+  {
+    std::deque<std::shared_ptr<DlgMessage> >& pending = s->Pending();
+    if (pending.empty() && s->HasCredit())
+      {
+	s->ConsumeCredit(msg->GetSize());
+	if (!SendMessage(msg.get(), s))
+	  Print(DBG_LEVEL_ERROR,"aBroker::deliver: couldn't send message to '%s'.\n", s->GetID().c_str());
+	return true;
+      }
+    if (pending.size() >= BROKER_MAX_PENDING)
+      {
+	if (m_overflowPolicy == OVERFLOW_DROP_SUBSCRIBER)
+	  return false;
+	no_responder(pending.front().get());
+	pending.pop_front();
+	s->CountDrop();
+	m_dropped.Add();
+	//not silent, but not on every message either
+	if (s->GetDropped() == 1 || s->GetDropped() % 1000 == 0)
+	  Print(DBG_LEVEL_ERROR,"aBroker %s: %lu message(s) dropped for slow subscriber '%s'.\n",
+		m_name.c_str(), (unsigned long)s->GetDropped(), s->GetID().c_str());
+      }
+    pending.push_back(msg);
+    return true;
+  }
+
+  void aBroker::flush_pending(aSubscriber* s)
+  {
+    std::deque<std::shared_ptr<DlgMessage> >& pending = s->Pending();
+    while (!pending.empty() && s->HasCredit())
+      {
+	s->ConsumeCredit(pending.front()->GetSize());
+	SendMessage(pending.front().get(), s);
+	pending.pop_front();
       }
-    Print(DBG_LEVEL_DEBUG,"End of %s broker thread\n", m_name.c_str());
-    //    return nullptr;
   }
 
   bool aBroker::SendMessage(DlgMessage* msg, aSubscriber* s)
@@ -210,67 +738,103 @@ namespace ZmqDialog
 	Print(DBG_LEVEL_ERROR,"aBroker::SendMessage: cannot set identity address of message.\n");
      	return false;
       }
-    return msg->Send(m_socket);
+    size_t size = msg->GetSize();
+    if (!msg->Send(m_socket))
+      return false;
+    m_messagesOut.Add();
+    m_bytesOut.Add(size);
+    return true;
   }
 
   bool aBroker::AddRequest(DlgMessage* msg)
   {
     if(!msg)
       return false;
+    uint32_t priority = PRIORITY_NORMAL;
+    DlgHeader header;
+    if(!msg->GetHeader(header))
+      Print(DBG_LEVEL_DEBUG,"aBroker::AddRequest: message without header, normal priority is used.\n");
+    else
+      {
+	priority = header.priority;
+	if ((header.flags & HEADER_FLAG_TIMED) && header.host == latency_clock_t::HostId())
+	  {
+	    header.stamps[STAMP_BROKER_IN] = latency_clock_t::Now();
+	    msg->SetHeader(header);
+	  }
+      }
+    m_messagesIn.Add();
+    m_bytesIn.Add(msg->GetSize());
     m_mutex.lock();
-    m_requests.push_back(msg);
+    m_requests.Push(msg, priority);
     m_mutex.unlock();
     return true;
   }
 
+  void aBroker::SetDequeuePolicy(DequeuePolicy policy)
+  {
+    m_mutex.lock();
+    m_requests.SetPolicy(policy);
+    m_mutex.unlock();
+  }
+
+  //The server thread adds them too: the lookup and the insert under one lock
   bool aBroker::AddSubscriber(const char *id)
   {
-    std::string from(id);
-    if (m_subscribers.count(from) != 0)
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_subscribers.Contains(id))
       {
 	Print(DBG_LEVEL_DEBUG, "aBroker::AddSubscriber: this subscriber already exists '%s'\n", id);
 	return false;
       }
-    m_mutex.lock();
-    m_subscribers[from] = new aSubscriber(id);
-    m_mutex.unlock();
+    m_subscribers.Insert(id, aSubscriber(id));
+    return true;
+  }
+
+  bool aBroker::Resubscribe(const char *id)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    aSubscriber* s = m_subscribers.Find(id);
+    if (!s)
+      {
+	m_subscribers.Insert(id, aSubscriber(id));
+	return true;
+      }
+    Print(DBG_LEVEL_DEBUG, "aBroker::Resubscribe: subscriber '%s' came again\n", id);
+    s->ResetCredit();
     return true;
   }
 
   bool aBroker::AddPublisher(const char* id)
   {
-    std::string pub(id);
-    if (m_publishers.count(pub) != 0)
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_publishers.Contains(id))
       {
 	Print(DBG_LEVEL_DEBUG, "aBroker::AddPublisher: this publisher already exists '%s'\n", id);
 	return false;
       }
-    m_mutex.lock();
-    m_publishers[pub] = new aPublisher(id);
-    m_mutex.unlock();
+    m_publishers.Insert(id, aPublisher(id));
     return true;
   }
 
+  //AddPublisher() may grow m_publishers on the server thread
+  bool aBroker::has_publisher(const std::string& id)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_publishers.Contains(id);
+  }
+
   void aBroker::destroy_publishers()
   {
     m_mutex.lock();
-    for(auto &it : m_publishers)
-      {
-	delete it.second;
-      }
-    m_publishers.clear();
+    m_publishers.Clear();
     m_mutex.unlock();
   }
 
   void aBroker::delete_publisher(const char* id)
   {
     m_mutex.lock();
-    std::map<std::string, aPublisher*>::iterator it = m_publishers.find(id);
-    if(it != m_publishers.end())
-      {
-	delete it->second;
-	m_publishers.erase(it);
-      }
+    m_publishers.Erase(id);
     m_mutex.unlock();  
   }
 
@@ -286,7 +850,7 @@ namespace ZmqDialog
     	return false;
       }
     
-    if (m_publishers.count(identity) == 0)
+    if (!has_publisher(identity))
       {
 	Print(DBG_LEVEL_DEBUG,"There are no any publishers for this message. You will be added as a publisher automatically.\n");
 	if (!this->AddPublisher(identity.c_str()))
@@ -319,7 +883,7 @@ namespace ZmqDialog
 	return false;
       }
       
-    if (m_publishers.count(identity) == 0)
+    if (!has_publisher(identity))
       {
 	Print(DBG_LEVEL_DEBUG,"There are no any publishers for this message. You will be added as a publisher automatically.\n");
 	if (!this->AddPublisher(identity.c_str()))
@@ -348,38 +912,279 @@ namespace ZmqDialog
   }
 
 
-  bool aBroker::subscribe_to_service(DlgMessage *msg)
-  { 
+  //The batch is unpacked here, subscribers get the original messages
+  bool aBroker::publish_batch_message(DlgMessage *msg)
+  {
     std::string identity;
-    if (!msg->GetIdentity(identity))
+    if(!msg->GetIdentity(identity))
       {
-	Print(DBG_LEVEL_ERROR,"aBroker::subscribe_to_service: Couldn't get identity.\n");
+	Print(DBG_LEVEL_ERROR,"aBroker::publish_batch_message: Couldn't get identity.\n");
 	return false;
       }
-    if (!this->AddSubscriber(identity.c_str()))
+
+    if (!has_publisher(identity))
       {
-	Print(DBG_LEVEL_ERROR,"aBroker::register_publisher: Couldn't register subscriber %s.\n", identity.c_str());
-	return false;
+	Print(DBG_LEVEL_DEBUG,"There are no any publishers for this message. You will be added as a publisher automatically.\n");
+	if (!this->AddPublisher(identity.c_str()))
+	  {
+	    Print(DBG_LEVEL_ERROR,"aBroker::publish_batch_message: Couldn't add publisher %s.\n", identity.c_str());
+	    return false;
+	  }
       }
+
+    std::vector<DlgMessage*> messages;
+    bool isUnpacked = DlgBatch::Unpack(msg, messages);
+    if (!isUnpacked)
+      Print(DBG_LEVEL_ERROR,"aBroker::publish_batch_message: bad batch received, %lu message(s) recovered.\n",
+	    (unsigned long)messages.size());
+    for(size_t i = 0; i < messages.size(); i++)
+      this->AddRequest(messages[i]);
+    if (!isUnpacked)
+      return false;
     delete msg;
     return true;
   }
 
-  bool aBroker::register_publisher(DlgMessage *msg)
+  //Clients that took the endpoint from their ServiceCache come here first.
+  //The entry is good only if it has the epoch of this broker, otherwise the
+  //client is told to ask DlgServer. Returns false if the client was turned away.
+  //Subscribers of XPUB broker always go to the server for its XPUB endpoint.
+  bool aBroker::check_epoch(DlgMessage *msg, const std::string& identity, bool isSubscriber)
   {
+    uint64_t epoch = 0;
+    std::string serviceName;
+    msg->GetEpoch(epoch);
+    msg->GetServiceName(serviceName);
+    if (epoch == m_epoch && serviceName == m_name && !(isSubscriber && m_mode == BROKER_XPUB))
+      return true;
+
+    Print(DBG_LEVEL_DEBUG,"aBroker: stale epoch %llu of '%s' (current %llu)\n",
+	  (unsigned long long)epoch, identity.c_str(), (unsigned long long)m_epoch);
+    std::string from(m_name);
+    DlgMessage *reply = new DlgMessage(serviceName, from, identity, STALE_EPOCH, std::string(""));
+    reply->SetIdentity(identity);
+    reply->SetEpoch(epoch);
+    if (!reply->Send(m_socket))
+      Print(DBG_LEVEL_ERROR,"aBroker::check_epoch: couldn't send a reply.\n");
+    delete reply;
+    return false;
+  }
+
+  bool aBroker::subscribe_to_service(DlgMessage *msg)
+  { 
     std::string identity;
     if (!msg->GetIdentity(identity))
       {
-	Print(DBG_LEVEL_ERROR,"aBroker::register_publisher: Couldn't get identity.\n");
+	Print(DBG_LEVEL_ERROR,"aBroker::subscribe_to_service: Couldn't get identity.\n");
 	return false;
       }
-    
-    if (!this->AddPublisher(identity.c_str()))
+    if (!check_epoch(msg, identity, true))
       {
-	Print(DBG_LEVEL_ERROR,"aBroker::register_publisher: Couldn't register publisher %s.\n", identity.c_str());
-	return false;	
+	delete msg;
+	return true;
       }
-    delete msg;
+    if (!this->Resubscribe(identity.c_str()))
+      {
+	Print(DBG_LEVEL_ERROR,"aBroker::register_publisher: Couldn't register subscriber %s.\n", identity.c_str());
+	return false;
+      }
+    //the same reply DlgServer would send, so the client goes on as usual
+    std::string from(m_name);
+    DlgMessage *reply = new DlgMessage(m_name, from, identity, SUBSCRIBE_TO_SERVICE, m_port);
+    reply->SetIdentity(identity);
+    reply->SetEpoch(m_epoch);
+    if (!reply->Send(m_socket))
+      {
+	Print(DBG_LEVEL_ERROR,"aBroker::subscribe_to_service: couldn't send a reply.\n");
+	delete reply;
+	return false;
+      }
+    delete reply;
+    delete msg;
+    return true;
+  }
+
+  bool aBroker::grant_credit(DlgMessage *msg)
+  {
+    std::string identity;
+    if (!msg->GetIdentity(identity))
+      {
+	Print(DBG_LEVEL_ERROR,"aBroker::grant_credit: Couldn't get identity.\n");
+	return false;
+      }
+    DlgCredit credit;
+    size_t size = sizeof(credit);
+    if (!msg->GetMessageBuffer(&credit, size) || size != sizeof(credit))
+      {
+	Print(DBG_LEVEL_ERROR,"aBroker::grant_credit: bad credit message from %s.\n", identity.c_str());
+	return false;
+      }
+    m_mutex.lock();
+    aSubscriber* s = m_subscribers.Find(identity);
+    if (!s)
+      {
+	m_mutex.unlock();
+	Print(DBG_LEVEL_ERROR,"aBroker::grant_credit: unknown subscriber %s.\n", identity.c_str());
+	return false;
+      }
+    s->GrantCredit(credit.messages, credit.bytes);
+    flush_pending(s);
+    m_mutex.unlock();
+    delete msg;
+    return true;
+  }
+
+  //The subscriber gets only schema messages whose routing key starts with
+  //the body, an empty body takes the filter off
+  bool aBroker::key_filter(DlgMessage *msg)
+  {
+    std::string identity;
+    if (!msg->GetIdentity(identity))
+      {
+	Print(DBG_LEVEL_ERROR,"aBroker::key_filter: Couldn't get identity.\n");
+	return false;
+      }
+    std::string prefix;
+    if (!msg->GetMessageBody(prefix))
+      {
+	Print(DBG_LEVEL_ERROR,"aBroker::key_filter: bad filter from %s.\n", identity.c_str());
+	return false;
+      }
+    m_mutex.lock();
+    aSubscriber* s = m_subscribers.Find(identity);
+    if (!s)
+      {
+	m_mutex.unlock();
+	Print(DBG_LEVEL_ERROR,"aBroker::key_filter: unknown subscriber %s.\n", identity.c_str());
+	return false;
+      }
+    s->SetKeyFilter(prefix);
+    m_mutex.unlock();
+    delete msg;
+    return true;
+  }
+
+  //A request goes to one subscriber, round robin, and is not queued: it is
+  //delivered under the credit of that subscriber. With no subscribers the
+  //requester gets an empty reply flagged HEADER_FLAG_NO_RESPONDER at once,
+  //and so does it if the request is dropped on the way. In BROKER_XPUB mode
+  //the broker doesn't know its subscribers, every request is answered so.
+  bool aBroker::request_message(DlgMessage *msg)
+  {
+    std::string identity;
+    if (!msg->GetIdentity(identity))
+      {
+	Print(DBG_LEVEL_ERROR,"aBroker::request_message: Couldn't get identity.\n");
+	return false;
+      }
+    //replies are routed by the 'from' address
+    if (!msg->SetFromAddress(identity))
+      return false;
+
+    std::shared_ptr<DlgMessage> shared(msg);
+    m_mutex.lock();
+    while (!m_subscribers.Empty())
+      {
+	size_t i = m_nextResponder++ % m_subscribers.Size();
+	if (deliver(shared, &m_subscribers.At(i).second))
+	  {
+	    m_mutex.unlock();
+	    return true;
+	  }
+	remove_subscriber(i);
+      }
+    m_mutex.unlock();
+
+    no_responder(msg);
+    //msg is deleted by shared, it is always handled here
+    return true;
+  }
+
+  //Must be called with m_mutex locked. Requests waiting for credit of the
+  //subscriber won't be answered, their requesters are told so at once.
+  void aBroker::remove_subscriber(size_t i)
+  {
+    Print(DBG_LEVEL_ERROR,"aBroker %s: subscriber '%s' doesn't keep up and is removed.\n",
+	  m_name.c_str(), m_subscribers.At(i).first.c_str());
+    std::deque<std::shared_ptr<DlgMessage> >& pending = m_subscribers.At(i).second.Pending();
+    for (size_t n = 0; n < pending.size(); n++)
+      no_responder(pending[n].get());
+    m_subscribers.EraseAt(i);
+    m_removed.Add();
+  }
+
+  //An empty reply flagged HEADER_FLAG_NO_RESPONDER, for a request nobody
+  //will answer. Anything but a request is ignored.
+  void aBroker::no_responder(DlgMessage* request)
+  {
+    uint32_t msgType = 0;
+    std::string requester;
+    DlgHeader header;
+    if (!request->GetMessageType(msgType) || msgType != REQUEST_MESSAGE ||
+	!request->GetFromAddress(requester) || !request->GetHeader(header))
+      return;
+    std::string from(m_name);
+    DlgMessage reply(m_name, from, requester, REPLY_MESSAGE, std::string(""));
+    DlgHeader replyHeader;
+    reply.GetHeader(replyHeader);
+    replyHeader.flags      |= HEADER_FLAG_NO_RESPONDER;
+    replyHeader.correlation = header.correlation;
+    replyHeader.priority    = header.priority;
+    reply.SetHeader(replyHeader);
+    reply.SetIdentity(requester);
+    if (!reply.Send(m_socket))
+      Print(DBG_LEVEL_ERROR,"aBroker::no_responder: couldn't answer '%s'.\n", requester.c_str());
+  }
+
+  //A reply goes straight to the requester, it is neither queued nor fanned out
+  bool aBroker::reply_message(DlgMessage *msg)
+  {
+    std::string to;
+    if (!msg->GetToAddress(to) || to.empty())
+      {
+	Print(DBG_LEVEL_ERROR,"aBroker::reply_message: reply without 'to' address.\n");
+	return false;
+      }
+    if (!msg->SetIdentity(to) || !msg->Send(m_socket))
+      {
+	Print(DBG_LEVEL_ERROR,"aBroker::reply_message: couldn't send reply to '%s'.\n", to.c_str());
+	return false;
+      }
+    delete msg;
+    return true;
+  }
+
+  bool aBroker::register_publisher(DlgMessage *msg)
+  {
+    std::string identity;
+    if (!msg->GetIdentity(identity))
+      {
+	Print(DBG_LEVEL_ERROR,"aBroker::register_publisher: Couldn't get identity.\n");
+	return false;
+      }
+    if (!check_epoch(msg, identity, false))
+      {
+	delete msg;
+	return true;
+      }
+    
+    if (!has_publisher(identity) && !this->AddPublisher(identity.c_str()))
+      {
+	Print(DBG_LEVEL_ERROR,"aBroker::register_publisher: Couldn't register publisher %s.\n", identity.c_str());
+	return false;	
+      }
+    std::string from(m_name);
+    DlgMessage *reply = new DlgMessage(m_name, from, identity, REGISTER_PUBLISHER, m_port);
+    reply->SetIdentity(identity);
+    reply->SetEpoch(m_epoch);
+    if (!reply->Send(m_socket))
+      {
+	Print(DBG_LEVEL_ERROR,"aBroker::register_publisher: couldn't send a reply.\n");
+	delete reply;
+	return false;
+      }
+    delete reply;
+    delete msg;
     return true;
   }
 
@@ -391,17 +1196,26 @@ namespace ZmqDialog
 
   volatile bool DlgServer::m_isRunning = false;
 
-  DlgServer::DlgServer() : m_router(nullptr), m_main_thread(nullptr)
+  DlgServer::DlgServer() : DlgServer(server_address, DLG_SERVER_TCP_PORT)
+  {
+  }
+
+  //Several servers of a federation may run on one host with different ports
+  DlgServer::DlgServer(const char* address, int port) : m_router(nullptr), m_main_thread(nullptr),
+			   m_address(address), m_endpoint(std::string(address) + ":" + std::to_string(port)),
+			   m_hasNewPeers(false), m_workerThreshold(WORKER_LOAD_THRESHOLD), m_dequeuePolicy(DEQUEUE_STRICT),
+			   m_overflowPolicy(OVERFLOW_DROP_OLDEST), m_brokerMode(BROKER_ROUTER),
+			   m_nextEpoch((uint64_t)current_time())
   {
   //  const char* server_address          ="192.168.0.112";
     try
       {
-        m_router  = ZMQ::Instance()->CreateSocket(ZMQ_ROUTER);
+	m_router  = ZMQ::Instance()->CreateSocket(ZMQ_ROUTER, SOCKET_SERVER);
         int socketID;
         size_t sizeSocketID = sizeof(socketID);
         m_router->getsockopt(ZMQ_TYPE, &socketID, &sizeSocketID);
         char endpoint[256];
-        sprintf(endpoint,"tcp://%s:%d",server_address, DLG_SERVER_TCP_PORT);
+	sprintf(endpoint,"tcp://%s:%d", address, port);
         m_router->bind(endpoint);
         size_t size = sizeof(endpoint);
         m_router->getsockopt(ZMQ_LAST_ENDPOINT, &endpoint, &size);
@@ -422,6 +1236,56 @@ namespace ZmqDialog
 	Print(DBG_LEVEL_ERROR, "DlgServer() unknown exeption.\n");
 	throw Exception("DlgServer() fatal error.");
       }
+
+    m_handlers.Register(PEER_HELLO,                &DlgServer::peer_hello,       "accept a peer");
+    m_handlers.Register(PEER_DIRECTORY,            &DlgServer::peer_directory,   "read directory of a peer");
+    m_handlers.Register(WORKER_HELLO,              &DlgServer::worker_hello,     "accept a worker");
+    m_handlers.Register(WORKER_LOAD,               &DlgServer::worker_load,      "read load of a worker");
+    m_handlers.Register(SUBSCRIBE_TO_SERVICE,      &DlgServer::subscribe_to_service, "subscribe to service", FOR_SERVICE);
+    m_handlers.Register(REGISTER_PUBLISHER,        &DlgServer::register_publisher, "register publisher", FOR_SERVICE);
+    m_handlers.Register(SUBSCRIBE_DIRECT,          &DlgServer::subscribe_direct, "subscribe to direct publishers", FOR_SERVICE);
+    m_handlers.Register(REGISTER_DIRECT_PUBLISHER, &DlgServer::register_direct_publisher, "register direct publisher", FOR_SERVICE);
+    m_handlers.Register(BROKER_CREATED,            &DlgServer::broker_created,   "place a broker", FOR_SERVICE);
+    m_handlers.Register(GET_STATS,                 &DlgServer::get_stats,        "report statistics");
+  }
+
+  bool DlgServer::RegisterHandler(uint32_t msgType, const std::function<bool(DlgMessage*)> &handler,
+				  const char* what)
+  {
+    if (msgType < MESSAGE_TYPE_USER || m_main_thread || !m_handlers.Register(msgType, handler, what))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::RegisterHandler: cannot register message type %u.\n", msgType);
+	return false;
+      }
+    return true;
+  }
+
+  bool DlgServer::Reply(DlgMessage *request, uint32_t msgType, const std::string &body)
+  {
+    std::string identity, serviceName;
+    if (!request->GetIdentity(identity))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::Reply: Couldn't get identity.\n");
+	return false;
+      }
+    request->GetServiceName(serviceName);
+    std::string from("DlgServer");
+    DlgMessage reply(serviceName, from, identity, msgType, body);
+    //the client matches the reply to its request by the correlation
+    DlgHeader header, replyHeader;
+    if (request->GetHeader(header) && reply.GetHeader(replyHeader))
+      {
+	replyHeader.correlation = header.correlation;
+	replyHeader.priority    = header.priority;
+	reply.SetHeader(replyHeader);
+      }
+    reply.SetIdentity(identity);
+    if (!reply.Send(m_router))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::Reply: Couldn't answer %s.\n", identity.c_str());
+	return false;
+      }
+    return true;
   }
 
   DlgServer::~DlgServer()
@@ -431,9 +1295,15 @@ namespace ZmqDialog
       {
 	for (auto &v : m_services)
 	  delete v.second;
-	m_services.clear();
+	m_services.Clear();
 	if(m_main_thread && m_main_thread->joinable())
 	  m_main_thread->join();
+	for (size_t i = 0; i < m_peers.size(); i++)
+	  {
+	    m_peers[i].socket->close();
+	    delete m_peers[i].socket;
+	  }
+	m_peers.clear();
 	Print(DBG_LEVEL_DEBUG, "*****\n");
 	delete m_router;
 	delete m_main_thread;
@@ -461,20 +1331,52 @@ namespace ZmqDialog
     return true;
   }
 
+  void DlgServer::SetDequeuePolicy(DequeuePolicy policy)
+  {
+    m_dequeuePolicy = policy;
+    for (auto &v : m_services)
+      if (v.second->HasBroker())
+	v.second->GetBroker()->SetDequeuePolicy(policy);
+  }
+
+  void DlgServer::SetOverflowPolicy(OverflowPolicy policy)
+  {
+    m_overflowPolicy = policy;
+    for (auto &v : m_services)
+      if (v.second->HasBroker())
+	v.second->GetBroker()->SetOverflowPolicy(policy);
+  }
+
   bool DlgServer::create_service(const char* name)
   {
-    if(m_services.count(name) != 0)
-      return false;
-    m_services[std::string(name)] = new aService(name);
-    if(!m_services[std::string(name)])
+    if(m_services.Contains(name))
       return false;
+    m_services.Insert(name, new aService(name));
     return true;
   }
 
+  //Services in the direct mode never start a broker
+  aBroker* DlgServer::get_broker(const std::string& serviceName)
+  {
+    aService* service = *m_services.Find(serviceName);
+    if (!service->HasBroker())
+      {
+	aBroker* broker = service->CreateBroker(m_brokerMode, m_address);
+	broker->SetDequeuePolicy(m_dequeuePolicy);
+	broker->SetOverflowPolicy(m_overflowPolicy);
+	//time based start, so a restarted server doesn't repeat old epochs
+	broker->SetEpoch(m_nextEpoch++);
+	if (!m_peers.empty())
+	  update_remotes();
+      }
+    return service->GetBroker();
+  }
+
 
 
   void DlgServer::main_thread()
   {
+    Affinity::Apply(THREAD_SERVER, "DlgServer");
     int64_t now = current_time();
     int64_t heartbeat_at = now + HEARTBEAT_INTERVAL;
     while(m_isRunning)
@@ -485,6 +1387,33 @@ namespace ZmqDialog
 	if (timeout < 0)
 	  timeout = 0;
 	zmq::poll(&items[0], 1, 0);
+
+	if (m_hasNewPeers.exchange(false))
+	  {
+	    std::vector<std::string> endpoints;
+	    m_peerMutex.lock();
+	    endpoints.swap(m_newPeers);
+	    m_peerMutex.unlock();
+	    for (size_t i = 0; i < endpoints.size(); i++)
+	      {
+		aPeer* peer = connect_peer(endpoints[i]);
+		if (!peer)
+		  continue;
+		DlgMessage hello(std::string(""), m_endpoint, peer->endpoint, PEER_HELLO, std::string(""));
+		if (!hello.Send(peer->socket))
+		  Print(DBG_LEVEL_ERROR,"main_thread: couldn't greet peer '%s'.\n", peer->endpoint.c_str());
+		send_directory(*peer);
+	      }
+	  }
+
+	//peers learn about new brokers and subscribers at least this often
+	now = current_time();
+	if (now >= heartbeat_at)
+	  {
+	    send_directories();
+	    heartbeat_at = now + HEARTBEAT_INTERVAL;
+	  }
+
 	if (items[0].revents & ZMQ_POLLIN)
 	  {
 	    DlgMessage* msg = new DlgMessage;
@@ -495,20 +1424,7 @@ namespace ZmqDialog
 		continue;
 	      }
 
-	    std::string serviceName;
-	    if(!msg->GetServiceName(serviceName))
-	      {
-		Print(DBG_LEVEL_ERROR,"main_thread: bad message received (cannot get service name).\n");
-		delete msg;
-		continue;
-	      }
-	    
-	    if(m_services.count(serviceName) == 0 && !create_service(serviceName.c_str()))
-	      {
-		Print(DBG_LEVEL_ERROR,"main_thread: cannot create service '%s'\n", serviceName.c_str());
-		delete msg;
-		continue;
-	      }
+	    m_received.Add();
 	    uint32_t msgType = 0;
 	    if (!msg->GetMessageType(msgType))
 	      {
@@ -516,23 +1432,33 @@ namespace ZmqDialog
 		delete msg;
 		continue;
 	      }
-    	   
-	    //SUBSCRIBE_TO_SERVICE_MESSAGE
-	    if (msgType == SUBSCRIBE_TO_SERVICE && !subscribe_to_service(msg))
+
+	    //peers and workers send messages which are not for a service
+	    const message_registry_t<DlgServer>::entry_t* handler = m_handlers.Find(msgType);
+	    if (!handler)
 	      {
-		Print(DBG_LEVEL_ERROR,"main_thread: Couldn't subscribe to service.\n");
+		m_unhandled.Add();
+		Print(DBG_LEVEL_VERBOSE,"main_thread: message of type %u is not handled.\n", msgType);
 		delete msg;
 		continue;
 	      }
-    
-	    //REGISTER_PUBLISHER_MESSAGE
-	    if (msgType == REGISTER_PUBLISHER && !register_publisher(msg))
+	    if (handler->flags & FOR_SERVICE)
 	      {
-		Print(DBG_LEVEL_ERROR,"main_thread: Couldn't register publisher.\n");
-		delete msg;
-		continue;
+		std::string serviceName;
+		if(!msg->GetServiceName(serviceName))
+		  {
+		    Print(DBG_LEVEL_ERROR,"main_thread: bad message received (cannot get service name).\n");
+		    delete msg;
+		    continue;
+		  }
+		if(!m_services.Contains(serviceName) && !create_service(serviceName.c_str()))
+		  {
+		    Print(DBG_LEVEL_ERROR,"main_thread: cannot create service '%s'\n", serviceName.c_str());
+		    delete msg;
+		    continue;
+		  }
 	      }
-
+	    m_handlers.Call(this, handler, msg, "main_thread");
 	  }
       }
     m_isRunning = false;
@@ -556,16 +1482,30 @@ namespace ZmqDialog
 	return false;
       }
 
-    if (!m_services[serviceName]->GetBroker()->AddSubscriber(identity.c_str()))
+    aService* service = *m_services.Find(serviceName);
+    if (!service->HasBroker() && (service->IsPlaced() || !m_workers.empty()))
+      return reply_placed(service, msg, SUBSCRIBE_TO_SERVICE);
+
+    aBroker* broker = get_broker(serviceName);
+    uint32_t replyType = SUBSCRIBE_TO_SERVICE;
+    std::string brokerPort = broker->GetPort();
+    if (broker->GetMode() == BROKER_XPUB)
+      {
+	//XPUB broker learns about the subscriber from its subscription
+	replyType = SUBSCRIBE_TO_XPUB;
+	brokerPort = broker->GetXPubPort();
+      }
+    else if (!broker->Resubscribe(identity.c_str()))
       {
 	Print(DBG_LEVEL_ERROR,"DlgServer::subscribe_to_service: Couldn't add subscriber %s.\n", identity.c_str());
 	return false;
       }
     
     std::string from("DlgServer");
-    std::string brokerPort = m_services[serviceName]->GetBroker()->GetPort();
-    DlgMessage *reply = new DlgMessage(serviceName, from, identity, SUBSCRIBE_TO_SERVICE, brokerPort);
+    DlgMessage *reply = new DlgMessage(serviceName, from, identity, replyType, brokerPort);
     reply->SetIdentity(identity);
+    if (replyType == SUBSCRIBE_TO_SERVICE)
+      reply->SetEpoch(broker->GetEpoch());
     if (!reply->Send(m_router))
       {
     Print(DBG_LEVEL_ERROR,"DlgServer::subscribe_to_service: couldn't send a reply.\n");
@@ -575,6 +1515,9 @@ namespace ZmqDialog
     
     delete reply;
     delete msg;
+    //the service may have become interesting for the peers
+    if (!m_peers.empty())
+      send_directories();
     return true;
   }
 
@@ -594,15 +1537,19 @@ namespace ZmqDialog
 	return false;
       }  
 
-    if (!m_services[serviceName]->GetBroker()->AddPublisher(identity.c_str()))
-      {
-	Print(DBG_LEVEL_ERROR,"DlgServer::register_publisher: Couldn't register publisher %s.\n", identity.c_str());
-	return false;
-      }
+    aService* service = *m_services.Find(serviceName);
+    if (!service->HasBroker() && (service->IsPlaced() || !m_workers.empty()))
+      return reply_placed(service, msg, REGISTER_PUBLISHER);
+
+    //a publisher comes again after its cached broker didn't answer
+    aBroker* broker = get_broker(serviceName);
+    if (!broker->AddPublisher(identity.c_str()))
+      Print(DBG_LEVEL_DEBUG,"DlgServer::register_publisher: publisher %s is already registered.\n", identity.c_str());
     std::string from("DlgServer");
-    std::string brokerPort = m_services[serviceName]->GetBroker()->GetPort();
+    std::string brokerPort = broker->GetPort();
     DlgMessage *reply = new DlgMessage(serviceName, from, identity, REGISTER_PUBLISHER, brokerPort);
     reply->SetIdentity(identity);
+    reply->SetEpoch(broker->GetEpoch());
 
     if (!reply->Send(m_router))
       {
@@ -615,4 +1562,603 @@ namespace ZmqDialog
     return true;
   }
 
+  bool DlgServer::send_direct_endpoints(const std::string& serviceName, const std::string& identity,
+					const std::string& endpoints)
+  {
+    std::string from("DlgServer");
+    DlgMessage reply(serviceName, from, identity, DIRECT_PUBLISHERS, endpoints);
+    reply.SetIdentity(identity);
+    if (!reply.Send(m_router))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::send_direct_endpoints: couldn't send endpoints to %s.\n", identity.c_str());
+	return false;
+      }
+    return true;
+  }
+
+  //Subscriber gets endpoints of all direct publishers of the service now
+  //and of every new one later
+  bool DlgServer::subscribe_direct(DlgMessage *msg)
+  {
+    std::string serviceName;
+    if(!msg->GetServiceName(serviceName))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::subscribe_direct: bad message received (cannot get service name).\n");
+	return false;
+      }
+    std::string identity;
+    if (!msg->GetIdentity(identity))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::subscribe_direct: Couldn't get identity.\n");
+	return false;
+      }
+
+    aService* service = *m_services.Find(serviceName);
+    service->AddDirectSubscriber(identity);
+    if (!send_direct_endpoints(serviceName, identity, service->GetDirectEndpoints()))
+      return false;
+    delete msg;
+    return true;
+  }
+
+  bool DlgServer::register_direct_publisher(DlgMessage *msg)
+  {
+    std::string serviceName;
+    if(!msg->GetServiceName(serviceName))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::register_direct_publisher: bad message received (cannot get service name).\n");
+	return false;
+      }
+    std::string identity;
+    if (!msg->GetIdentity(identity))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::register_direct_publisher: Couldn't get identity.\n");
+	return false;
+      }
+    std::string endpoint;
+    if (!msg->GetMessageBody(endpoint) || endpoint.empty())
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::register_direct_publisher: %s sent no endpoint.\n", identity.c_str());
+	return false;
+      }
+    Print(DBG_LEVEL_DEBUG,"DlgServer::register_direct_publisher: %s publishes '%s' at %s.\n",
+	  identity.c_str(), serviceName.c_str(), endpoint.c_str());
+
+    aService* service = *m_services.Find(serviceName);
+    service->AddDirectPublisher(identity, endpoint);
+
+    //acknowledge and tell already known subscribers where to connect
+    std::string from("DlgServer");
+    DlgMessage reply(serviceName, from, identity, REGISTER_DIRECT_PUBLISHER, endpoint);
+    reply.SetIdentity(identity);
+    if (!reply.Send(m_router))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::register_direct_publisher: couldn't send a reply.\n");
+	return false;
+      }
+    const std::vector<std::string>& subscribers = service->GetDirectSubscribers();
+    for (size_t i = 0; i < subscribers.size(); i++)
+      send_direct_endpoints(serviceName, subscribers[i], endpoint);
+    delete msg;
+    return true;
+  }
+
+  ////////////////////////////// Federation //////////////////////////////
+
+  bool DlgServer::AddPeer(const std::string& endpoint)
+  {
+    if (endpoint.empty() || endpoint == m_endpoint)
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::AddPeer: bad peer '%s'.\n", endpoint.c_str());
+	return false;
+      }
+    m_peerMutex.lock();
+    m_newPeers.push_back(endpoint);
+    m_peerMutex.unlock();
+    m_hasNewPeers = true;
+    return true;
+  }
+
+  void DlgServer::PrintPeers()
+  {
+    std::lock_guard<std::mutex> lock(m_peerMutex);
+    Print(DBG_LEVEL_INFO, "Server %s, %lu peer(s):\n", m_endpoint.c_str(), (unsigned long)m_peers.size());
+    for (size_t i = 0; i < m_peers.size(); i++)
+      {
+	Print(DBG_LEVEL_INFO, "  %s\n", m_peers[i].endpoint.c_str());
+	for (auto &v : m_peers[i].services)
+	  Print(DBG_LEVEL_INFO, "    %-20s broker %s%s\n", v.first.c_str(), v.second.broker.c_str(),
+		v.second.isInterested ? ", has subscribers" : "");
+      }
+  }
+
+  //Main thread only. Returns the known peer or connects to a new one.
+  aPeer* DlgServer::connect_peer(const std::string& endpoint)
+  {
+    for (size_t i = 0; i < m_peers.size(); i++)
+      if (m_peers[i].endpoint == endpoint)
+	return &m_peers[i];
+
+    aPeer peer;
+    peer.endpoint = endpoint;
+    peer.socket   = ZMQ::Instance()->CreateSocket(ZMQ_DEALER, SOCKET_SERVER);
+    peer.socket->setsockopt(ZMQ_IDENTITY, m_endpoint.c_str(), m_endpoint.size()+1);
+    char address[256];
+    snprintf(address, sizeof(address), "tcp://%s", endpoint.c_str());
+    try
+      {
+	peer.socket->connect(address);
+      }
+    catch(zmq::error_t& e)
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::connect_peer: couldn't connect to '%s' (%s).\n", address, e.what());
+	delete peer.socket;
+	return nullptr;
+      }
+    Print(DBG_LEVEL_INFO,"DlgServer: %s is a peer now.\n", endpoint.c_str());
+    std::lock_guard<std::mutex> lock(m_peerMutex);
+    m_peers.push_back(peer);
+    return &m_peers.back();
+  }
+
+  //Line per service with a broker: name, broker endpoint, epoch and whether
+  //it has subscribers. Only the last one decides where traffic goes.
+  bool DlgServer::send_directory(aPeer& peer)
+  {
+    std::string body;
+    for (auto &v : m_services)
+      {
+	char line[512];
+	if (v.second->HasBroker())
+	  {
+	    aBroker* broker = v.second->GetBroker();
+	    snprintf(line, sizeof(line), "%s %s %llu %d\n", v.first.c_str(), broker->GetPort().c_str(),
+		     (unsigned long long)broker->GetEpoch(), broker->GetSubscriberCount() > 0 ? 1 : 0);
+	  }
+	else if (v.second->IsPlaced() && !v.second->Placement().broker.empty())
+	  {
+	    const aService::placement_t& placement = v.second->Placement();
+	    snprintf(line, sizeof(line), "%s %s %llu %d\n", v.first.c_str(), placement.broker.c_str(),
+		     (unsigned long long)placement.epoch, placement.subscribers > 0 ? 1 : 0);
+	  }
+	else
+	  continue;
+	body += line;
+      }
+    DlgMessage msg(std::string(""), m_endpoint, peer.endpoint, PEER_DIRECTORY, body);
+    if (!msg.Send(peer.socket))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::send_directory: couldn't send directory to '%s'.\n", peer.endpoint.c_str());
+	return false;
+      }
+    return true;
+  }
+
+  void DlgServer::send_directories()
+  {
+    for (size_t i = 0; i < m_peers.size(); i++)
+      send_directory(m_peers[i]);
+  }
+
+  //Every local broker forwards to the brokers of its service which have subscribers
+  void DlgServer::update_remotes()
+  {
+    for (auto &v : m_services)
+      {
+	if (!v.second->HasBroker())
+	  continue;
+	std::map<std::string, uint64_t> remotes;
+	for (size_t i = 0; i < m_peers.size(); i++)
+	  {
+	    std::map<std::string, aPeer::remote_service_t>::iterator it = m_peers[i].services.find(v.first);
+	    if (it != m_peers[i].services.end() && it->second.isInterested)
+	      remotes[it->second.broker] = it->second.epoch;
+	  }
+	v.second->GetBroker()->SetRemotes(remotes);
+      }
+  }
+
+  bool DlgServer::peer_hello(DlgMessage *msg)
+  {
+    std::string endpoint;
+    if (!msg->GetFromAddress(endpoint) || endpoint.empty())
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::peer_hello: bad message received (cannot get peer address).\n");
+	return false;
+      }
+    aPeer* peer = connect_peer(endpoint);
+    if (!peer)
+      return false;
+    send_directory(*peer);
+    delete msg;
+    return true;
+  }
+
+  bool DlgServer::peer_directory(DlgMessage *msg)
+  {
+    std::string endpoint;
+    std::string body;
+    if (!msg->GetFromAddress(endpoint) || endpoint.empty() || !msg->GetMessageBody(body))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::peer_directory: bad message received.\n");
+	return false;
+      }
+    aPeer* peer = connect_peer(endpoint);
+    if (!peer)
+      return false;
+
+    std::map<std::string, aPeer::remote_service_t> services;
+    size_t begin = 0;
+    while (begin < body.size())
+      {
+	size_t end = body.find('\n', begin);
+	if (end == std::string::npos)
+	  end = body.size();
+	std::string line = body.substr(begin, end - begin);
+	begin = end + 1;
+
+	char name[256];
+	char broker[256];
+	unsigned long long epoch = 0;
+	int isInterested = 0;
+	if (sscanf(line.c_str(), "%255s %255s %llu %d", name, broker, &epoch, &isInterested) != 4)
+	  {
+	    Print(DBG_LEVEL_ERROR,"DlgServer::peer_directory: bad line '%s' from %s.\n", line.c_str(), endpoint.c_str());
+	    continue;
+	  }
+	aPeer::remote_service_t& service = services[name];
+	service.broker       = broker;
+	service.epoch        = epoch;
+	service.isInterested = (isInterested != 0);
+      }
+    m_peerMutex.lock();
+    peer->services.swap(services);
+    m_peerMutex.unlock();
+
+    update_remotes();
+    delete msg;
+    return true;
+  }
+
+  ////////////////////////// Broker workers //////////////////////////////
+
+  void DlgServer::PrintWorkers()
+  {
+    Print(DBG_LEVEL_INFO, "%lu broker worker(s), threshold %llu msgs/sec:\n",
+	  (unsigned long)m_workers.size(), (unsigned long long)m_workerThreshold);
+    for (size_t i = 0; i < m_workers.size(); i++)
+      {
+	Print(DBG_LEVEL_INFO, "  %s: %llu msgs/sec\n", m_workers[i].identity.c_str(),
+	      (unsigned long long)m_workers[i].load);
+	for (auto &v : m_services)
+	  if (v.second->Placement().worker == m_workers[i].identity)
+	    Print(DBG_LEVEL_INFO, "    %-20s %s, %llu msgs/sec\n", v.first.c_str(),
+		  v.second->Placement().broker.c_str(), (unsigned long long)v.second->Placement().rate);
+      }
+  }
+
+  //Main thread only, it owns m_services
+  std::string DlgServer::format_stats()
+  {
+    char line[512];
+    snprintf(line, sizeof(line), "server %s received %llu unhandled %llu services %lu workers %lu\n",
+	     m_endpoint.c_str(), (unsigned long long)m_received.Get(), (unsigned long long)m_unhandled.Get(),
+	     (unsigned long)m_services.Size(), (unsigned long)m_workers.size());
+    std::string stats(line);
+    for (auto &v : m_services)
+      {
+	aService* service = v.second;
+	if (service->HasBroker())
+	  {
+	    broker_stats_t b;
+	    service->GetBroker()->GetStats(b);
+	    snprintf(line, sizeof(line), "service %s in %llu %llu out %llu %llu dropped %llu removed %llu "
+		     "queued %lu pending %lu subscribers %lu publishers %lu residence %llu %llu %llu %llu\n",
+		     v.first.c_str(),
+		     (unsigned long long)b.messagesIn, (unsigned long long)b.bytesIn,
+		     (unsigned long long)b.messagesOut, (unsigned long long)b.bytesOut,
+		     (unsigned long long)b.dropped, (unsigned long long)b.removed,
+		     (unsigned long)b.queued, (unsigned long)b.pending,
+		     (unsigned long)b.subscribers, (unsigned long)b.publishers,
+		     (unsigned long long)b.residence.count, (unsigned long long)b.residence.p50,
+		     (unsigned long long)b.residence.p99, (unsigned long long)b.residence.p999);
+	  }
+	else if (service->IsPlaced())
+	  snprintf(line, sizeof(line), "service %s worker %s rate %llu subscribers %lu\n", v.first.c_str(),
+		   service->Placement().worker.c_str(), (unsigned long long)service->Placement().rate,
+		   (unsigned long)service->Placement().subscribers);
+	else
+	  continue;
+	stats += line;
+      }
+    return stats;
+  }
+
+  bool DlgServer::get_stats(DlgMessage *msg)
+  {
+    if (!Reply(msg, GET_STATS, format_stats()))
+      return false;
+    delete msg;
+    return true;
+  }
+
+  bool DlgServer::RequestStats(const std::string& server, std::string& stats, uint32_t timeout)
+  {
+    static std::atomic<uint32_t> requests(0);
+    char identity[64];
+    snprintf(identity, sizeof(identity), "stats-%d-%u", (int)getpid(), (unsigned)requests++);
+    zmq::socket_t* socket = ZMQ::Instance()->CreateSocket(ZMQ_DEALER, SOCKET_CLIENT);
+    socket->setsockopt(ZMQ_IDENTITY, identity, strlen(identity)+1);
+    char endpoint[256];
+    snprintf(endpoint, sizeof(endpoint), "tcp://%s", server.c_str());
+    bool isReceived = false;
+    try
+      {
+	socket->connect(endpoint);
+	DlgMessage request(std::string(""), std::string(identity), std::string(""), GET_STATS, std::string(""));
+	zmq::pollitem_t item = { static_cast<void*>(*socket), 0, ZMQ_POLLIN, 0 };
+	if (request.Send(socket) && zmq::poll(&item, 1, (long)timeout/1000) > 0)
+	  {
+	    DlgMessage reply;
+	    isReceived = reply.Recv(socket) && reply.GetMessageBody(stats);
+	  }
+      }
+    catch(zmq::error_t& e)
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::RequestStats: %s\n", e.what());
+      }
+    if (!isReceived)
+      Print(DBG_LEVEL_ERROR,"DlgServer::RequestStats: no answer from %s.\n", server.c_str());
+    socket->close();
+    delete socket;
+    return isReceived;
+  }
+
+  //m_services belongs to the main thread, so the console asks it like anyone else
+  void DlgServer::PrintStats()
+  {
+    std::string stats;
+    if (RequestStats(m_endpoint, stats))
+      Print(DBG_LEVEL_INFO, "%s", stats.c_str());
+  }
+
+  aWorker* DlgServer::find_worker(const std::string& identity)
+  {
+    for (size_t i = 0; i < m_workers.size(); i++)
+      if (m_workers[i].identity == identity)
+	return &m_workers[i];
+    return nullptr;
+  }
+
+  //Consistent hashing: a new worker takes over only its share of services
+  aWorker* DlgServer::place_service(const std::string& serviceName)
+  {
+    if (m_ring.empty())
+      return nullptr;
+    std::map<uint32_t, size_t>::iterator it = m_ring.lower_bound(key_view_t(serviceName).Hash());
+    if (it == m_ring.end())
+      it = m_ring.begin();
+    return &m_workers[it->second];
+  }
+
+  bool DlgServer::create_placed_broker(const std::string& serviceName, aService* service, const aWorker& worker)
+  {
+    uint64_t epoch = m_nextEpoch++;
+    std::string from("DlgServer");
+    DlgMessage create(serviceName, from, worker.identity, CREATE_BROKER, std::string(""));
+    create.SetIdentity(worker.identity);
+    create.SetEpoch(epoch);
+    if (!create.Send(m_router))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::create_placed_broker: couldn't ask %s for a broker.\n", worker.identity.c_str());
+	return false;
+      }
+
+    //placed only when the worker was asked, else clients would wait for nothing
+    aService::placement_t& placement = service->Placement();
+    placement.worker = worker.identity;
+    placement.broker.clear();
+    placement.epoch  = epoch;
+    Print(DBG_LEVEL_VERBOSE,"DlgServer: broker of '%s' goes to %s.\n", serviceName.c_str(), worker.identity.c_str());
+    return true;
+  }
+
+  //The reply carries the broker endpoint as usual. The broker in another
+  //process doesn't know the client yet, so the client repeats its request
+  //there (HEADER_FLAG_JOIN_BROKER) the way it does with a cached endpoint.
+  bool DlgServer::reply_placed(aService* service, DlgMessage *msg, uint32_t replyType)
+  {
+    std::string serviceName;
+    std::string identity;
+    msg->GetServiceName(serviceName);
+    msg->GetIdentity(identity);
+    aService::placement_t& placement = service->Placement();
+    if (!service->IsPlaced())
+      {
+	aWorker* worker = place_service(serviceName);
+	if (!worker || !create_placed_broker(serviceName, service, *worker))
+	  return false;
+      }
+    if (placement.broker.empty())
+      {
+	//replayed when the broker is there
+	placement.waiting.push_back(msg);
+	return true;
+      }
+
+    std::string from("DlgServer");
+    DlgMessage reply(serviceName, from, identity, replyType, placement.broker);
+    reply.SetIdentity(identity);
+    DlgHeader header;
+    reply.GetHeader(header);
+    header.epoch  = placement.epoch;
+    header.flags |= HEADER_FLAG_JOIN_BROKER;
+    reply.SetHeader(header);
+    if (!reply.Send(m_router))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::reply_placed: couldn't send a reply.\n");
+	return false;
+      }
+    delete msg;
+    return true;
+  }
+
+  bool DlgServer::worker_hello(DlgMessage *msg)
+  {
+    std::string identity;
+    if (!msg->GetIdentity(identity))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::worker_hello: Couldn't get identity.\n");
+	return false;
+      }
+    if (!find_worker(identity))
+      {
+	aWorker worker;
+	worker.identity = identity;
+	worker.load     = 0;
+	m_workers.push_back(worker);
+	for (int i = 0; i < WORKER_VIRTUAL_NODES; i++)
+	  {
+	    std::string point = identity + "#" + std::to_string(i);
+	    m_ring[key_view_t(point).Hash()] = m_workers.size() - 1;
+	  }
+	Print(DBG_LEVEL_INFO,"DlgServer: broker worker %s has joined.\n", identity.c_str());
+      }
+    delete msg;
+    return true;
+  }
+
+  bool DlgServer::worker_load(DlgMessage *msg)
+  {
+    std::string identity;
+    std::string body;
+    if (!msg->GetIdentity(identity) || !msg->GetMessageBody(body))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::worker_load: bad message received.\n");
+	return false;
+      }
+    aWorker* worker = find_worker(identity);
+    if (!worker)
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::worker_load: unknown worker %s.\n", identity.c_str());
+	return false;
+      }
+
+    uint64_t load = 0;
+    size_t begin = 0;
+    while (begin < body.size())
+      {
+	size_t end = body.find('\n', begin);
+	if (end == std::string::npos)
+	  end = body.size();
+	std::string line = body.substr(begin, end - begin);
+	begin = end + 1;
+
+	char name[256];
+	unsigned long long rate = 0;
+	unsigned long subscribers = 0;
+	if (sscanf(line.c_str(), "%255s %llu %lu", name, &rate, &subscribers) != 3)
+	  continue;
+	load += rate;
+	aService** service = m_services.Find(name);
+	if (service && (*service)->Placement().worker == identity)
+	  {
+	    (*service)->Placement().rate        = rate;
+	    (*service)->Placement().subscribers = subscribers;
+	  }
+      }
+    worker->load = load;
+    if (load > m_workerThreshold)
+      rebalance(*worker);
+    delete msg;
+    return true;
+  }
+
+  //Moves the hottest service of an overloaded worker to the least loaded
+  //one, if that makes the two closer. One move per load report.
+  void DlgServer::rebalance(aWorker& worker)
+  {
+    aWorker* target = nullptr;
+    for (size_t i = 0; i < m_workers.size(); i++)
+      if (&m_workers[i] != &worker && (!target || m_workers[i].load < target->load))
+	target = &m_workers[i];
+    if (!target)
+      return;
+
+    aService* hottest = nullptr;
+    std::string hottestName;
+    for (auto &v : m_services)
+      {
+	aService::placement_t& placement = v.second->Placement();
+	if (placement.worker != worker.identity || placement.broker.empty() || !placement.movingFrom.empty())
+	  continue;
+	if (target->load + placement.rate >= worker.load)
+	  continue;
+	if (!hottest || placement.rate > hottest->Placement().rate)
+	  {
+	    hottest     = v.second;
+	    hottestName = v.first;
+	  }
+      }
+    if (!hottest)
+      return;
+
+    Print(DBG_LEVEL_INFO,"DlgServer: %s has %llu msgs/sec, a service moves to %s.\n", worker.identity.c_str(),
+	  (unsigned long long)worker.load, target->identity.c_str());
+    //the old broker keeps the service if the target can't be asked
+    if (!create_placed_broker(hottestName, hottest, *target))
+      return;
+    hottest->Placement().movingFrom = worker.identity;
+    target->load += hottest->Placement().rate;
+    worker.load  -= hottest->Placement().rate;
+  }
+
+  bool DlgServer::broker_created(DlgMessage *msg)
+  {
+    std::string serviceName;
+    std::string endpoint;
+    uint64_t epoch = 0;
+    if (!msg->GetServiceName(serviceName) || !msg->GetMessageBody(endpoint) || !msg->GetEpoch(epoch))
+      {
+	Print(DBG_LEVEL_ERROR,"DlgServer::broker_created: bad message received.\n");
+	return false;
+      }
+    aService* service = *m_services.Find(serviceName);
+    aService::placement_t& placement = service->Placement();
+    if (epoch != placement.epoch)
+      {
+	Print(DBG_LEVEL_DEBUG,"DlgServer::broker_created: outdated broker of '%s'.\n", serviceName.c_str());
+	delete msg;
+	return true;
+      }
+    placement.broker = endpoint;
+
+    //the old broker sends its clients back here, they get the new endpoint
+    if (!placement.movingFrom.empty())
+      {
+	std::string from("DlgServer");
+	DlgMessage move(serviceName, from, placement.movingFrom, MOVE_BROKER, endpoint);
+	move.SetIdentity(placement.movingFrom);
+	if (!move.Send(m_router))
+	  Print(DBG_LEVEL_ERROR,"DlgServer::broker_created: couldn't move broker of '%s'.\n", serviceName.c_str());
+	placement.movingFrom.clear();
+      }
+
+    std::vector<DlgMessage*> waiting;
+    waiting.swap(placement.waiting);
+    for (size_t i = 0; i < waiting.size(); i++)
+      {
+	uint32_t msgType = 0;
+	waiting[i]->GetMessageType(msgType);
+	bool isOk = (msgType == SUBSCRIBE_TO_SERVICE) ? subscribe_to_service(waiting[i])
+						       : register_publisher(waiting[i]);
+	if (!isOk)
+	  delete waiting[i];
+      }
+    if (!m_peers.empty())
+      send_directories();
+    delete msg;
+    return true;
+  }
+
 } // namespace ZmqDialog
@@ -6,8 +6,21 @@
 namespace ZmqDialog {
 
 DlgSubscriber::DlgSubscriber(const std::string &name) : m_name(name), m_service(""), m_server(""),
-                            m_socket(nullptr), m_isRunning(false),
-                            m_thread(nullptr)
+                            m_socket(nullptr), m_directSocket(nullptr), m_isRunning(false),
+                            m_thread(nullptr), m_state(CLIENT_DISCONNECTED), m_isConnected(false),
+                            m_sendQueue(new mpmc_ring_t<DlgMessage*>(SUBSCRIBER_SEND_QUEUE)),
+                            m_isBrokerConnected(false),
+                            m_creditMessages(SUBSCRIBER_CREDIT_MESSAGES),
+                            m_creditBytes(SUBSCRIBER_CREDIT_BYTES),
+                            m_consumedMessages(0), m_consumedBytes(0),
+                            m_isCacheRequested(false), m_isCacheWaiting(false), m_cachedEpoch(0),
+                            m_dispatcher(nullptr),
+                            m_queueMode(QUEUE_LOCKED), m_queueOverflow(QUEUE_OVERFLOW_BLOCK),
+                            m_spsc(nullptr), m_mpmc(nullptr), m_waiters(0), m_isBlocked(false),
+                            m_hasHandler(false), m_hasNotify(false),
+                            m_queueHighWater(0), m_droppedMessages(0),
+                            m_hasLinks(false), m_isLinkRequested(false), m_isReconnectRequested(false),
+                            m_isFilterRequested(false), m_link(nullptr)
 {
   m_isRunning = true;
   m_thread = new std::thread(&DlgSubscriber::subscriber_thread, this);
@@ -15,8 +28,21 @@ DlgSubscriber::DlgSubscriber(const std::string &name) : m_name(name), m_service(
 
 DlgSubscriber::DlgSubscriber(const std::string &name,
                  const std::string &serviceName) : m_name(name), m_service(serviceName),
-                                   m_server(""), m_socket(nullptr),
-                                   m_isRunning(false), m_thread(nullptr)
+                                   m_server(""), m_socket(nullptr), m_directSocket(nullptr),
+                                   m_isRunning(false), m_thread(nullptr), m_state(CLIENT_DISCONNECTED), m_isConnected(false),
+                                   m_sendQueue(new mpmc_ring_t<DlgMessage*>(SUBSCRIBER_SEND_QUEUE)),
+                                   m_isBrokerConnected(false),
+                                   m_creditMessages(SUBSCRIBER_CREDIT_MESSAGES),
+                                   m_creditBytes(SUBSCRIBER_CREDIT_BYTES),
+                                   m_consumedMessages(0), m_consumedBytes(0),
+                                   m_isCacheRequested(false), m_isCacheWaiting(false), m_cachedEpoch(0),
+                            m_dispatcher(nullptr),
+                            m_queueMode(QUEUE_LOCKED), m_queueOverflow(QUEUE_OVERFLOW_BLOCK),
+                            m_spsc(nullptr), m_mpmc(nullptr), m_waiters(0), m_isBlocked(false),
+                            m_hasHandler(false), m_hasNotify(false),
+                            m_queueHighWater(0), m_droppedMessages(0),
+                            m_hasLinks(false), m_isLinkRequested(false), m_isReconnectRequested(false),
+                            m_isFilterRequested(false), m_link(nullptr)
 {
   m_isRunning = true;
   m_thread = new std::thread(&DlgSubscriber::subscriber_thread, this);
@@ -25,8 +51,21 @@ DlgSubscriber::DlgSubscriber(const std::string &name,
 DlgSubscriber::DlgSubscriber(const std::string &name,
                  const std::string &serviceName,
                  const std::string &serverName) : m_name(name), m_service(serviceName),
-                                  m_server(serverName), m_socket(nullptr),
-                                  m_isRunning(false), m_thread(nullptr)
+                                  m_server(serverName), m_socket(nullptr), m_directSocket(nullptr),
+                                  m_isRunning(false), m_thread(nullptr), m_state(CLIENT_DISCONNECTED), m_isConnected(false),
+                                  m_sendQueue(new mpmc_ring_t<DlgMessage*>(SUBSCRIBER_SEND_QUEUE)),
+                                  m_isBrokerConnected(false),
+                                  m_creditMessages(SUBSCRIBER_CREDIT_MESSAGES),
+                                  m_creditBytes(SUBSCRIBER_CREDIT_BYTES),
+                                  m_consumedMessages(0), m_consumedBytes(0),
+                                  m_isCacheRequested(false), m_isCacheWaiting(false), m_cachedEpoch(0),
+                            m_dispatcher(nullptr),
+                            m_queueMode(QUEUE_LOCKED), m_queueOverflow(QUEUE_OVERFLOW_BLOCK),
+                            m_spsc(nullptr), m_mpmc(nullptr), m_waiters(0), m_isBlocked(false),
+                            m_hasHandler(false), m_hasNotify(false),
+                            m_queueHighWater(0), m_droppedMessages(0),
+                            m_hasLinks(false), m_isLinkRequested(false), m_isReconnectRequested(false),
+                            m_isFilterRequested(false), m_link(nullptr)
 {
   m_isRunning = true;
   m_thread = new std::thread(&DlgSubscriber::subscriber_thread, this);
@@ -36,20 +75,43 @@ DlgSubscriber::DlgSubscriber(const std::string &name,
 
 DlgSubscriber::~DlgSubscriber()
 {
+  m_mutex.lock();
   m_isRunning = false;
+  m_mutex.unlock();
+  m_messageCondition.notify_all();
+  m_wakeup.Signal();
   if (m_thread && m_thread->joinable())
     m_thread->join();
   delete m_thread;
+  for (size_t i = 0; i < m_reconnectWaiters.size(); i++)
+    m_reconnectWaiters[i].set_value(false);
+  m_reconnectWaiters.clear();
 
-  //Deleting messages which weren't read
-  while(!m_messages.empty())
-    m_messages.pop();
+  RemoveHandler();
+  close_direct();
+  for (size_t i = 0; i < m_links.Size(); i++)
+    close_link(m_links.At(i).second);
+  m_links.Clear();
+
+  //Deleting messages which weren't read or sent
+  DlgMessage *msg = nullptr;
+  while(pop_queued(msg))
+    delete msg;
+  for (size_t i = 0; i < m_blocked.size(); i++)
+    delete m_blocked[i].first;
+  delete m_spsc;
+  delete m_mpmc;
+  while(m_sendQueue->TryPop(msg))
+    delete msg;
+  delete m_sendQueue;
 
   close_connection();
 }
 
 bool DlgSubscriber::SetServerName(const std::string &serverName)
 {
+    //the thread writes m_server when it connects
+    std::lock_guard<std::mutex> lock(m_mutex);
     if (m_server != "")
     {
         Print(DBG_LEVEL_ERROR,
@@ -82,6 +144,7 @@ bool DlgSubscriber::Connect()
 {
   if (IsConnected())
   {
+      std::lock_guard<std::mutex> lock(m_mutex);
       Print(DBG_LEVEL_ERROR,
             "DlgSubscriber::Connect(): "
             "Subscriber %s already has active connection with %s.\n"
@@ -89,34 +152,100 @@ bool DlgSubscriber::Connect()
             m_name.c_str(), m_server.c_str());
       return false;
   }
-  if (m_server == "")
-    {
-      Print(DBG_LEVEL_ERROR,
-      "DlgSubscriber::Connect(): Subscriber %s has no server to connect.\n", m_name.c_str());
-      return false;
-    }
-  //Connect to serve
-  return connect_to(m_server.c_str());
+  //the thread connects to m_server, or reports that there is none
+  return post_reconnect("", "");
 }
 
 bool DlgSubscriber::Connect(const std::string &serverName)
 {
-  m_server = serverName;
-  return connect_to(m_server.c_str());
+  return ReConnect(serverName);
 }
 
 bool DlgSubscriber::Connect(const char *serverName)
 {
-    m_server = std::string(serverName);
-    return connect_to(m_server.c_str());
+  return ReConnect(std::string(serverName));
 }
 
+//The thread owns m_socket: connected or not, it connects itself
 bool DlgSubscriber::ReConnect(const std::string &serverName)
 {
-    if (IsConnected())
-        close_connection();
-    m_server = serverName;
-    return Connect();
+  return post_reconnect(serverName, "");
+}
+
+//An empty server is the current one. Waits for the thread's result, but
+//from the thread itself (a reply handler) it only posts the request.
+bool DlgSubscriber::post_reconnect(const std::string &server, const std::string &service)
+{
+  if (!m_isRunning)
+    return false;
+  bool isThread = (std::this_thread::get_id() == m_thread->get_id());
+  std::future<bool> result;
+  m_mutex.lock();
+  m_reconnectServer  = server;
+  m_reconnectService = service;
+  if (!isThread)
+    {
+      m_reconnectWaiters.push_back(std::promise<bool>());
+      result = m_reconnectWaiters.back().get_future();
+    }
+  m_mutex.unlock();
+  m_isReconnectRequested = true;
+  m_wakeup.Signal();
+  return isThread || result.get();
+}
+
+//subscriber_thread only. Replies queued before the request go to the old
+//broker, a new service is subscribed the way Subscribe() does it. A failed
+//connect leaves the subscriber CLIENT_DISCONNECTED.
+void DlgSubscriber::reconnect()
+{
+  m_mutex.lock();
+  std::string server  = m_reconnectServer;
+  std::string service = m_reconnectService;
+  std::vector<std::promise<bool> > waiters;
+  waiters.swap(m_reconnectWaiters);
+  m_mutex.unlock();
+
+  m_isCacheWaiting = false;
+  if (!service.empty())
+    close_direct();
+  if (!server.empty())
+    {
+      m_mutex.lock();
+      m_server = server;
+      m_mutex.unlock();
+    }
+
+  bool isDone = false;
+  if (m_server.empty())
+    Print(DBG_LEVEL_ERROR, "DlgSubscriber::reconnect(): Subscriber %s has no server to connect.\n",
+          m_name.c_str());
+  else if (!connect_to(m_server.c_str()))
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::reconnect(): Subscriber %s couldn't connect to %s.\n",
+            m_name.c_str(), m_server.c_str());
+    }
+  else if (service.empty())
+    isDone = true;
+  else
+    {
+      m_service = service;
+      std::string endpoint;
+      uint64_t epoch = 0;
+      if (ServiceCache::Find(m_service, endpoint, epoch))
+        {
+          m_mutex.lock();
+          m_cachedEndpoint = endpoint;
+          m_cachedEpoch    = epoch;
+          m_mutex.unlock();
+          subscribe_cached();
+          isDone = true;
+        }
+      else
+        isDone = send_subscribe(0);
+    }
+  for (size_t i = 0; i < waiters.size(); i++)
+    waiters[i].set_value(isDone);
 }
 
 bool DlgSubscriber::Subscribe()
@@ -133,8 +262,36 @@ bool DlgSubscriber::Subscribe()
       return false;
     }
 
+  //the thread owns the socket, it connects to the cached broker itself
+  std::string endpoint;
+  uint64_t epoch = 0;
+  if (ServiceCache::Find(m_service, endpoint, epoch))
+    {
+      m_mutex.lock();
+      m_cachedEndpoint = endpoint;
+      m_cachedEpoch    = epoch;
+      m_mutex.unlock();
+      m_isCacheRequested = true;
+      m_wakeup.Signal();
+      return true;
+    }
+  //the thread sends it
+  return post_message(subscribe_message(0));
+}
+
+//Epoch 0 goes to the server, anything else to the cached broker
+DlgMessage* DlgSubscriber::subscribe_message(uint64_t epoch)
+{
   DlgMessage *msg = new DlgMessage(m_service, m_name, m_server, SUBSCRIBE_TO_SERVICE, std::string(""));
   msg->SetIdentity(m_name);
+  msg->SetEpoch(epoch);
+  return msg;
+}
+
+//subscriber_thread only
+bool DlgSubscriber::send_subscribe(uint64_t epoch)
+{
+  DlgMessage *msg = subscribe_message(epoch);
   if (!msg->Send(m_socket))
     {
       delete msg;
@@ -148,6 +305,31 @@ bool DlgSubscriber::Subscribe()
   return true;
 }
 
+void DlgSubscriber::subscribe_cached()
+{
+  m_mutex.lock();
+  std::string endpoint = m_cachedEndpoint;
+  uint64_t    epoch    = m_cachedEpoch;
+  m_mutex.unlock();
+  Print(DBG_LEVEL_DEBUG, "DlgSubscriber: %s tries cached broker '%s' of %s.\n",
+        m_name.c_str(), endpoint.c_str(), m_service.c_str());
+  m_isCacheWaiting = true;
+  m_cacheDeadline  = std::chrono::steady_clock::now() + std::chrono::microseconds(DIRECTORY_CACHE_TIMEOUT);
+  if (!connect_to(endpoint.c_str()) || !send_subscribe(epoch))
+    fallback_to_server();
+}
+
+//The cached broker is gone, moved or doesn't answer: ask the server
+void DlgSubscriber::fallback_to_server()
+{
+  Print(DBG_LEVEL_DEBUG, "DlgSubscriber: %s falls back to server %s.\n", m_name.c_str(), m_server.c_str());
+  ServiceCache::Invalidate(m_service, m_cachedEpoch);
+  m_isCacheWaiting = false;
+  if (!connect_to(m_server.c_str()))
+    return;
+  send_subscribe(0);
+}
+
 bool DlgSubscriber::Subscribe(const std::string &serviceName)
 {
   m_service = serviceName;
@@ -160,133 +342,794 @@ bool DlgSubscriber::Subscribe(const char* serviceName)
     return Subscribe();
 }
 
-bool DlgSubscriber::ReSubscribe(const std::string &serviceName)
+bool DlgSubscriber::SubscribeDirect()
 {
-  if (IsConnected())
-    close_connection();
+  if (!IsConnected())
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::SubscribeDirect(): Subscriber %s is not connected at any socket.\n", m_name.c_str());
+      return false;
+    }
 
-  m_service = serviceName;
+  if (m_service == "")
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::SubscribeDirect(): Subscriber %s has no any services to subscribe.\n", m_name.c_str());
+      return false;
+    }
 
-  if (!Connect(server_address))
-  {
+  DlgMessage *msg = new DlgMessage(m_service, m_name, m_server, SUBSCRIBE_DIRECT, std::string(""));
+  msg->SetIdentity(m_name);
+  if (!post_message(msg))
+    {
       Print(DBG_LEVEL_ERROR,
-            "DlgSubscriber::ReSubscribe(): "
-            "Couldn't connect to new server %s.\n", server_address);
+            "DlgSubscriber::SubscribeDirect(): Subscriber %s couldn't send "
+            "a request to subscribe at service %s.\n",
+            m_name.c_str(), m_service.c_str());
       return false;
-  }
+    }
+  return true;
+}
 
-  return Subscribe();
+bool DlgSubscriber::SubscribeDirect(const std::string &serviceName)
+{
+  m_service = serviceName;
+  return SubscribeDirect();
+}
+
+bool DlgSubscriber::ReSubscribe(const std::string &serviceName)
+{
+  if (serviceName.empty())
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::ReSubscribe(): Subscriber %s has no any services to subscribe.\n", m_name.c_str());
+      return false;
+    }
+  //the thread closes its sockets and subscribes itself at the current server
+  return post_reconnect("", serviceName);
+}
+
+bool DlgSubscriber::HasData()
+{
+  if (m_queueMode != QUEUE_LOCKED)
+    return !queue_empty();
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return !queue_empty();
+}
+
+bool DlgSubscriber::WaitMessage(uint32_t timeout)
+{
+  //the receiving thread signals only if somebody waits; the fence pairs
+  //with the one of push_message(), so one of the two sees the other
+  m_waiters++;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  std::unique_lock<std::mutex> lock(m_mutex);
+  bool hasData = m_messageCondition.wait_for(lock, std::chrono::microseconds(timeout),
+                                             [this] { return !queue_empty() || !m_isRunning; })
+                 && !queue_empty();
+  m_waiters--;
+  return hasData;
+}
+
+size_t DlgSubscriber::ExtractMessages(std::vector<DlgMessage*> &out, size_t max)
+{
+  size_t count = 0;
+  uint32_t bytes = 0;
+  DlgMessage *msg = nullptr;
+  bool isLocked = (m_queueMode == QUEUE_LOCKED);
+  if (isLocked)
+    m_mutex.lock();
+  for (; count < max && pop_queued(msg); count++)
+    {
+      out.push_back(msg);
+      bytes += (uint32_t)msg->GetSize();
+    }
+  if (isLocked)
+    m_mutex.unlock();
+  if (count)
+    wake_blocked();
+  for (size_t i = out.size() - count; i < out.size(); i++)
+    stamp_dequeued(out[i]);
+  if (m_hasLinks)
+    {
+      for (size_t i = out.size() - count; i < out.size(); i++)
+        count_consumed(out[i]);
+      return count;
+    }
+  m_consumedMessages += (uint32_t)count;
+  m_consumedBytes += bytes;
+  return count;
 }
 
 bool DlgSubscriber::ExtractMessage(DlgMessage *& msg)
 {
-  if (m_messages.empty())
+  if (!TryExtractMessage(msg))
     {
      Print(DBG_LEVEL_ERROR, "DlgSubscriber::GetMessage(): there are no any messages in queue.\n");
      return false;
     }
+  return true;
+}
 
+bool DlgSubscriber::TryExtractMessage(DlgMessage *& msg)
+{
+  bool isExtracted = false;
+  if (m_queueMode == QUEUE_LOCKED)
+    {
+      m_mutex.lock();
+      isExtracted = pop_queued(msg);
+      m_mutex.unlock();
+    }
+  else
+    isExtracted = pop_queued(msg);
+  if (!isExtracted)
+    return false;
+  wake_blocked();
+  stamp_dequeued(msg);
+  //returned to the broker as new credit by subscriber_thread
+  count_consumed(msg);
+  return true;
+}
+
+bool DlgSubscriber::Reply(DlgMessage *request, DlgMessage *reply)
+{
+  std::string requester;
+  uint64_t correlation = 0;
+  if (!request->GetFromAddress(requester) || !request->GetCorrelation(correlation))
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::Reply(): bad request, no requester.\n");
+      return false;
+    }
+  //a request of an AddService() service goes back over its link
+  std::string service;
+  if (!request->GetServiceName(service) || service.empty())
+    service = m_service;
+  if (!reply->SetIdentity(m_name) || !reply->SetServiceName(service) ||
+      !reply->SetFromAddress(m_name) || !reply->SetToAddress(requester) ||
+      !reply->SetMessageType(REPLY_MESSAGE) || !reply->SetCorrelation(correlation))
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::Reply(): Couldn't prepare reply of '%s'.\n", m_name.c_str());
+      return false;
+    }
+  return post_message(new DlgMessage(*reply));
+}
+
+//Takes ownership of msg. A full queue means the thread is behind, the
+//caller waits for it rather than lose the message.
+bool DlgSubscriber::post_message(DlgMessage *msg)
+{
+  while (!m_sendQueue->TryPush(msg))
+    {
+      if (!m_isRunning)
+        {
+          delete msg;
+          return false;
+        }
+      m_wakeup.Signal();
+      std::this_thread::yield();
+    }
+  m_wakeup.Notify();
+  return true;
+}
+
+//subscriber_thread only: requests to the server or broker go over m_socket
+//as they are; a reply of an AddService() service goes over its link, any
+//other reply over m_socket
+void DlgSubscriber::drain_queue()
+{
+  DlgMessage *msg = nullptr;
+  for (int n = 0; n < SUBSCRIBER_SEND_QUEUE && m_sendQueue->TryPop(msg); ++n)
+    {
+      //posted after ReConnect(), it goes to the new peer
+      if (m_isReconnectRequested.exchange(false))
+        reconnect();
+
+      std::string service;
+      uint32_t msgType = 0;
+      msg->GetServiceName(service);
+      msg->GetMessageType(msgType);
+      bool isSent = false;
+      if (msgType != REPLY_MESSAGE)
+        isSent = msg->Send(m_socket);
+      else if (service != m_service)
+        {
+          link_t **link = m_links.Find(service);
+          isSent = link && (*link)->isBrokerConnected && msg->SetIdentity((*link)->identity) &&
+                   msg->Send((*link)->socket);
+        }
+      else
+        isSent = m_isBrokerConnected && msg->SetIdentity(m_name) && msg->Send(m_socket);
+      if (!isSent)
+        {
+          std::string to;
+          msg->GetToAddress(to);
+          Print(DBG_LEVEL_ERROR, "DlgSubscriber::drain_queue(): Couldn't send message to '%s'.\n", to.c_str());
+        }
+      delete msg;
+    }
+}
+
+bool DlgSubscriber::SetCreditWindow(uint32_t messages, uint32_t bytes)
+{
+  if (messages == 0)
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::SetCreditWindow(): window must be at least one message.\n");
+      return false;
+    }
+  if (m_isBrokerConnected)
+    {
+      Print(DBG_LEVEL_ERROR,
+            "DlgSubscriber::SetCreditWindow(): "
+            "Subscriber %s is already connected to a broker.\n", m_name.c_str());
+      return false;
+    }
+  m_creditMessages = messages;
+  m_creditBytes    = bytes;
+  return true;
+}
+
+void DlgSubscriber::SetDequeuePolicy(DequeuePolicy policy)
+{
   m_mutex.lock();
-  msg = m_messages.front();
-  m_messages.pop();
+  m_messages.SetPolicy(policy);
   m_mutex.unlock();
+}
+
+bool DlgSubscriber::SetQueue(QueueMode mode, size_t capacity, QueueOverflow overflow)
+{
+  if (IsConnected())
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::SetQueue(): Subscriber %s is already connected.\n", m_name.c_str());
+      return false;
+    }
+  if (mode != QUEUE_LOCKED && capacity == 0)
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::SetQueue(): ring capacity must be positive.\n");
+      return false;
+    }
+  //the oldest message would be taken by the producer, a second consumer
+  if (mode == QUEUE_SPSC && overflow == QUEUE_OVERFLOW_DROP_OLDEST)
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::SetQueue(): QUEUE_SPSC cannot drop the oldest message.\n");
+      return false;
+    }
+  if (mode != QUEUE_LOCKED && capacity < m_creditMessages)
+    Print(DBG_LEVEL_DEBUG, "DlgSubscriber::SetQueue(): capacity %lu is below credit window %u, rings may overflow.\n",
+          (unsigned long)capacity, m_creditMessages);
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  delete m_spsc;
+  delete m_mpmc;
+  m_spsc = (mode == QUEUE_SPSC) ? new spsc_lanes_t(capacity) : nullptr;
+  m_mpmc = (mode == QUEUE_MPMC) ? new mpmc_lanes_t(capacity) : nullptr;
+  m_queueMode     = mode;
+  m_queueOverflow = overflow;
   return true;
 }
 
-void DlgSubscriber::subscriber_thread()
+size_t DlgSubscriber::GetQueueSize()
 {
-  Print(DBG_LEVEL_DEBUG, "Start of %s subscriber thread.\n", m_name.c_str());
-  while(m_isRunning)
-  {
-      if (!IsConnected())
-        continue;
+  if (m_queueMode != QUEUE_LOCKED)
+    return ring_size();
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_messages.Size();
+}
+
+bool DlgSubscriber::pop_queued(DlgMessage *&msg)
+{
+  if (m_spsc)
+    return m_spsc->TryPop(msg);
+  if (m_mpmc)
+    return m_mpmc->TryPop(msg);
+  return m_messages.Pop(msg);
+}
+
+bool DlgSubscriber::queue_empty()
+{
+  if (m_spsc)
+    return m_spsc->Empty();
+  if (m_mpmc)
+    return m_mpmc->Empty();
+  return m_messages.Empty();
+}
 
-      zmq::pollitem_t items[] = {
-        { static_cast<void*>(*m_socket), 0, ZMQ_POLLIN, 0 }
-      };
+void DlgSubscriber::SetNotify(const std::function<void()> &notify)
+{
+  m_mutex.lock();
+  m_notify.reset(notify ? new std::function<void()>(notify) : nullptr);
+  m_hasNotify = (bool)notify;
+  m_mutex.unlock();
+}
 
-      zmq::poll(items, 1, (long)TIMEOUT_INTERVAL/1000);
+bool DlgSubscriber::SetHandler(DlgDispatcher &dispatcher, const message_handler_t &handler)
+{
+  if (!handler)
+    return false;
+  message_handler_t single = handler;
+  return SetBatchHandler(dispatcher, [single](std::vector<DlgMessage*> &messages)
+                         {
+                           for (size_t i = 0; i < messages.size(); i++)
+                             single(messages[i]);
+                         }, DISPATCH_MAX_BATCH);
+}
 
-      if (items[0].revents & ZMQ_POLLIN)
+bool DlgSubscriber::SetBatchHandler(DlgDispatcher &dispatcher, const DlgDispatcher::batch_handler_t &handler,
+                                    size_t maxBatch)
+{
+  if (!handler)
+    return false;
+  RemoveHandler();
+
+  //messages waiting in the strand are still held against the credit window
+  DlgSubscriber *self = this;
+  DlgDispatcher::batch_handler_t batchHandler = handler;
+  std::shared_ptr<DlgDispatcher::strand_t> strand =
+    dispatcher.Attach([self, batchHandler](std::vector<DlgMessage*> &messages)
+                      {
+                        for (size_t i = 0; i < messages.size(); i++)
+                          {
+                            self->stamp_dequeued(messages[i]);
+                            self->count_consumed(messages[i]);
+                          }
+                        batchHandler(messages);
+                      }, maxBatch);
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  DlgMessage *msg = nullptr;
+  while (pop_queued(msg))
+    dispatcher.Post(strand, msg);
+  m_dispatcher = &dispatcher;
+  m_strand     = strand;
+  m_hasHandler = true;
+  //blocked messages go to the handler now
+  if (m_isBlocked)
+    m_wakeup.Signal();
+  return true;
+}
+
+void DlgSubscriber::RemoveHandler()
+{
+  m_mutex.lock();
+  DlgDispatcher *dispatcher = m_dispatcher;
+  std::shared_ptr<DlgDispatcher::strand_t> strand = m_strand;
+  m_dispatcher = nullptr;
+  m_strand.reset();
+  m_hasHandler = false;
+  m_mutex.unlock();
+  if (dispatcher)
+    dispatcher->Detach(strand);
+}
+
+void DlgSubscriber::push_message(DlgMessage *msg)
+{
+  m_receivedMessages.Add();
+  m_receivedBytes.Add(msg->GetSize());
+  uint32_t priority = PRIORITY_NORMAL;
+  msg->GetPriority(priority);
+  //blocked messages go first
+  if (m_hasHandler && m_blocked.empty() && dispatch_message(msg))
+    return;
+  if (!enqueue(msg, priority))
+    return;
+  notify_consumers();
+}
+
+//A message is queued: consumers in WaitMessage() and the notify hook hear of it
+void DlgSubscriber::notify_consumers()
+{
+  //a ring push is a release store only, the check of m_waiters mustn't
+  //move ahead of it (see WaitMessage)
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (m_waiters > 0)
     {
-      DlgMessage *msg = new DlgMessage();
-      if (!msg->Recv(m_socket))
+      //a consumer between its check and its wait gets the signal too
+      m_mutex.lock();
+      m_mutex.unlock();
+      m_messageCondition.notify_one();
+    }
+  if (m_hasNotify)
+    {
+      m_mutex.lock();
+      std::shared_ptr<std::function<void()> > notify = m_notify;
+      m_mutex.unlock();
+      if (notify)
+        (*notify)();
+    }
+}
+
+void DlgSubscriber::GetStats(client_stats_t &stats)
+{
+  stats.messages       = m_receivedMessages.Get();
+  stats.bytes          = m_receivedBytes.Get();
+  stats.batches        = 0;
+  stats.errors         = 0;
+  stats.dropped        = m_droppedMessages;
+  stats.queueWaits     = 0;
+  stats.queued         = GetQueueSize();
+  stats.queueHighWater = m_queueHighWater;
+}
+
+//No queue hop, the order of arrival is kept
+bool DlgSubscriber::dispatch_message(DlgMessage *msg)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  if (!m_dispatcher)
+    return false;
+  DlgDispatcher *dispatcher = m_dispatcher;
+  std::shared_ptr<DlgDispatcher::strand_t> strand = m_strand;
+  //what got into a ring while the handler was being set goes first
+  DlgMessage *queued = nullptr;
+  while (pop_queued(queued))
+    dispatcher->Post(strand, queued);
+  lock.unlock();
+  dispatcher->Post(strand, msg);
+  return true;
+}
+
+//subscriber_thread only: moves blocked messages to the ring (or to the
+//handler) as consumers make room, returns true when none is left
+bool DlgSubscriber::push_blocked()
+{
+  size_t pushed = 0;
+  while (!m_blocked.empty())
+    {
+      DlgMessage *msg   = m_blocked.front().first;
+      uint32_t priority = m_blocked.front().second;
+      if (!(m_hasHandler && dispatch_message(msg)) &&
+          !(m_spsc ? m_spsc->TryPush(msg, priority) : m_mpmc->TryPush(msg, priority)))
+        break;
+      m_blocked.pop_front();
+      pushed++;
+    }
+  if (m_blocked.empty())
+    m_isBlocked = false;
+  if (pushed)
+    {
+      size_t size = ring_size();
+      if (size > m_queueHighWater)
+        m_queueHighWater = size;
+      notify_consumers();
+    }
+  return m_blocked.empty();
+}
+
+//A consumer has made room in the ring. The fence pairs with the one of
+//wakeup_t::Sleep(), which the thread calls before its last push_blocked().
+void DlgSubscriber::wake_blocked()
+{
+  if (m_queueMode == QUEUE_LOCKED || m_queueOverflow != QUEUE_OVERFLOW_BLOCK)
+    return;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (m_isBlocked)
+    m_wakeup.Notify();
+}
+
+//Returns false if the message isn't queued: dropped, or blocked until a
+//consumer makes room (QUEUE_OVERFLOW_BLOCK)
+bool DlgSubscriber::enqueue(DlgMessage *msg, uint32_t priority)
+{
+  size_t size = 0;
+  if (m_queueMode == QUEUE_LOCKED)
+    {
+      m_mutex.lock();
+      m_messages.Push(msg, priority);
+      size = m_messages.Size();
+      m_mutex.unlock();
+    }
+  else
+    {
+      while (!m_blocked.empty() ||
+             !(m_spsc ? m_spsc->TryPush(msg, priority) : m_mpmc->TryPush(msg, priority)))
         {
-          Print(DBG_LEVEL_ERROR,"DlgSubscriber::subscriber_thread(): message receiving error.\n");
-          delete msg;
-          continue;
+          DlgMessage *dropped = nullptr;
+          if (m_queueOverflow == QUEUE_OVERFLOW_BLOCK)
+            {
+              //behind the others, the thread stops reading until
+              //consumers make room (see subscriber_thread)
+              m_blocked.push_back(std::make_pair(msg, priority));
+              m_isBlocked = true;
+              return false;
+            }
+          if (m_queueOverflow == QUEUE_OVERFLOW_DROP_NEWEST)
+            std::swap(dropped, msg);
+          else
+            m_mpmc->TryPop(dropped, priority);
+          if (!dropped)
+            continue;
+          //a dropped message is consumed as far as the broker's credit goes
+          count_consumed(dropped);
+          if (++m_droppedMessages == 1 || m_droppedMessages % 1000 == 0)
+            Print(DBG_LEVEL_ERROR, "DlgSubscriber %s: %lu message(s) dropped, the queue is full.\n",
+                  m_name.c_str(), (unsigned long)m_droppedMessages);
+          delete dropped;
+          if (!msg)
+            return false;
         }
+      size = ring_size();
+    }
+  //only this thread raises it
+  if (size > m_queueHighWater)
+    m_queueHighWater = size;
+  return true;
+}
 
-      uint32_t msgType = 0;
-      if (!msg->GetMessageType(msgType))
+//CLIENT_HANDSHAKE lasts from Connect() to the broker's (or the server's
+//direct publishers) answer
+ClientState DlgSubscriber::next_state()
+{
+  if (!m_isRunning)
+    return CLIENT_DRAINING;
+  if (!m_socket)
+    return CLIENT_DISCONNECTED;
+  if ((m_isBrokerConnected || m_directSocket) && !m_isCacheWaiting)
+    return CLIENT_CONNECTED;
+  return CLIENT_HANDSHAKE;
+}
+
+//Credit which hasn't gone back to a broker yet
+bool DlgSubscriber::has_consumed()
+{
+  if (m_isBrokerConnected && m_consumedMessages != 0)
+    return true;
+  for (size_t i = 0; i < m_links.Size(); i++)
+    if (m_links.At(i).second->isBrokerConnected && m_links.At(i).second->consumedMessages != 0)
+      return true;
+  return false;
+}
+
+void DlgSubscriber::subscriber_thread()
+{
+  Print(DBG_LEVEL_DEBUG, "Start of %s subscriber thread.\n", m_name.c_str());
+  Affinity::Apply(THREAD_CLIENT, m_name);
+  while(true)
+  {
+      if (m_isRunning && m_isReconnectRequested.exchange(false))
+        reconnect();
+
+      ClientState state = next_state();
+      if (state != m_state.exchange(state))
+        Print(DBG_LEVEL_DEBUG, "Subscriber %s is %s.\n", m_name.c_str(), ClientStateName(state));
+      if (state == CLIENT_DRAINING)
+        break;
+
+      //sleeps until Connect() or the destructor
+      if (state == CLIENT_DISCONNECTED)
         {
-          Print(DBG_LEVEL_ERROR,"DlgSubscriber::subscriber_thread(): bad message received(cannot get message type).\n");
-          delete msg;
+          zmq::pollitem_t wake = { nullptr, m_wakeup.Fd(), ZMQ_POLLIN, 0 };
+          m_wakeup.Sleep();
+          if (m_socket || !m_isRunning || m_isReconnectRequested)
+            wake.revents = 0;
+          else
+            zmq::poll(&wake, 1, -1);
+          m_wakeup.Awake(wake.revents & ZMQ_POLLIN);
           continue;
         }
-      //reply from server
-      if (msgType == SUBSCRIBE_TO_SERVICE && !subscribe_to_service(msg))
+
+      if (m_isCacheRequested.exchange(false))
+        subscribe_cached();
+
+      if (m_isLinkRequested.exchange(false))
+        update_links();
+
+      drain_queue();
+
+      //before that subscribe_to_service() sends it
+      if (m_isBrokerConnected && m_isFilterRequested.exchange(false))
+        send_key_filter();
+
+      //the wakeup, m_socket, the PUB socket of the brokerless mode, then the links
+      zmq::pollitem_t item = { nullptr, m_wakeup.Fd(), ZMQ_POLLIN, 0 };
+      m_pollItems.assign(1, item);
+      item.fd = 0;
+      item.socket = static_cast<void*>(*m_socket);
+      m_pollItems.push_back(item);
+      if (m_directSocket)
         {
-          Print(DBG_LEVEL_ERROR,"DlgSubscriber::subscriber_thread(): Couldn't add a new service.\n");
-          delete msg;
-          continue;
+          item.socket = static_cast<void*>(*m_directSocket);
+          m_pollItems.push_back(item);
         }
-      //PUBLISH_TEXT_MESSAGE
-      if (msgType == PUBLISH_TEXT_MESSAGE && !publish_text_message(msg))
+      size_t firstLink = m_pollItems.size();
+      m_pollLinks.clear();
+      for (size_t i = 0; i < m_links.Size(); i++)
         {
-          Print(DBG_LEVEL_ERROR,"DlgSubscriber::subscriber_thread(): Couldn't publish text message.\n");
-          delete msg;
-          continue;
+          if (!m_links.At(i).second->socket)
+            continue;
+          item.socket = static_cast<void*>(*m_links.At(i).second->socket);
+          m_pollItems.push_back(item);
+          m_pollLinks.push_back(m_links.At(i).second);
         }
 
-      //PUBLISH_BINARY_MESSAGE
-      if (msgType == PUBLISH_BINARY_MESSAGE && !publish_binary_message(msg))
+      //without consumed credit or a cached broker to wait for, nothing is due
+      m_wakeup.Sleep();
+      //a full ring: the sockets wait (the broker holds the rest under our
+      //credit) and the pop of a consumer wakes the thread, see wake_blocked()
+      if (m_isBlocked && !push_blocked())
+        for (size_t i = 1; i < m_pollItems.size(); i++)
+          m_pollItems[i].events = 0;
+      long timeout = -1;
+      if (has_consumed())
+        timeout = (long)FLOW_CONTROL_INTERVAL/1000;
+      if (m_isCacheWaiting && (timeout < 0 || timeout > (long)DIRECTORY_CACHE_TIMEOUT/1000))
+        timeout = (long)DIRECTORY_CACHE_TIMEOUT/1000;
+      if (m_isCacheRequested || m_isLinkRequested || m_isReconnectRequested || !m_isRunning ||
+          !m_sendQueue->Empty() || (m_isBrokerConnected && m_isFilterRequested))
+        timeout = 0;
+      int nEvents = zmq::poll(&m_pollItems[0], m_pollItems.size(), timeout);
+      m_wakeup.Awake(m_pollItems[0].revents & ZMQ_POLLIN);
+      //consumed credit goes back in portions or when nothing else happens
+      bool isIdle = (nEvents == 0);
+
+      if (m_isCacheWaiting && !(m_pollItems[1].revents & ZMQ_POLLIN) &&
+          std::chrono::steady_clock::now() >= m_cacheDeadline)
+        fallback_to_server();
+
+      if (m_isBrokerConnected)
+        return_credit(isIdle);
+
+      //receive_message() may open the direct socket, which isn't polled yet
+      bool hasDirectInput = (firstLink == 3 && (m_pollItems[2].revents & ZMQ_POLLIN));
+      if (m_pollItems[1].revents & ZMQ_POLLIN)
+        receive_message(m_socket);
+      if (hasDirectInput && m_directSocket)
+        receive_message(m_directSocket);
+      for (size_t i = 0; i < m_pollLinks.size(); i++)
         {
-          Print(DBG_LEVEL_ERROR,"DlgSubscriber::subscriber_thread(): Couldn't publish binary message.\n");
-          delete msg;
-          continue;
+          bool hasInput = (m_pollItems[firstLink + i].revents & ZMQ_POLLIN);
+          if (m_pollLinks[i]->isBrokerConnected)
+            link_return_credit(m_pollLinks[i], isIdle);
+          if (hasInput)
+            receive_link(m_pollLinks[i]);
         }
-    }
   }//End of m_isRunning cycle
   Print(DBG_LEVEL_DEBUG, "End of %s subscriber's thread.\n", m_name.c_str());
 }
 
+void DlgSubscriber::receive_message(zmq::socket_t *socket)
+{
+  DlgMessage *msg = new DlgMessage();
+  if (!msg->Recv(socket))
+    {
+      Print(DBG_LEVEL_ERROR,"DlgSubscriber::subscriber_thread(): message receiving error.\n");
+      delete msg;
+      return;
+    }
+
+  uint32_t msgType = 0;
+  if (!msg->GetMessageType(msgType))
+    {
+      Print(DBG_LEVEL_ERROR,"DlgSubscriber::subscriber_thread(): bad message received(cannot get message type).\n");
+      delete msg;
+      return;
+    }
+  handlers().Dispatch(this, msgType, msg, "DlgSubscriber::subscriber_thread()");
+}
+
+//Handlers of messages from the server, the broker and direct publishers
+const message_registry_t<DlgSubscriber>& DlgSubscriber::handlers()
+{
+  static const message_registry_t<DlgSubscriber> registry = []()
+    {
+      message_registry_t<DlgSubscriber> r;
+      //reply from server
+      r.Register(SUBSCRIBE_TO_SERVICE,   &DlgSubscriber::subscribe_to_service, "add a new service");
+      //reply from a cached broker which doesn't serve us anymore
+      r.Register(STALE_EPOCH,            &DlgSubscriber::stale_epoch,       "fall back to server");
+      //the service has another broker now, ask the server
+      r.Register(BROKER_MOVED,           &DlgSubscriber::broker_moved,      "follow the moved broker");
+      //reply from server, the broker fans out through XPUB
+      r.Register(SUBSCRIBE_TO_XPUB,      &DlgSubscriber::subscribe_to_xpub, "connect to XPUB broker");
+      //reply or update from server
+      r.Register(DIRECT_PUBLISHERS,      &DlgSubscriber::direct_publishers, "connect to direct publishers");
+      r.Register(PUBLISH_TEXT_MESSAGE,   &DlgSubscriber::publish_text_message, "publish text message");
+      r.Register(PUBLISH_BINARY_MESSAGE, &DlgSubscriber::publish_binary_message, "publish binary message");
+      //the broker chose us to answer it
+      r.Register(REQUEST_MESSAGE,        &DlgSubscriber::request_message,   "queue request");
+      //only direct publishers send batches to subscribers
+      r.Register(PUBLISH_BATCH_MESSAGE,  &DlgSubscriber::publish_batch_message, "publish batch message");
+      return r;
+    }();
+  return registry;
+}
+
+bool DlgSubscriber::grant_credit(uint32_t messages, uint32_t bytes)
+{
+  DlgCredit credit = { messages, bytes };
+  DlgMessage msg(m_service, m_name, std::string(""), GRANT_CREDIT, std::string(""));
+  if (!msg.SetMessageBuffer(&credit, sizeof(credit)) || !msg.Send(m_socket))
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::grant_credit(): Subscriber %s couldn't grant credit.\n", m_name.c_str());
+      return false;
+    }
+  return true;
+}
+
+bool DlgSubscriber::SetKeyFilter(const std::string &prefix)
+{
+  m_mutex.lock();
+  m_keyFilter = prefix;
+  m_mutex.unlock();
+  m_isFilterRequested = true;
+  m_wakeup.Signal();
+  return true;
+}
+
+bool DlgSubscriber::send_key_filter()
+{
+  m_mutex.lock();
+  std::string prefix = m_keyFilter;
+  m_mutex.unlock();
+  DlgMessage msg(m_service, m_name, std::string(""), SET_KEY_FILTER, prefix);
+  if (!msg.Send(m_socket))
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::send_key_filter(): Subscriber %s couldn't set key filter.\n", m_name.c_str());
+      return false;
+    }
+  return true;
+}
+
+//Returns consumed messages to the broker in portions of a half window,
+//or everything consumed so far if there is nothing to receive.
+void DlgSubscriber::return_credit(bool isIdle)
+{
+  uint32_t messages = m_consumedMessages.load();
+  if (messages == 0)
+    return;
+  if (!isIdle && messages < m_creditMessages/2)
+    return;
+  messages = m_consumedMessages.exchange(0);
+  uint32_t bytes = m_consumedBytes.exchange(0);
+  grant_credit(messages, m_creditBytes ? bytes : 0);
+}
+
 void DlgSubscriber::close_connection()
 {
+  m_isBrokerConnected = false;
+  m_isConnected = false;
   if (m_socket)
     m_socket->close();
   delete m_socket;
   m_socket = nullptr;
+  m_endpoint.clear();
 }
 
 bool DlgSubscriber::connect_to(const char *name)
 {
-  if (IsConnected())
+  if (m_socket)
     close_connection();
 
-  m_socket = ZMQ::Instance()->CreateSocket(ZMQ_DEALER);
-  m_socket->setsockopt(ZMQ_IDENTITY, m_name.c_str(), m_name.size()+1);
+  //the endpoint may come from the network (a broker port): a bad one is
+  //an error of this connection, the thread goes on
   char endpoint[256];
   try
     {
-      sprintf(endpoint, "tcp://%s", name);
+      if (snprintf(endpoint, sizeof(endpoint), "tcp://%s", name) >= (int)sizeof(endpoint))
+        {
+          Print(DBG_LEVEL_ERROR, "DlgSubscriber::connect_to(): endpoint '%s' is too long\n", name);
+          return false;
+        }
+      m_socket = ZMQ::Instance()->CreateSocket(ZMQ_DEALER, SOCKET_CLIENT);
+      m_socket->setsockopt(ZMQ_IDENTITY, m_name.c_str(), m_name.size()+1);
       m_socket->connect(endpoint);
     }
   catch(zmq::error_t& e)
     {
       Print(DBG_LEVEL_ERROR, "DlgSubscriber::connect_to(): zmq::exception %s\n", e.what());
-      throw Exception("DlgSubscriber::connect_to(): fatal error.");
+      close_connection();
+      return false;
     }
   catch(std::exception& e)
     {
       Print(DBG_LEVEL_ERROR, "DlgSubscriber::connect_to(): std::exception %s\n", e.what());
-      throw Exception("DlgSubscriber::connect_to(): fatal error.");
+      close_connection();
+      return false;
     }
   catch(...)
     {
       Print(DBG_LEVEL_ERROR, "DlgSubscriber::connect_to(): unknown exeption.\n");
-      throw Exception("DlgSubscriber::connect_to(): fatal error.");
+      close_connection();
+      return false;
     }
+  m_endpoint = name;
+  m_isConnected = true;
+  //out of CLIENT_DISCONNECTED, or a handshake with another peer
+  m_wakeup.Signal();
   return true;
 }
 
@@ -306,20 +1149,181 @@ bool DlgSubscriber::subscribe_to_service(DlgMessage *msg)
                         "Get broker port : '%s'.\n",
         brokerPort.c_str());
 
-  if (!connect_to(brokerPort.c_str()))
+  //the broker runs in a worker process and has to hear from us itself
+  DlgHeader header;
+  if (msg->GetHeader(header) && (header.flags & HEADER_FLAG_JOIN_BROKER))
+    {
+      ServiceCache::Update(m_service, brokerPort, header.epoch);
+      m_mutex.lock();
+      m_cachedEndpoint = brokerPort;
+      m_cachedEpoch    = header.epoch;
+      m_mutex.unlock();
+      subscribe_cached();
+      delete msg;
+      return true;
+    }
+
+  //the reply came from the cached broker itself, if the socket is there already
+  m_isCacheWaiting = false;
+  uint64_t epoch = 0;
+  msg->GetEpoch(epoch);
+  ServiceCache::Update(m_service, brokerPort, epoch);
+  if (brokerPort != m_endpoint && !connect_to(brokerPort.c_str()))
     {
       Print(DBG_LEVEL_ERROR,"DlgSubscriber::subscribe_to_service(): Couldn't connect to broker %s.\n", brokerPort.c_str());
       return false;
     }
+
+  //Broker sends nothing until the first credit is granted.
+  //Messages still in the queue are counted against the window.
+  m_mutex.lock();
+  uint32_t queued = (uint32_t)m_messages.Size();
+  m_mutex.unlock();
+  m_consumedMessages = 0;
+  m_consumedBytes    = 0;
+  //the filter goes first, so that no credit is spent on other keys
+  m_mutex.lock();
+  bool hasFilter = !m_keyFilter.empty();
+  m_mutex.unlock();
+  if (m_isFilterRequested.exchange(false) || hasFilter)
+    send_key_filter();
+  if (queued < m_creditMessages)
+    grant_credit(m_creditMessages - queued, m_creditBytes);
+  m_isBrokerConnected = true;
   delete msg;
   return true;
 }
 
-bool DlgSubscriber::publish_text_message(DlgMessage *msg)
+//XPUB broker is connected just like a direct publisher,
+//the connection to the server is kept
+bool DlgSubscriber::stale_epoch(DlgMessage *msg)
+{
+  uint64_t epoch = 0;
+  msg->GetEpoch(epoch);
+  //an answer to a request we have given up on already
+  if (m_isCacheWaiting && epoch == m_cachedEpoch)
+    fallback_to_server();
+  delete msg;
+  return true;
+}
+
+bool DlgSubscriber::broker_moved(DlgMessage *msg)
 {
+  uint64_t epoch = 0;
+  msg->GetEpoch(epoch);
   m_mutex.lock();
-  m_messages.push(msg);
+  m_cachedEpoch = epoch;
   m_mutex.unlock();
+  fallback_to_server();
+  delete msg;
+  return true;
+}
+
+bool DlgSubscriber::subscribe_to_xpub(DlgMessage *msg)
+{
+  std::string xpubPort;
+  if (!msg->GetMessageBody(xpubPort))
+    {
+      Print(DBG_LEVEL_ERROR,"DlgSubscriber::subscribe_to_xpub(): "
+                            "Couldn't get broker port for %s service.\n",
+            m_service.c_str());
+      return false;
+    }
+  Print(DBG_LEVEL_DEBUG,"DlgSubscriber::subscribe_to_xpub(): "
+                        "Get XPUB broker port : '%s'.\n",
+        xpubPort.c_str());
+  if (!connect_direct(xpubPort.c_str()))
+    return false;
+  delete msg;
+  return true;
+}
+
+//Server keeps the subscriber connected and sends endpoints of the
+//service's publishers: all known ones first, then every new one
+bool DlgSubscriber::direct_publishers(DlgMessage *msg)
+{
+  std::string endpoints;
+  if (!msg->GetMessageBody(endpoints))
+    {
+      Print(DBG_LEVEL_ERROR,"DlgSubscriber::direct_publishers(): "
+                            "Couldn't get publishers of %s service.\n",
+            m_service.c_str());
+      return false;
+    }
+
+  size_t begin = 0;
+  while (begin < endpoints.size())
+    {
+      size_t end = endpoints.find(';', begin);
+      if (end == std::string::npos)
+        end = endpoints.size();
+      if (end > begin && !connect_direct(endpoints.substr(begin, end - begin).c_str()))
+        return false;
+      begin = end + 1;
+    }
+  delete msg;
+  return true;
+}
+
+bool DlgSubscriber::connect_direct(const char *endpoint)
+{
+  for (size_t i = 0; i < m_directEndpoints.size(); i++)
+    if (m_directEndpoints[i] == endpoint)
+      return true;
+
+  char address[256];
+  try
+    {
+      if (!m_directSocket)
+        {
+          m_directSocket = ZMQ::Instance()->CreateSocket(ZMQ_SUB, SOCKET_DIRECT);
+          //Publishers' first frame is the service name with its size prefix
+          uint32_t size = m_service.size() + 1;
+          std::string filter((const char*)&size, sizeof(size));
+          filter.append(m_service.c_str(), size);
+          m_directSocket->setsockopt(ZMQ_SUBSCRIBE, filter.data(), filter.size());
+        }
+      sprintf(address, "tcp://%s", endpoint);
+      m_directSocket->connect(address);
+    }
+  catch(zmq::error_t& e)
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::connect_direct(): zmq::exception %s\n", e.what());
+      return false;
+    }
+  m_directEndpoints.push_back(endpoint);
+  Print(DBG_LEVEL_DEBUG, "DlgSubscriber::connect_direct(): %s is connected to publisher '%s'.\n",
+        m_name.c_str(), endpoint);
+  return true;
+}
+
+void DlgSubscriber::close_direct()
+{
+  if (m_directSocket)
+    m_directSocket->close();
+  delete m_directSocket;
+  m_directSocket = nullptr;
+  m_directEndpoints.clear();
+}
+
+bool DlgSubscriber::publish_batch_message(DlgMessage *msg)
+{
+  std::vector<DlgMessage*> messages;
+  bool isUnpacked = DlgBatch::Unpack(msg, messages);
+  for (size_t i = 0; i < messages.size(); i++)
+    push_message(messages[i]);
+  if (!isUnpacked)
+    {
+      Print(DBG_LEVEL_ERROR,"DlgSubscriber::publish_batch_message(): bad batch received.\n");
+      return false;
+    }
+  delete msg;
+  return true;
+}
+
+bool DlgSubscriber::publish_text_message(DlgMessage *msg)
+{
+  push_message(msg);
 
   std::string msgBody;
   if(msg->GetMessageBody(msgBody))
@@ -334,11 +1338,16 @@ bool DlgSubscriber::publish_text_message(DlgMessage *msg)
   return true;
 }
 
+//Requests are queued with the published messages, see Reply()
+bool DlgSubscriber::request_message(DlgMessage *msg)
+{
+  push_message(msg);
+  return true;
+}
+
 bool DlgSubscriber::publish_binary_message(DlgMessage *msg)
 {
-  m_mutex.lock();
-  m_messages.push(msg);
-  m_mutex.unlock();
+  push_message(msg);
 
   void *buf = nullptr;
   size_t size = 0;
@@ -354,4 +1363,277 @@ bool DlgSubscriber::publish_binary_message(DlgMessage *msg)
   return true;
 }
 
+//Services of AddService()
+
+bool DlgSubscriber::AddService(const std::string &serviceName)
+{
+  if (m_server.empty() || serviceName.empty() || serviceName == m_service)
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::AddService(): Subscriber %s cannot add service '%s'.\n",
+            m_name.c_str(), serviceName.c_str());
+      return false;
+    }
+  std::lock_guard<std::mutex> lock(m_linkMutex);
+  m_linkRequests.push_back(std::make_pair(serviceName, true));
+  m_isLinkRequested = true;
+  m_wakeup.Signal();
+  return true;
+}
+
+bool DlgSubscriber::RemoveService(const std::string &serviceName)
+{
+  std::lock_guard<std::mutex> lock(m_linkMutex);
+  m_linkRequests.push_back(std::make_pair(serviceName, false));
+  m_isLinkRequested = true;
+  m_wakeup.Signal();
+  return true;
+}
+
+std::vector<std::string> DlgSubscriber::GetServices()
+{
+  std::vector<std::string> services;
+  if (!m_service.empty())
+    services.push_back(m_service);
+  std::lock_guard<std::mutex> lock(m_linkMutex);
+  for (size_t i = 0; i < m_links.Size(); i++)
+    services.push_back(m_links.At(i).first);
+  return services;
+}
+
+//Messages of the service still in the queue are kept and credit for them is lost
+void DlgSubscriber::update_links()
+{
+  std::vector<link_t*> closed;
+  m_linkMutex.lock();
+  std::vector<std::pair<std::string, bool> > requests;
+  requests.swap(m_linkRequests);
+  std::vector<link_t*> added;
+  for (size_t i = 0; i < requests.size(); i++)
+    {
+      const std::string &service = requests[i].first;
+      link_t **known = m_links.Find(service);
+      if (requests[i].second && !known)
+        {
+          link_t *link = new link_t;
+          link->service           = service;
+          link->identity          = m_name + "/" + service;
+          link->socket            = nullptr;
+          link->isBrokerConnected = false;
+          link->consumedMessages  = 0;
+          link->consumedBytes     = 0;
+          m_links.Insert(service, link);
+          added.push_back(link);
+        }
+      else if (requests[i].second && !(*known)->socket)
+        added.push_back(*known);   // its connection failed, once more
+      else if (!requests[i].second && known)
+        {
+          closed.push_back(*known);
+          added.erase(std::remove(added.begin(), added.end(), *known), added.end());
+          m_links.Erase(service);
+        }
+    }
+  m_hasLinks = !m_links.Empty();
+  m_linkMutex.unlock();
+
+  for (size_t i = 0; i < closed.size(); i++)
+    close_link(closed[i]);
+  for (size_t i = 0; i < added.size(); i++)
+    link_subscribe(added[i], m_server, 0);
+}
+
+//Epoch 0 goes to the server, anything else to the broker itself
+void DlgSubscriber::link_subscribe(link_t *link, const std::string &endpoint, uint64_t epoch)
+{
+  if (link->socket)
+    link->socket->close();
+  delete link->socket;
+  link->isBrokerConnected = false;
+  link->socket = ZMQ::Instance()->CreateSocket(ZMQ_DEALER, SOCKET_CLIENT);
+  link->socket->setsockopt(ZMQ_IDENTITY, link->identity.c_str(), link->identity.size()+1);
+  char address[256];
+  sprintf(address, "tcp://%s", endpoint.c_str());
+  try
+    {
+      link->socket->connect(address);
+    }
+  catch(zmq::error_t& e)
+    {
+      Print(DBG_LEVEL_ERROR, "DlgSubscriber::link_subscribe(): zmq::exception %s\n", e.what());
+      //not polled anymore, AddService() again to retry
+      link->socket->close();
+      delete link->socket;
+      link->socket = nullptr;
+      link->endpoint.clear();
+      return;
+    }
+  link->endpoint = endpoint;
+
+  DlgMessage msg(link->service, link->identity, m_server, SUBSCRIBE_TO_SERVICE, std::string(""));
+  msg.SetIdentity(link->identity);
+  msg.SetEpoch(epoch);
+  if (!msg.Send(link->socket))
+    Print(DBG_LEVEL_ERROR, "DlgSubscriber::link_subscribe(): %s couldn't subscribe at service %s.\n",
+          m_name.c_str(), link->service.c_str());
+}
+
+void DlgSubscriber::close_link(link_t *link)
+{
+  if (link->socket)
+    link->socket->close();
+  delete link->socket;
+  delete link;
+}
+
+void DlgSubscriber::receive_link(link_t *link)
+{
+  DlgMessage *msg = new DlgMessage();
+  if (!msg->Recv(link->socket))
+    {
+      Print(DBG_LEVEL_ERROR,"DlgSubscriber::receive_link(): message receiving error.\n");
+      delete msg;
+      return;
+    }
+  uint32_t msgType = 0;
+  if (!msg->GetMessageType(msgType))
+    {
+      Print(DBG_LEVEL_ERROR,"DlgSubscriber::receive_link(): bad message received(cannot get message type).\n");
+      delete msg;
+      return;
+    }
+  m_link = link;
+  link_handlers().Dispatch(this, msgType, msg, "DlgSubscriber::receive_link()");
+  m_link = nullptr;
+}
+
+//Handlers of messages over a link, m_link is the link of the message.
+//A link has a broker in BROKER_ROUTER mode and no batches of direct publishers.
+const message_registry_t<DlgSubscriber>& DlgSubscriber::link_handlers()
+{
+  static const message_registry_t<DlgSubscriber> registry = []()
+    {
+      message_registry_t<DlgSubscriber> r;
+      //reply from the server or from the broker
+      r.Register(SUBSCRIBE_TO_SERVICE,   &DlgSubscriber::link_subscribed,   "subscribe link");
+      //the broker doesn't serve the service anymore, ask the server
+      r.Register(STALE_EPOCH,            &DlgSubscriber::link_moved,        "resubscribe link");
+      r.Register(BROKER_MOVED,           &DlgSubscriber::link_moved,        "resubscribe link");
+      r.Register(SUBSCRIBE_TO_XPUB,      &DlgSubscriber::link_no_broker,    "subscribe link");
+      r.Register(DIRECT_PUBLISHERS,      &DlgSubscriber::link_no_broker,    "subscribe link");
+      r.Register(PUBLISH_TEXT_MESSAGE,   &DlgSubscriber::publish_text_message, "publish text message");
+      r.Register(PUBLISH_BINARY_MESSAGE, &DlgSubscriber::publish_binary_message, "publish binary message");
+      r.Register(REQUEST_MESSAGE,        &DlgSubscriber::request_message,   "queue request");
+      return r;
+    }();
+  return registry;
+}
+
+bool DlgSubscriber::link_moved(DlgMessage *msg)
+{
+  link_subscribe(m_link, m_server, 0);
+  delete msg;
+  return true;
+}
+
+bool DlgSubscriber::link_no_broker(DlgMessage *msg)
+{
+  Print(DBG_LEVEL_ERROR,"DlgSubscriber::receive_link(): %s has no broker, use its own subscriber.\n",
+        m_link->service.c_str());
+  delete msg;
+  return true;
+}
+
+bool DlgSubscriber::link_subscribed(DlgMessage *msg)
+{
+  link_t *link = m_link;
+  std::string brokerPort;
+  if (!msg->GetMessageBody(brokerPort))
+    return false;
+  DlgHeader header;
+  if (!msg->GetHeader(header))
+    return false;
+  //a reply of the server: the broker confirms the subscription itself
+  //(it may run in a worker process and not know about us yet)
+  if ((header.flags & HEADER_FLAG_JOIN_BROKER) || brokerPort != link->endpoint)
+    {
+      link_subscribe(link, brokerPort, header.epoch);
+      delete msg;
+      return true;
+    }
+
+  //the broker sends nothing until the first credit is granted
+  link->consumedMessages = 0;
+  link->consumedBytes    = 0;
+  DlgCredit credit = { m_creditMessages, m_creditBytes };
+  DlgMessage grant(link->service, link->identity, std::string(""), GRANT_CREDIT, std::string(""));
+  if (!grant.SetMessageBuffer(&credit, sizeof(credit)) || !grant.Send(link->socket))
+    Print(DBG_LEVEL_ERROR, "DlgSubscriber::link_subscribed(): couldn't grant credit for %s.\n", link->service.c_str());
+  link->isBrokerConnected = true;
+  delete msg;
+  return true;
+}
+
+//As return_credit() for m_socket
+void DlgSubscriber::link_return_credit(link_t *link, bool isIdle)
+{
+  uint32_t messages = link->consumedMessages.load();
+  if (messages == 0 || (!isIdle && messages < m_creditMessages/2))
+    return;
+  messages = link->consumedMessages.exchange(0);
+  uint32_t bytes = link->consumedBytes.exchange(0);
+  DlgCredit credit = { messages, m_creditBytes ? bytes : 0 };
+  DlgMessage grant(link->service, link->identity, std::string(""), GRANT_CREDIT, std::string(""));
+  if (!grant.SetMessageBuffer(&credit, sizeof(credit)) || !grant.Send(link->socket))
+    Print(DBG_LEVEL_ERROR, "DlgSubscriber::link_return_credit(): couldn't grant credit for %s.\n", link->service.c_str());
+}
+
+//Credit goes back to the broker the message came from. The first message
+//consumed wakes the thread, which then returns credit on its timeout.
+void DlgSubscriber::count_consumed(DlgMessage *msg)
+{
+  uint32_t size = (uint32_t)msg->GetSize();
+  if (m_hasLinks)
+    {
+      std::string service;
+      msg->GetServiceName(service);
+      if (service != m_service)
+        {
+          std::lock_guard<std::mutex> lock(m_linkMutex);
+          link_t **link = m_links.Find(service);
+          if (link)
+            {
+              (*link)->consumedBytes += size;
+              if ((*link)->consumedMessages++ == 0)
+                m_wakeup.Notify();
+            }
+          return;
+        }
+    }
+  m_consumedBytes += size;
+  if (m_consumedMessages++ == 0)
+    m_wakeup.Notify();
+}
+
+//The application takes msg: the last stamp, and the hops go to m_latency
+void DlgSubscriber::stamp_dequeued(DlgMessage *msg)
+{
+  DlgHeader header;
+  if (!msg->GetHeader(header) || !(header.flags & HEADER_FLAG_TIMED) ||
+      header.host != latency_clock_t::HostId())
+    return;
+  header.stamps[STAMP_DEQUEUE] = latency_clock_t::Now();
+  msg->SetHeader(header);
+  const uint64_t *stamps = header.stamps;
+  m_latency[HOP_PUBLISH_TO_BROKER].RecordSpan(stamps[STAMP_PUBLISH], stamps[STAMP_BROKER_IN]);
+  m_latency[HOP_IN_BROKER].RecordSpan(stamps[STAMP_BROKER_IN], stamps[STAMP_BROKER_OUT]);
+  m_latency[HOP_BROKER_TO_DEQUEUE].RecordSpan(stamps[STAMP_BROKER_OUT], stamps[STAMP_DEQUEUE]);
+  m_latency[HOP_END_TO_END].RecordSpan(stamps[STAMP_PUBLISH], stamps[STAMP_DEQUEUE]);
+}
+
+void DlgSubscriber::ResetLatency()
+{
+  for (int i = 0; i < N_LATENCY_HOPS; i++)
+    m_latency[i].Reset();
+}
+
 }//end of namespace
@@ -0,0 +1,58 @@
+#include "ServiceCache.h"
+#include "Debug.h"
+
+namespace ZmqDialog
+{
+  std::map<std::string, ServiceCache::entry_t> ServiceCache::m_entries;
+  std::mutex                                   ServiceCache::m_mutex;
+  bool                                         ServiceCache::m_isEnabled = true;
+
+  void ServiceCache::Enable(bool isEnabled)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_isEnabled = isEnabled;
+    if(!isEnabled)
+      m_entries.clear();
+  }
+
+  bool ServiceCache::Find(const std::string& service, std::string& endpoint, uint64_t& epoch)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<std::string, entry_t>::iterator it = m_entries.find(service);
+    if(it == m_entries.end())
+      return false;
+    endpoint = it->second.endpoint;
+    epoch    = it->second.epoch;
+    return true;
+  }
+
+  void ServiceCache::Update(const std::string& service, const std::string& endpoint, uint64_t epoch)
+  {
+    if(epoch == 0)
+      return;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(!m_isEnabled)
+      return;
+    entry_t& entry = m_entries[service];
+    entry.endpoint = endpoint;
+    entry.epoch    = epoch;
+  }
+
+  void ServiceCache::Invalidate(const std::string& service, uint64_t epoch)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<std::string, entry_t>::iterator it = m_entries.find(service);
+    if(it != m_entries.end() && it->second.epoch == epoch)
+      {
+	Print(DBG_LEVEL_DEBUG, "ServiceCache: entry of '%s' is stale\n", service.c_str());
+	m_entries.erase(it);
+      }
+  }
+
+  void ServiceCache::Clear()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+  }
+
+} // namespace ZmqDialog
@@ -0,0 +1,24 @@
+#ifndef __CHECK_H__
+#define __CHECK_H__
+
+#include <stdio.h>
+
+//Checks of the unit tests: a failed one is reported and counted, the test
+//goes on and its main() returns CHECK_RESULT() as the exit code
+static int check_failures = 0;
+
+#define CHECK(cond)                                                     \
+  do                                                                    \
+    {                                                                   \
+      if (!(cond))                                                      \
+        {                                                               \
+          fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+          check_failures++;                                             \
+        }                                                               \
+    }                                                                   \
+  while (0)
+
+#define CHECK_RESULT(name)                                              \
+  (printf("%s: %s\n", name, check_failures ? "FAILED" : "passed"), check_failures ? 1 : 0)
+
+#endif // __CHECK_H__
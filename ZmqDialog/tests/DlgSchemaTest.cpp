@@ -0,0 +1,126 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+//Generated by dlgschema from tests/Quote.schema and tests/QuoteV1.schema,
+//see the test target of the Makefile. Both declare ZmqDialog::Quote, so
+//the old one goes to a namespace of its own.
+#include "Quote.h"
+namespace v1
+{
+  using namespace ZmqDialog;
+#include "QuoteV1.h"
+}
+#include "Check.h"
+
+using namespace ZmqDialog;
+
+typedef v1::ZmqDialog::Quote QuoteV1;
+
+template <class Builder>
+static std::vector<uint8_t> write(const Builder& builder)
+{
+  std::vector<uint8_t> payload(builder.Size());
+  builder.Write(&payload[0]);
+  return payload;
+}
+
+static void test_layout()
+{
+  CHECK(Quote::ID == QuoteV1::ID);
+  CHECK(Quote::VERSION == 2 && QuoteV1::VERSION == 1);
+  CHECK(Quote::FIXED_SIZE % 8 == 0);
+  CHECK(Quote::SYMBOL == SCHEMA_PREFIX_SIZE);
+  CHECK(Quote::KEY_SLOT == Quote::SYMBOL);
+  //fields of version 1 stay where they were
+  CHECK(Quote::PRICE == QuoteV1::PRICE && Quote::QTY == QuoteV1::QTY);
+  CHECK(Quote::VENUE >= QuoteV1::QTY + 4);
+}
+
+static void test_round_trip()
+{
+  Quote::Builder builder;
+  builder.symbol("EURUSD").price(1.0825).qty(1000000).venue("LMAX").flags(3);
+  std::vector<uint8_t> payload = write(builder);
+  CHECK(payload.size() == Quote::FIXED_SIZE + 6 + 4);
+
+  Quote::Reader reader(&payload[0], payload.size());
+  CHECK(reader.IsValid());
+  CHECK(reader.GetVersion() == 2);
+  CHECK(reader.symbol() == "EURUSD");
+  CHECK(reader.price() == 1.0825);
+  CHECK(reader.qty() == 1000000);
+  CHECK(reader.venue() == "LMAX");
+  CHECK(reader.flags() == 3);
+
+  schema_bytes_t key = { "", 0 };
+  CHECK(SchemaReader::RoutingKey(&payload[0], payload.size(), key));
+  CHECK(key == "EURUSD");
+
+  //not a Quote, or too short to be anything
+  uint32_t other = Quote::ID + 1;
+  memcpy(&payload[0], &other, sizeof(other));
+  CHECK(!Quote::Reader(&payload[0], payload.size()).IsValid());
+  CHECK(!Quote::Reader(&payload[0], SCHEMA_PREFIX_SIZE - 1).IsValid());
+  CHECK(!SchemaReader::RoutingKey(&payload[0], SCHEMA_PREFIX_SIZE - 1, key));
+}
+
+//An old writer: the new reader takes the defaults of the fields it added
+static void test_old_writer()
+{
+  QuoteV1::Builder builder;
+  builder.symbol("USDJPY").price(151.5).qty(42);
+  std::vector<uint8_t> payload = write(builder);
+
+  Quote::Reader reader(&payload[0], payload.size());
+  CHECK(reader.IsValid());
+  CHECK(reader.GetVersion() == 1);
+  CHECK(reader.symbol() == "USDJPY");
+  CHECK(reader.price() == 151.5);
+  CHECK(reader.qty() == 42);
+  CHECK(reader.venue().size == 0);
+  CHECK(reader.flags() == 0);
+}
+
+//An old reader skips what it doesn't know
+static void test_old_reader()
+{
+  Quote::Builder builder;
+  builder.symbol("GBPUSD").price(1.27).qty(7).venue("EBS").flags(1);
+  std::vector<uint8_t> payload = write(builder);
+
+  QuoteV1::Reader reader(&payload[0], payload.size());
+  CHECK(reader.IsValid());
+  CHECK(reader.GetVersion() == 2);
+  CHECK(reader.symbol() == "GBPUSD");
+  CHECK(reader.price() == 1.27);
+  CHECK(reader.qty() == 7);
+}
+
+static void test_message()
+{
+  DlgMessage msg(std::string("Quotes"), std::string("test"), std::string(""),
+                 PUBLISH_BINARY_MESSAGE, std::string(""));
+  Quote::Builder builder;
+  builder.symbol("AUDUSD").qty(5);
+  CHECK(builder.Write(&msg));
+
+  DlgHeader header;
+  CHECK(msg.GetHeader(header) && (header.flags & HEADER_FLAG_SCHEMA));
+  Quote::Reader reader(&msg);
+  CHECK(reader.IsValid());
+  CHECK(reader.symbol() == "AUDUSD");
+  CHECK(reader.qty() == 5);
+  CHECK(reader.venue() == "");
+}
+
+int main()
+{
+  test_layout();
+  test_round_trip();
+  test_old_writer();
+  test_old_reader();
+  test_message();
+  return CHECK_RESULT("DlgSchemaTest");
+}
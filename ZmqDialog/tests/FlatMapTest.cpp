@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <map>
+#include <string>
+
+#include "FlatMap.h"
+#include "Check.h"
+
+using namespace ZmqDialog;
+
+static void test_basic()
+{
+  flat_map_t<int> map;
+  bool isInserted = false;
+  CHECK(map.Empty());
+  CHECK(map.Find("a") == nullptr);
+  CHECK(!map.Erase("a"));
+
+  map.Insert("a", 1, &isInserted);
+  CHECK(isInserted);
+  //an existing key keeps its value
+  CHECK(map.Insert("a", 2, &isInserted) == 1);
+  CHECK(!isInserted);
+  CHECK(map.Size() == 1);
+
+  //lookups by a frame which isn't terminated
+  const char frame[] = { 'a', 'b', 'c' };
+  map.Insert(std::string("ab"), 3);
+  CHECK(map.Find(key_view_t(frame, 1)) && *map.Find(key_view_t(frame, 1)) == 1);
+  CHECK(map.Find(key_view_t(frame, 2)) && *map.Find(key_view_t(frame, 2)) == 3);
+  CHECK(!map.Contains(key_view_t(frame, 3)));
+  CHECK(map.IndexOf("ab") == 1);
+  CHECK(map.At(1).first == "ab");
+
+  map.Clear();
+  CHECK(map.Empty());
+  CHECK(!map.Contains("a"));
+}
+
+//The last entry moves into the hole of an erased one
+static void test_erase_at()
+{
+  flat_map_t<int> map;
+  map.Insert("x", 0);
+  map.Insert("y", 1);
+  map.Insert("z", 2);
+  map.EraseAt(0);
+  CHECK(map.Size() == 2);
+  CHECK(map.At(0).first == "z");
+  CHECK(map.IndexOf("z") == 0);
+  CHECK(map.IndexOf("y") == 1);
+  CHECK(!map.Contains("x"));
+}
+
+//Against std::map through growth and random erases, probe chains included
+static void test_random()
+{
+  flat_map_t<int>            map;
+  std::map<std::string, int> reference;
+  srand(12345);
+  for (int i = 0; i < 20000; i++)
+    {
+      char key[16];
+      snprintf(key, sizeof(key), "service%d", rand() % 2000);
+      if (rand() % 3 == 0)
+        CHECK(map.Erase(key) == (reference.erase(key) == 1));
+      else
+        {
+          bool isInserted = false;
+          map.Insert(key, i, &isInserted);
+          CHECK(isInserted == reference.insert(std::make_pair(std::string(key), i)).second);
+        }
+    }
+  CHECK(map.Size() == reference.size());
+
+  std::map<std::string, int>::iterator it;
+  for (it = reference.begin(); it != reference.end(); ++it)
+    {
+      int *value = map.Find(it->first);
+      CHECK(value && *value == it->second);
+    }
+  size_t n = 0;
+  for (flat_map_t<int>::iterator e = map.begin(); e != map.end(); ++e, ++n)
+    CHECK(reference.count(e->first) == 1);
+  CHECK(n == reference.size());
+
+  for (it = reference.begin(); it != reference.end(); ++it)
+    CHECK(map.Erase(it->first));
+  CHECK(map.Empty());
+}
+
+int main()
+{
+  test_basic();
+  test_erase_at();
+  test_random();
+  return CHECK_RESULT("FlatMapTest");
+}
@@ -0,0 +1,85 @@
+#include <stdint.h>
+
+#include "Latency.h"
+#include "Check.h"
+
+using namespace ZmqDialog;
+
+//A percentile is the highest value of its bucket: within 1/32 above the true one
+static bool is_close(uint64_t value, uint64_t expected)
+{
+  return value >= expected && value <= expected + expected / 32;
+}
+
+static void test_exact()
+{
+  latency_histogram_t h;
+  CHECK(h.GetCount() == 0);
+  CHECK(h.GetPercentile(50.0) == 0);
+  for (uint64_t ns = 1; ns <= 20; ns++)
+    h.Record(ns);
+  CHECK(h.GetCount() == 20);
+  CHECK(h.GetMax() == 20);
+  CHECK(h.GetPercentile(50.0) == 10);
+  CHECK(h.GetPercentile(100.0) == 20);
+  CHECK(h.GetPercentile(0.0) == 1);
+}
+
+static void test_percentiles()
+{
+  latency_histogram_t h;
+  for (uint64_t i = 1; i <= 100000; i++)
+    h.Record(i * 100);  // 100ns .. 10ms
+
+  latency_summary_t s = h.GetSummary();
+  CHECK(s.count == 100000);
+  CHECK(s.max == 10000000);
+  CHECK(is_close(s.p50, 5000000));
+  CHECK(is_close(s.p99, 9900000));
+  CHECK(is_close(s.p999, 9990000));
+  //never above the largest record
+  CHECK(h.GetPercentile(100.0) == s.max);
+
+  //beyond the last bucket it is still counted, and the max is exact
+  h.Record((uint64_t)1 << 50);
+  CHECK(h.GetMax() == (uint64_t)1 << 50);
+  CHECK(h.GetPercentile(100.0) == (uint64_t)1 << 50);
+
+  h.Reset();
+  CHECK(h.GetCount() == 0);
+  CHECK(h.GetMax() == 0);
+  CHECK(h.GetPercentile(99.0) == 0);
+}
+
+static void test_spans()
+{
+  latency_histogram_t h;
+  h.RecordSpan(0, 1000);     // not stamped at the start
+  h.RecordSpan(2000, 1000);  // not stamped at the end, or another clock
+  CHECK(h.GetCount() == 0);
+
+  uint64_t from = latency_clock_t::Now();
+  uint64_t to   = latency_clock_t::Now();
+  CHECK(to >= from);
+  h.RecordSpan(1000, 1000 + 300);
+  CHECK(h.GetCount() == 1);
+#if !LATENCY_CLOCK_TSC
+  CHECK(h.GetMax() == 300);
+#endif
+}
+
+static void test_host()
+{
+  uint64_t id = latency_clock_t::HostId();
+  CHECK(id != 0);
+  CHECK(latency_clock_t::HostId() == id);
+}
+
+int main()
+{
+  test_exact();
+  test_percentiles();
+  test_spans();
+  test_host();
+  return CHECK_RESULT("LatencyTest");
+}
@@ -0,0 +1,104 @@
+#include <stdint.h>
+
+#include <string>
+
+#include "MessageRegistry.h"
+#include "Check.h"
+
+using namespace ZmqDialog;
+
+//Tells whether the registry deleted a message
+static int destroyed = 0;
+
+class counted_message_t : public DlgMessage
+{
+public:
+  counted_message_t(uint32_t msgType)
+    : DlgMessage(std::string("service"), std::string("from"), std::string("to"), msgType, std::string("body")) {}
+  ~counted_message_t() { destroyed++; }
+};
+
+//Owner of built-in handlers, as a broker or a client would be
+struct owner_t
+{
+  int handled;
+  owner_t() : handled(0) {}
+
+  bool take(DlgMessage* msg)
+  {
+    handled++;
+    delete msg;
+    return true;
+  }
+
+  bool fail(DlgMessage*)
+  {
+    handled++;
+    return false;
+  }
+};
+
+static void test_methods()
+{
+  message_registry_t<owner_t> registry;
+  owner_t owner;
+  CHECK(registry.Register(REGISTER_PUBLISHER, &owner_t::take, "take"));
+  CHECK(registry.Register(STALE_EPOCH, &owner_t::fail, "fail", 7));
+  CHECK(registry.Find(REGISTER_PUBLISHER) != nullptr);
+  CHECK(registry.Find(STALE_EPOCH)->flags == 7);
+  CHECK(registry.Find(BROKER_MOVED) == nullptr);
+  CHECK(registry.Find(MESSAGE_TYPE_MAX + 1) == nullptr);
+
+  destroyed = 0;
+  registry.Dispatch(&owner, REGISTER_PUBLISHER, new counted_message_t(REGISTER_PUBLISHER), "test");
+  CHECK(owner.handled == 1 && destroyed == 1);
+
+  //false: the registry deletes the message
+  registry.Dispatch(&owner, STALE_EPOCH, new counted_message_t(STALE_EPOCH), "test");
+  CHECK(owner.handled == 2 && destroyed == 2);
+
+  //no handler: dropped
+  registry.Dispatch(&owner, BROKER_MOVED, new counted_message_t(BROKER_MOVED), "test");
+  CHECK(owner.handled == 2 && destroyed == 3);
+
+  CHECK(registry.Unregister(STALE_EPOCH));
+  CHECK(!registry.Unregister(STALE_EPOCH));
+  CHECK(registry.Find(STALE_EPOCH) == nullptr);
+}
+
+static void test_handlers()
+{
+  message_registry_t<owner_t> registry;
+  owner_t owner;
+  const uint32_t type = MESSAGE_TYPE_USER + 1;
+  int calls = 0;
+  CHECK(!registry.Register(MESSAGE_TYPE_MAX, [](DlgMessage*) { return true; }, "out of range"));
+  CHECK(!registry.Register(type, message_registry_t<owner_t>::handler_t(), "empty"));
+  CHECK(registry.Register(type, &owner_t::take, "take"));
+  //a handler replaces the method of its type
+  CHECK(registry.Register(type, [&calls](DlgMessage* msg)
+    {
+      calls++;
+      uint32_t msgType = 0;
+      bool isOk = msg->GetMessageType(msgType) && msgType == MESSAGE_TYPE_USER + 1;
+      delete msg;
+      return isOk;
+    }, "count"));
+
+  destroyed = 0;
+  registry.Dispatch(&owner, type, new counted_message_t(type), "test");
+  CHECK(calls == 1 && owner.handled == 0 && destroyed == 1);
+
+  const message_registry_t<owner_t>::entry_t* e = registry.Find(type);
+  CHECK(e && !e->method && e->handler);
+  registry.Call(&owner, e, new counted_message_t(type), "test");
+  CHECK(calls == 2 && destroyed == 2);
+}
+
+int main()
+{
+  DLG_DEBUG_LEVEL = -1;  // the registry reports the failures on purpose
+  test_methods();
+  test_handlers();
+  return CHECK_RESULT("MessageRegistryTest");
+}
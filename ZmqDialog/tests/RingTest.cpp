@@ -0,0 +1,168 @@
+#include <stdint.h>
+
+#include <thread>
+#include <vector>
+
+#include "Ring.h"
+#include "Check.h"
+
+using namespace ZmqDialog;
+
+static void test_capacity()
+{
+  CHECK(ring_capacity(0) == 2);
+  CHECK(ring_capacity(1) == 2);
+  CHECK(ring_capacity(5) == 8);
+  CHECK(ring_capacity(8) == 8);
+
+  spsc_ring_t<int> spsc(5);
+  mpmc_ring_t<int> mpmc(100);
+  CHECK(spsc.Capacity() == 8);
+  CHECK(mpmc.Capacity() == 128);
+}
+
+//Fills the ring, then goes around it many times: FIFO and no more than
+//Capacity() items
+template <class Ring>
+static void test_fifo()
+{
+  Ring ring(4);
+  int item = -1;
+  CHECK(ring.Empty());
+  CHECK(!ring.TryPop(item));
+  for (int i = 0; i < 4; i++)
+    CHECK(ring.TryPush(i));
+  CHECK(!ring.TryPush(4));
+  CHECK(ring.Size() == 4);
+  for (int i = 0; i < 4; i++)
+    CHECK(ring.TryPop(item) && item == i);
+  CHECK(ring.Empty());
+
+  int next = 0;
+  for (int i = 0; i < 1000; i++)
+    {
+      CHECK(ring.TryPush(i));
+      if (i % 3 == 2)
+        while (ring.TryPop(item))
+          CHECK(item == next++);
+    }
+  while (ring.TryPop(item))
+    CHECK(item == next++);
+  CHECK(next == 1000);
+}
+
+static void test_spsc_threads()
+{
+  const uint64_t N = 100000;
+  spsc_ring_t<uint64_t> ring(64);
+  std::thread producer([&]()
+    {
+      for (uint64_t i = 0; i < N; i++)
+        while (!ring.TryPush(i))
+          std::this_thread::yield();
+    });
+  uint64_t next = 0;
+  bool isOrdered = true;
+  while (next < N)
+    {
+      uint64_t item;
+      if (!ring.TryPop(item))
+        {
+          std::this_thread::yield();
+          continue;
+        }
+      isOrdered = isOrdered && item == next;
+      next++;
+    }
+  producer.join();
+  CHECK(isOrdered);
+  CHECK(ring.Empty());
+}
+
+//Every item comes out once, and items of one producer in its order
+static void test_mpmc_threads()
+{
+  const int      N_PRODUCERS = 4;
+  const int      N_CONSUMERS = 4;
+  const uint64_t N           = 50000;   // per producer
+  mpmc_ring_t<uint64_t> ring(128);
+
+  std::vector<std::thread> threads;
+  for (int p = 0; p < N_PRODUCERS; p++)
+    threads.push_back(std::thread([&ring, p]()
+      {
+        for (uint64_t i = 0; i < N; i++)
+          while (!ring.TryPush(((uint64_t)p << 32) | i))
+            std::this_thread::yield();
+      }));
+
+  std::atomic<uint64_t> popped(0);
+  std::atomic<uint64_t> sum(0);
+  std::atomic<bool>     isOrdered(true);
+  for (int c = 0; c < N_CONSUMERS; c++)
+    threads.push_back(std::thread([&]()
+      {
+        std::vector<int64_t> last(N_PRODUCERS, -1);
+        uint64_t item;
+        while (popped < N * N_PRODUCERS)
+          {
+            if (!ring.TryPop(item))
+              {
+                std::this_thread::yield();
+                continue;
+              }
+            int      p = (int)(item >> 32);
+            int64_t  i = (int64_t)(item & 0xffffffff);
+            if (i <= last[p])
+              isOrdered = false;
+            last[p] = i;
+            sum += (uint64_t)i;
+            popped++;
+          }
+      }));
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+
+  CHECK(popped == N * N_PRODUCERS);
+  CHECK(sum == N_PRODUCERS * (N * (N - 1) / 2));
+  CHECK(isOrdered);
+  CHECK(ring.Empty());
+}
+
+static void test_lanes()
+{
+  ring_lanes_t<int, spsc_ring_t<int> > lanes(4);
+  int item = -1;
+  CHECK(lanes.Empty());
+  CHECK(lanes.TryPush(1, PRIORITY_LOW));
+  CHECK(lanes.TryPush(2, PRIORITY_NORMAL));
+  CHECK(lanes.TryPush(3, PRIORITY_HIGH));
+  CHECK(lanes.TryPush(4, 77));             // unknown, the lowest lane
+  CHECK(lanes.TryPush(5, PRIORITY_HIGH));
+  CHECK(lanes.Size() == 5);
+
+  //the oldest of one lane
+  CHECK(lanes.TryPop(item, PRIORITY_LOW) && item == 1);
+
+  int expected[] = { 3, 5, 2, 4 };
+  for (int i = 0; i < 4; i++)
+    CHECK(lanes.TryPop(item) && item == expected[i]);
+  CHECK(!lanes.TryPop(item));
+  CHECK(lanes.Empty());
+
+  for (int i = 0; i < 4; i++)
+    CHECK(lanes.TryPush(i, PRIORITY_NORMAL));
+  CHECK(!lanes.TryPush(4, PRIORITY_NORMAL));
+  CHECK(lanes.TryPush(4, PRIORITY_HIGH));
+}
+
+int main()
+{
+  test_capacity();
+  test_fifo<spsc_ring_t<int> >();
+  test_fifo<mpmc_ring_t<int> >();
+  test_spsc_threads();
+  test_mpmc_threads();
+  test_lanes();
+  return CHECK_RESULT("RingTest");
+}